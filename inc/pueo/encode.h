@@ -0,0 +1,140 @@
+#ifndef _PUEO_ENCODE_H
+#define _PUEO_ENCODE_H
+
+/** \file pueo/encode.h
+ *
+ * \brief Converting waveforms to and from pueo_encoded_waveform_t
+ *
+ * The samples of an encoded waveform are compressed losslessly. They are
+ * predicted from the samples before them (by the first or second difference,
+ * whichever does better, chosen every PUEO_ENCODE_BLOCK samples) and the
+ * residuals are bit-packed at the width the block needs. Waveforms that don't
+ * compress are stored raw. Which was done is in the low bits of encoded_flags.
+ *
+ * For the narrow links there's also a lossy mode (see pueo_quantize_opts_t), which
+ * requantizes (and optionally decimates) the samples before packing them, and
+ * records how far off the result can be. Decoding doesn't care which was used.
+ *
+ * This file is part of libpueorawdata, developed by the PUEO collaboration.
+ * \copyright Copyright (C) 2021-2025 PUEO Collaboration
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+ *
+ */
+
+#include <pueo/rawdata.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+/** How the samples are encoded, in encoded_flags & PUEO_ENCODING_MASK */
+enum e_pueo_encoding
+{
+  PUEO_ENCODING_RAW = 0,   // little-endian int16
+  PUEO_ENCODING_PACKED = 1, // predicted, then bit-packed in blocks (see above)
+  PUEO_ENCODING_QUANTIZED = 2 // lossy: a pueo_quantized_head_t, then the requantized samples encoded as inner says
+};
+
+#define PUEO_ENCODING_MASK 0xf
+
+/** Samples per block. Each block starts with a byte holding the bit width (low 5 bits) and whether the second difference was used (top bit),
+ * followed by the zigzagged residuals, packed least significant bit first. */
+#define PUEO_ENCODE_BLOCK 32
+
+
+/** Encodes nsamples samples into out, which has room for capacity bytes.
+ * Sets *flags to the encoding used and returns the number of bytes, or negative if they don't fit.
+ */
+int pueo_encode_samples(const int16_t * samples, int nsamples, uint8_t * out, int capacity, uint16_t * flags);
+
+/** Decodes nbytes of encoded samples (encoded as flags says) into nsamples samples.
+ * Returns nsamples, or negative if the encoded samples are malformed.
+ */
+int pueo_decode_samples(const uint8_t * in, int nbytes, uint16_t flags, int16_t * samples, int nsamples);
+
+/** Fills the channel and samples of enc from wf (run, event and readout_time are left alone). Returns encoded_nbytes or negative on error. */
+int pueo_encode_waveform(const pueo_waveform_t * wf, pueo_encoded_waveform_t * enc);
+
+/** Also fills run, event and readout_time. */
+int pueo_encode_single_waveform(const pueo_single_waveform_t * wf, pueo_encoded_waveform_t * enc);
+
+/** Decodes enc into wf (surf_word, which isn't kept, is 0). Returns the number of samples or negative on error. */
+int pueo_decode_waveform(const pueo_encoded_waveform_t * enc, pueo_waveform_t * wf);
+
+/** Also fills run, event and readout_time. Everything an encoded waveform doesn't keep is zeroed. */
+int pueo_decode_single_waveform(const pueo_encoded_waveform_t * enc, pueo_single_waveform_t * wf);
+
+
+/** How to lose information, for pueo_encode_waveform_lossy and friends */
+typedef struct pueo_quantize_opts
+{
+  uint8_t bits;       // bits per (requantized) sample, 2-16. 0 means lossless (the rest is ignored)
+  uint8_t decimation; // keep every nth sample, the rest are linearly interpolated on decoding (0 or 1 keeps them all)
+  uint16_t step;      // quantization step in ADC counts. 0 picks the smallest one that fits this waveform into bits
+  int16_t offset;     // what a requantized 0 means, if step is given (otherwise the middle of the waveform's range is used)
+} pueo_quantize_opts_t;
+
+/** What the encoded bytes of a PUEO_ENCODING_QUANTIZED waveform start with (unaligned, so memcpy it out).
+ * A requantized sample q decodes to offset + q * step. */
+typedef struct pueo_quantized_head
+{
+  int16_t offset;
+  uint16_t step;
+  uint16_t max_error;  // the largest difference between a decoded and an original sample (interpolated ones included)
+  uint8_t decimation;
+  uint8_t inner;       // the encoding of the requantized samples (PUEO_ENCODING_RAW or PUEO_ENCODING_PACKED)
+} pueo_quantized_head_t;
+
+/** Like pueo_encode_samples, but lossy as opts says (lossless if opts is NULL or opts->bits is 0), for up to PUEO_MAX_BUFFER_LENGTH samples.
+ * If max_error isn't NULL, it's set to the error bound (0 if lossless).
+ */
+int pueo_encode_samples_lossy(const int16_t * samples, int nsamples, uint8_t * out, int capacity, uint16_t * flags,
+                              const pueo_quantize_opts_t * opts, int * max_error);
+
+/** Like pueo_encode_waveform and pueo_encode_single_waveform, but lossy as opts says */
+int pueo_encode_waveform_lossy(const pueo_waveform_t * wf, pueo_encoded_waveform_t * enc, const pueo_quantize_opts_t * opts);
+int pueo_encode_single_waveform_lossy(const pueo_single_waveform_t * wf, pueo_encoded_waveform_t * enc, const pueo_quantize_opts_t * opts);
+
+/** Encodes wf with the options for its priority, opts[wf->prio.signal_level] (so e.g. thermal events can be lossy while
+ * signal-like ones stay lossless). A NULL table is lossless. The signal level is kept in enc->flags, overwriting
+ * whatever was there, so set any other flags after calling this.
+ */
+int pueo_encode_single_waveform_by_priority(const pueo_single_waveform_t * wf, pueo_encoded_waveform_t * enc, const pueo_quantize_opts_t opts[4]);
+
+/** The largest error of any decoded sample of enc: 0 if it was encoded losslessly, negative if it's malformed */
+int pueo_encoded_waveform_max_error(const pueo_encoded_waveform_t * enc);
+
+
+/** Plain bit-packing, used for the packed waveform versions (see pueo_handle_set_pack_samples).
+ * Samples are stored in two's complement at a fixed width, least significant bit first.
+ */
+
+/** The narrowest width (1-16 bits) that holds all n samples */
+int pueo_pack_width(const int16_t * samples, int n);
+
+/** Packs n samples at width bits each into out, which needs room for (n * width + 7) / 8 bytes. Returns that many. */
+int pueo_pack_samples(const int16_t * samples, int n, int width, uint8_t * out);
+
+/** The reverse, sign-extending each sample. Returns the number of bytes used. */
+int pueo_unpack_samples(const uint8_t * in, int n, int width, int16_t * samples);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
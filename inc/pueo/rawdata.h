@@ -160,6 +160,8 @@ typedef struct pueo_full_waveforms
 } pueo_full_waveforms_t;
 
 #define PUEO_FULL_WAVEFORMS_VER 1
+/* Same as version 1, but each waveform's samples are bit-packed (see pueo_handle_set_pack_samples). Only written when asked for. */
+#define PUEO_FULL_WAVEFORMS_PACKED_VER 2
 
 #define PUEO_PRIO_TRIG_TYPE_FORCE 0
 #define PUEO_PRIO_TRIG_TYPE_LF 1
@@ -212,9 +214,11 @@ typedef struct pueo_single_waveform
 } pueo_single_waveform_t;
 
 #define PUEO_SINGLE_WAVEFORM_VER 2
+/* Same as version 2, with the samples bit-packed */
+#define PUEO_SINGLE_WAVEFORM_PACKED_VER 3
 
 
-/* see pueo/encode.h to convert, once implemented*/
+/* see pueo/encode.h to convert */
 typedef struct pueo_encoded_waveform
 {
   uint32_t run;
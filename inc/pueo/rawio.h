@@ -38,6 +38,8 @@
 #include <pueo/pueo.h>
 #include <pueo/rawdata.h>
 
+struct iovec;
+
 #ifdef __cplusplus
 extern "C"
 {
@@ -74,6 +76,7 @@ typedef struct pueo_handle
 
   uint64_t bytes_written;
   uint64_t bytes_read;
+  uint64_t packets_dropped; // for backends that may drop packets (e.g. async, udp). Wrappers include what the handle they wrap dropped
   char * description;
 
   //Function pointers
@@ -85,6 +88,30 @@ typedef struct pueo_handle
 
   //needed for UDP, when done writing.
   int (*done_write_packet) (struct pueo_handle *h);
+
+  //Optional, for backends that can hand out pointers to their data in place (e.g. mmap).
+  //On return, *bytes points to the next nbytes of the stream, which are then consumed. Returns the number of bytes available.
+  int (*view_bytes) (size_t nbytes, const void ** bytes, struct pueo_handle *h);
+
+  //Optional, push anything buffered towards its destination. See pueo_handle_flush.
+  int (*flush) (struct pueo_handle *h);
+
+  //Optional, for seekable read backends. Moves to an absolute offset in the (uncompressed) stream. See pueo_handle_seek.
+  int (*seek) (uint64_t offset, struct pueo_handle *h);
+
+  //Optional, for backends that do better with a whole packet at once (e.g. writev).
+  //If set, pueo_write_X gathers the pieces of the packet (header included) and hands them over in one call. Returns the number of bytes written.
+  int (*write_bytesv) (const struct iovec * iov, int iovcnt, struct pueo_handle *h);
+
+  //Optional, for read backends that can move past bytes without handing them out (e.g. lseek). Returns the number of bytes skipped,
+  //or negative if it can't, in which case they get viewed or read instead. See pueo_ll_skip.
+  int (*skip_bytes) (size_t nbytes, struct pueo_handle *h);
+
+  //Optional, called before the first byte of each packet is written, so backends that build up a packet
+  //can start afresh even if the last one failed partway (and so never got its done_write_packet).
+  void (*begin_write_packet) (struct pueo_handle *h);
+
+  uint64_t type_filter; // if non-zero, only packet types in this mask are read, see pueo_handle_set_type_filter
 } pueo_handle_t;
 
 
@@ -96,6 +123,14 @@ typedef struct pueo_handle
  *    (none):  treat as file://
  *     file://filename treat as a file
  *     udp:port//host  udp socket
+ *     mmap://filename memory-mapped (uncompressed) file, read-only. Supports pueo_ll_view and friends.
+ *     uring://filename (uncompressed) file read or written with io_uring, with default options
+ *     bgz://filename block-compressed gzip file, with default options (see pueo_handle_init_bgz)
+ *     tcp://host:port TCP stream (add l to the mode to listen for a connection, the host may then be empty)
+ *     unix:///path unix-domain stream socket (likewise)
+ *     mem://[capacity] growable buffer in memory, for writing (see pueo_handle_init_mem)
+ *     rotate://prefix?max_bytes=N&max_packets=N&max_secs=N&compress=zst|gz  series of files (see pueo_handle_init_rotate)
+ *     shm://name shared-memory ring between processes on one node (add b to the writer's mode for broadcast, see pueo_handle_init_shm)
  *
  * @param h A handle to initialize (will be zeroed out!)
  * @param uri a recognized URI. Will default to a filename if no prefix. If ends with .gz will use zlib
@@ -104,13 +139,52 @@ typedef struct pueo_handle
  */
 int pueo_handle_init(pueo_handle_t * h, const char * uri, const char * mode);
 
-/** This initializes a handle corresponding to a file. If it ends with .gz, zlib is used automatically,
- * If it ends with .zst, zstd is used autoagically.
+/** This initializes a handle corresponding to a file. If it ends with .gz, zlib is used automatically
+ * (unless reading a block-compressed file, in which case the parallel reader from pueo_handle_init_bgz is used).
+ * If it ends with .zst, zstd is used autoagically (with default options, see pueo_handle_init_zstd).
  * If writing a gzfile, mode is passed to gzopen so you can use it to set compression level /strategy
+ * If writing a zstd file, digits in mode set the compression level (e.g. "w19").
 
  **/
 int pueo_handle_init_file(pueo_handle_t * h, const char * file, const char * mode);
 
+
+/** Options for zstd-compressed files. Zero-initialized means defaults. */
+typedef struct pueo_zstd_opts
+{
+  int level;     // compression level, 0 means the zstd default (3). Negative levels are the fast ones.
+  int nthreads;  // number of compression worker threads (ZSTD_c_nbWorkers), 0 means compress in the calling thread
+  int window_log; // if non-zero, enable long distance matching with this window log (e.g. 27 for 128 MB)
+  int buffer_size; // size of the internal buffers, 0 means 4 MB
+} pueo_zstd_opts_t;
+
+/** Open a zstd-compressed file natively (requires compiling with libzstd).
+ * mode should be r, w or a (zstd frames can be concatenated).
+ * opts may be NULL for defaults, in which case any digits in mode are used as the level.
+ */
+int pueo_handle_init_zstd(pueo_handle_t * h, const char * file, const char * mode, const pueo_zstd_opts_t * opts);
+
+/** Options for block-compressed gzip files. Zero-initialized means defaults. */
+typedef struct pueo_bgz_opts
+{
+  int level;      // compression level, 0 means the zlib default (6)
+  int nthreads;   // number of (de)compression threads, 0 means one per online CPU (up to 16)
+  int block_size; // a block is ended after the first packet that takes it past this many (uncompressed) bytes, default 1 MB
+} pueo_bgz_opts_t;
+
+/** Opens a block-compressed gzip file.
+ *
+ * This is a gzip file made of many independent members (blocks), each holding
+ * whole packets, followed by an index of the blocks.  Anything that reads .gz
+ * files (gzread, zcat, pueo_handle_init_file) can still read it, but this
+ * compresses and decompresses the blocks on a pool of threads, and the reader
+ * supports pueo_handle_seek and pueo_ll_view.
+ *
+ * mode should be r or w (appending is not supported). opts may be NULL for
+ * defaults, in which case any digits in mode are used as the level.
+ */
+int pueo_handle_init_bgz(pueo_handle_t * h, const char * file, const char * mode, const pueo_bgz_opts_t * opts);
+
 /* if you already have a FILE * (e.g. through fmemopen). If close is true, the FILE * will be closed when the handle is closed. 
  * */
 int pueo_handle_init_filep(pueo_handle_t * h, FILE * fptr, bool close);
@@ -123,9 +197,319 @@ int pueo_handle_init_fd_with_desc(pueo_handle_t * h, int fd, const char * descri
 
 int pueo_handle_init_udp(pueo_handle_t *h, int port, const char *hostname, const char * mode);
 
+/** Options for UDP handles. Zero-initialized means defaults (which behave like pueo_handle_init_udp). */
+typedef struct pueo_udp_opts
+{
+  int batch;        // datagrams moved per recvmmsg / sendmmsg call, default 1
+  int max_delay_ms; // when batching or coalescing, a packet is sent at the latest this long after it was written, default 10
+  int coalesce;     // if non-zero, pack consecutive packets into datagrams of up to this many bytes (e.g. 1400 to stay under the MTU). Negative means as big as UDP allows.
+  int bufsize;      // SO_RCVBUF / SO_SNDBUF, 0 leaves the receive buffer alone and uses ~1 MB for the send buffer
+  int reassembly_slots;      // reading: how many fragmented packets may be reassembled at once, default 4 (each needs up to ~1 MB)
+  int reassembly_timeout_ms; // reading: give up on a fragmented packet if it's not complete after this long, default 1000
+} pueo_udp_opts_t;
+
+/** A UDP handle, as above, with options.
+ *
+ * With batch > 1, a reader pulls up to batch datagrams per recvmmsg into a pool and serves
+ * reads from it (this also allows pueo_ll_view, valid until the next read), and a writer
+ * queues datagrams and sends them with one sendmmsg when batch are queued, when the oldest
+ * is older than max_delay_ms, on pueo_handle_flush and on close.
+ *
+ * With coalesce, a writer keeps appending packets to a datagram until the next one wouldn't fit
+ * (packets bigger than coalesce get a datagram to themselves) or the first packet in it has waited
+ * max_delay_ms. Readers handle datagrams holding several packets either way.
+ *
+ * A writer that batches or coalesces has a thread that sends whatever has waited max_delay_ms
+ * even if nothing more is written (it never sends a packet that is only partly written), so the
+ * handle's functions take a lock.
+ *
+ * Packets too big for a datagram (e.g. full waveforms) are always sent as fragments, which the reader
+ * reassembles, so they are read like any other packet. Fragments may arrive out of order, but if
+ * one is lost, the packet is given up on after reassembly_timeout_ms (or when its slot is needed).
+ *
+ * For readers, h->packets_dropped is the number of datagrams the kernel dropped for lack of buffer space (SO_RXQ_OVFL)
+ * plus the number of fragmented packets given up on. For writers, it counts datagrams that failed to send.
+ */
+int pueo_handle_init_udp_opts(pueo_handle_t *h, int port, const char *hostname, const char * mode, const pueo_udp_opts_t * opts);
+
+/** Options for stream (TCP and unix-domain socket) handles. Zero-initialized means defaults. */
+typedef struct pueo_stream_opts
+{
+  int bufsize;    // SO_SNDBUF / SO_RCVBUF, default 4 MB
+  int timeout_ms; // how long to wait for a connection, or for the other end to make room or send something. 0 means forever
+  bool cork;      // TCP only: instead of TCP_NODELAY, use TCP_CORK so only full frames go out (until pueo_handle_flush)
+} pueo_stream_opts_t;
+
+/** A reliable stream between processes or hosts.
+ *
+ * mode is r or w, plus l to listen (and accept a single connection) instead of connecting.
+ * Either end may listen. The socket is non-blocking internally, so partial writes are
+ * handled and the writer simply waits (up to timeout_ms) when the reader falls behind.
+ * Nothing is ever dropped; the reader sees EOF when the writer closes.
+ *
+ * Each packet is several small reads, so readers will want pueo_handle_set_buffer (which also allows pueo_ll_view).
+ */
+int pueo_handle_init_tcp(pueo_handle_t *h, const char * host, int port, const char * mode, const pueo_stream_opts_t * opts);
+int pueo_handle_init_unix(pueo_handle_t *h, const char * path, const char * mode, const pueo_stream_opts_t * opts);
+
+/** Options for shared-memory rings. Zero-initialized means defaults. */
+typedef struct pueo_shm_opts
+{
+  size_t size;    // writer: size of the ring, default 64 MB. Readers use whatever the writer made.
+  bool broadcast; // writer: any number of readers, each seeing every packet, but the writer never waits for them (also b in the mode)
+  bool block;     // writer, single reader only: wait for the reader to make room rather than dropping the packet
+  bool unlink;    // remove the segment on close
+} pueo_shm_opts_t;
+
+/** A lock-free ring in POSIX shared memory (/dev/shm/name), for passing packets between processes on one node.
+ *
+ * mode is r or w. The writer creates (or resets) the ring; readers must open it after that.
+ * Packets are stored whole, so pueo_ll_view works (the view is valid until the next read) and
+ * reads are served straight out of the ring. Readers wait on a futex for the next packet
+ * and see EOF once the writer closes and they have caught up.
+ *
+ * By default there is one reader, which picks up where the previous one left off. If the reader
+ * falls a whole ring behind, the writer drops packets (counted in h->packets_dropped) unless block is set.
+ *
+ * With broadcast, each reader starts at the next packet written and keeps its own place. The writer
+ * overwrites the oldest packets as needed, and a reader that gets lapped skips ahead to the oldest packet
+ * still there, counting what it missed in h->packets_dropped (a read that was overwritten as it happened fails).
+ * Since nothing stops the writer, a view may be overwritten while in use if the reader is that far behind.
+ *
+ * The segment persists after the writer closes unless unlink is set, so readers can drain it.
+ */
+int pueo_handle_init_shm(pueo_handle_t *h, const char * name, const char * mode, const pueo_shm_opts_t * opts);
+
+/** Fill level and counters of a shared-memory ring */
+typedef struct pueo_shm_stats
+{
+  uint64_t size;     // bytes in the ring
+  uint64_t used;     // bytes not yet read (for a broadcast reader, not yet read by this reader; for a broadcast writer, bytes still in the ring)
+  uint64_t packets;  // written so far
+  uint64_t overruns; // packets the writer dropped (single reader) or overwrote (broadcast) for lack of room
+} pueo_shm_stats_t;
+
+/** Fills stats for a handle from pueo_handle_init_shm. Returns -1 for other handles. */
+int pueo_handle_shm_stats(const pueo_handle_t *h, pueo_shm_stats_t * stats);
+
+/** Options for pueo_handle_init_prefetch. Zero-initialized means defaults. */
+typedef struct pueo_prefetch_opts
+{
+  int block_size; // bytes asked of inner per read, default 1 MB
+  int nblocks;    // how many blocks may be read ahead, default 4
+} pueo_prefetch_opts_t;
+
+/** Turns a reading handle into one that reads ahead on a background thread.
+ *
+ * A thread reads blocks from inner (which is moved into h, so don't use or close inner afterwards)
+ * while the caller parses packets out of the blocks read so far, so e.g. gz decompression
+ * overlaps with whatever is done with the packets. Supports pueo_ll_view (valid until the
+ * next read) and pueo_handle_seek (if inner does).
+ *
+ * Each block is a single read of inner, so this works best with files; stream sockets would
+ * wait for a whole block. bgz already does its own readahead.
+ */
+int pueo_handle_init_prefetch(pueo_handle_t *h, pueo_handle_t * inner, const pueo_prefetch_opts_t * opts);
+
+/** Options for pueo_handle_init_resync. Zero-initialized means defaults. */
+typedef struct pueo_resync_opts
+{
+  uint32_t max_bytes; // largest payload considered plausible, default (and at most) what num_bytes can hold
+  bool skip_crc;      // trust the marker, type and length without checking the payload's checksum (faster, less careful)
+
+  // if set, called each time damage has been skipped, with the stream offset where it started and how many bytes were skipped
+  void (*callback) (uint64_t offset, size_t nskipped, void * arg);
+  void * callback_arg;
+} pueo_resync_opts_t;
+
+typedef struct pueo_resync_stats
+{
+  uint64_t bytes_skipped; // total bytes thrown away
+  uint64_t resyncs;       // how many separate stretches of damage that was
+} pueo_resync_stats_t;
+
+/** Turns a reading handle into one that survives damaged data.
+ *
+ * Without this, a header without the 0xf1 marker makes reads fail with -EIO. Here, each packet
+ * is checked before it is handed out (marker, known type, sane length and matching checksum) and anything
+ * that doesn't check out is skipped until the next packet that does. inner is moved into h, so don't use or close it afterwards.
+ *
+ * Supports pueo_ll_view (valid until the next read) and pueo_handle_seek (if inner does).
+ * Since each packet is read whole before it's checked, a damaged length on a live stream
+ * may wait for up to that many bytes.
+ */
+int pueo_handle_init_resync(pueo_handle_t *h, pueo_handle_t * inner, const pueo_resync_opts_t * opts);
+
+/** Fills stats for a handle from pueo_handle_init_resync. Returns -1 for other handles. */
+int pueo_handle_resync_stats(const pueo_handle_t *h, pueo_resync_stats_t * stats);
+
+/** Options for rotating writers. Zero-initialized means a single file. */
+typedef struct pueo_rotate_opts
+{
+  uint64_t max_bytes;    // start a new file once a file has this many (uncompressed) bytes, 0 for no limit
+  uint32_t max_packets;  // ... or this many packets
+  int max_secs;          // ... or was opened this long ago
+  const char * compress; // NULL, "gz" or "zst"
+} pueo_rotate_opts_t;
+
+/** Writes to a series of files named prefix<secs>.<nsecs>.dat (.dat.gz or .dat.zst if compressing),
+ * moving on to a new file when any of the limits is hit. prefix may be a directory (with the trailing slash).
+ *
+ * Packets never straddle files, and a new file is only started when there's a packet to put in it.
+ * A background thread opens the next file ahead of time (as prefix.next-...) and closes
+ * finished ones, so rotating doesn't hold up the writer.
+ */
+int pueo_handle_init_rotate(pueo_handle_t *h, const char * prefix, const pueo_rotate_opts_t * opts);
+
+/** The file a rotating writer is writing to, or NULL (if nothing has been written yet, or h isn't a rotating writer) */
+const char * pueo_handle_rotate_current(const pueo_handle_t *h);
+
+/** An entry in a sidecar index. There is one per waveform packet (full or single). */
+typedef struct pueo_index_entry
+{
+  uint64_t offset;           // of the packet in the uncompressed stream, for pueo_handle_seek
+  uint32_t run;
+  uint32_t event;
+  pueo_time_t readout_time;  // zero for old versions that don't have one
+  uint16_t type;
+  uint16_t reserved[3];
+} pueo_index_entry_t;
+
+typedef struct pueo_index pueo_index_t;
+
+/** Builds an index by scanning the data at uri (only the start of each packet is decoded).
+ * If index_file isn't NULL, it's saved there too (conventionally, next to the data with .idx appended).
+ */
+pueo_index_t * pueo_index_build(const char * uri, const char * index_file);
+
+/** Loads an index saved by pueo_index_build or written by pueo_handle_write_index. */
+pueo_index_t * pueo_index_open(const char * index_file);
+int pueo_index_save(const pueo_index_t * idx, const char * index_file);
+void pueo_index_close(pueo_index_t * idx);
+
+/** All the entries, in the order the packets are in the data */
+const pueo_index_entry_t * pueo_index_entries(const pueo_index_t * idx, size_t * n);
+
+/** The first packet of an event (if there are several, e.g. single waveforms, the one earliest in the data), or NULL */
+const pueo_index_entry_t * pueo_index_find_event(const pueo_index_t * idx, uint32_t run, uint32_t event);
+
+/** The first packet read out at or after the given time, or NULL */
+const pueo_index_entry_t * pueo_index_find_time(const pueo_index_t * idx, uint64_t utc_secs, uint32_t utc_nsecs);
+
+/** Moves a reading handle (which must support pueo_handle_seek) to an event, or the first packet read out at or after a time.
+ * Returns -ENOENT if there's no such thing in the index, otherwise as pueo_handle_seek.
+ */
+int pueo_handle_seek_event(pueo_handle_t * h, const pueo_index_t * idx, uint32_t run, uint32_t event);
+int pueo_handle_seek_time(pueo_handle_t * h, const pueo_index_t * idx, uint64_t utc_secs, uint32_t utc_nsecs);
+
+/** Writes an index of the packets written to h from now on, as they're written.
+ * Offsets count from here, so this should be done on a fresh handle (not one appending to a file).
+ * The index is flushed with the handle and closed with it.
+ */
+int pueo_handle_write_index(pueo_handle_t * h, const char * index_file);
+
+/** Options for io_uring handles. Zero-initialized means defaults. */
+typedef struct pueo_uring_opts
+{
+  int block_size; // size of each io, default 1 MB
+  int nblocks;    // number of blocks (i.e. ios in flight), default 8
+} pueo_uring_opts_t;
+
+/** Reads or writes an uncompressed file using io_uring (Linux only).
+ *
+ * The file is moved in large blocks through buffers registered with the kernel,
+ * so the many small reads and writes per packet are just memcpys.  When reading,
+ * all blocks are kept in flight as readahead (so nblocks * block_size bytes).
+ * When writing, each full block is submitted and the writer only waits when it
+ * comes back around to a block that is still being written.
+ *
+ * mode should be r, w or a.
+ */
+int pueo_handle_init_uring(pueo_handle_t *h, const char * file, const char * mode, const pueo_uring_opts_t * opts);
+
+/** Memory-maps an uncompressed file for reading. Normal reads work as usual
+ * (but only cost a memcpy), and in addition the pueo_ll_view / pueo_view_X
+ * methods can be used to look at packets in place without copying them.
+ */
+int pueo_handle_init_mmap(pueo_handle_t *h, const char * file);
+
+/** Writes into a growable buffer in memory, without going through stdio.
+ * capacity is the initial size (0 for 64 kB); the buffer doubles as needed.
+ * What was written can also be read back (or viewed, or seeked) through the same handle.
+ * Use pueo_handle_mem_data to get at the bytes and pueo_handle_mem_reset to start over.
+ */
+int pueo_handle_init_mem(pueo_handle_t *h, size_t capacity);
+
+/** Reads from len bytes at data, which are not copied, so must outlive the handle.
+ * Supports pueo_ll_view (and friends) and pueo_handle_seek.
+ */
+int pueo_handle_init_mem_span(pueo_handle_t *h, const void * data, size_t len);
+
+/** The bytes in a memory handle, and how many there are (if len isn't NULL).
+ * The pointer is invalidated by writing more (the buffer may move) and by closing the handle.
+ * Returns NULL if h isn't a memory handle.
+ */
+const void * pueo_handle_mem_data(const pueo_handle_t *h, size_t * len);
+
+/** Empties a memory handle from pueo_handle_init_mem, keeping the buffer around for reuse. */
+int pueo_handle_mem_reset(pueo_handle_t *h);
+
 // This  will normally be equivalent to something like h->close(h->aux)
+// Returns what the backend's close returned (non-zero if anything still pending couldn't be written)
 int pueo_handle_close(pueo_handle_t  *h);
 
+/** Puts a user-space buffer of the given size in front of any handle (or resizes an existing one).
+ *
+ * This turns the many small read_bytes/write_bytes calls made per packet into a few large ones,
+ * which matters for backends where each call is a syscall (e.g. fd).
+ * When writing, the buffer is flushed at the end of every packet (so datagram backends still see one packet at a time),
+ * on pueo_handle_flush and on close. Writes larger than the buffer bypass it.
+ * A buffered read handle also supports pueo_ll_view (the buffer grows if a packet doesn't fit).
+ *
+ * A size of 0 flushes and removes the buffer again.
+ */
+int pueo_handle_set_buffer(pueo_handle_t *h, size_t size);
+
+/** Flushes anything buffered in the handle. Returns 0 on success. */
+int pueo_handle_flush(pueo_handle_t *h);
+
+/** Moves a reading handle to the given offset in the (uncompressed) stream, which should be the start of a packet
+ * (e.g. a value of h->bytes_read from before a read, which is updated to offset).
+ * Returns 0 on success, or -ENOTSUP if the backend can't seek (udp, zstd, uring...). gz files can seek, but slowly; use bgz.
+ */
+int pueo_handle_seek(pueo_handle_t *h, uint64_t offset);
+
+
+/** What an async handle does when its queue is full */
+typedef enum pueo_async_policy
+{
+  PUEO_ASYNC_BLOCK = 0,  // wait for the writer thread to make room
+  PUEO_ASYNC_DROP_NEWEST, // drop the packet being written
+  PUEO_ASYNC_DROP_LOWEST_PRIORITY // drop whichever of the new packet and the queued ones is the least important (see below)
+} pueo_async_policy_t;
+
+/** Options for pueo_handle_init_async. Zero-initialized means defaults. */
+typedef struct pueo_async_opts
+{
+  int queue_depth;  // number of packets that may be queued, default 8
+  int slot_size;    // size of each (pre-allocated) packet buffer, default is big enough for any packet
+  pueo_async_policy_t policy;
+} pueo_async_opts_t;
+
+/** Turns a writing handle into an asynchronous one.
+ *
+ * pueo_write_X on h then only serializes into one of a ring of pre-allocated
+ * buffers, and a background thread writes them out to inner (which is moved into h,
+ * so don't use or close inner afterwards). This keeps slow backends (e.g. gz or zstd compression) out of the writing loop.
+ *
+ * When the queue is full, what happens depends on the policy. Dropped packets are counted in h->packets_dropped,
+ * as are packets too big for a slot (the write fails for those).
+ * For PUEO_ASYNC_DROP_LOWEST_PRIORITY, waveform packets are less important than everything else, and among single waveforms, prio.signal_level decides.
+ *
+ * pueo_handle_flush waits until the queue is drained. Closing drains the queue, then closes inner.
+ */
+int pueo_handle_init_async(pueo_handle_t *h, pueo_handle_t * inner, const pueo_async_opts_t * opts);
+
 
 /** In-memory size of type */
 int pueo_size_inmem(pueo_datatype_t type);
@@ -139,6 +523,19 @@ int pueo_size_inmem(pueo_datatype_t type);
  */
 int pueo_ll_write(pueo_handle_t *h, pueo_datatype_t type, const void * p);
 
+/**
+ * Serializes a packet (header and payload, exactly as pueo_write_X would write it) into buf,
+ * so the same image can be sent to several places without serializing again.
+ * The checksum is computed as the payload is copied, so the data are only walked once.
+ * Returns the size of the image, or -EMSGSIZE if it's bigger than cap (see pueo_serialized_size_X).
+ *
+ * There is a type-safe pueo_serialize_X / pueo_serialized_size_X for every type.
+ */
+int pueo_ll_serialize(pueo_datatype_t type, const void * p, void * buf, size_t cap);
+
+/** Writes a packet image from pueo_serialize_X (or anything else holding a whole packet) to h. */
+int pueo_write_serialized(pueo_handle_t *h, const void * buf, size_t len);
+
 
 
 /** Low-level read that writes into a generic pueo_packet_t with a given
@@ -150,6 +547,9 @@ int pueo_ll_write(pueo_handle_t *h, pueo_datatype_t type, const void * p);
  * capacity you need afyou can query h->required_read_size. After a succsesful
  * read, h->required_read_size will be 0.
  *
+ * If the stream has lost sync (the next header doesn't look like one), -EIO is returned.
+ * Wrap the handle with pueo_handle_init_resync to skip past damage instead.
+ *
  * An alternative to using pueo_packet_t is to use pueo_read_X (where X e.g. single_waveform) which will attempt to
  * read a given type from a stream. Those functions are typesafe, but will return 0 if the type is not the right one!
  *
@@ -160,9 +560,170 @@ int pueo_ll_read(pueo_handle_t *h, pueo_packet_t * dest);
  **/
 int pueo_ll_read_realloc(pueo_handle_t *h, pueo_packet_t **dest);
 
+/** Holds many packets back to back, for pueo_ll_read_batch. Zero-initialize it,
+ * reuse it between batches (its memory is kept) and free with pueo_packet_arena_free.
+ */
+typedef struct pueo_packet_arena
+{
+  uint8_t * mem;
+  size_t cap;
+  size_t used;
+  size_t * offsets;  // where each packet starts in mem, use pueo_packet_arena_get
+  int offsets_cap;
+  int npackets;      // in the last batch
+  int status;        // for internal use (an error that ended the last batch early)
+} pueo_packet_arena_t;
+
+/** Reads up to max_packets (0 for no limit) packets into arena, replacing what was there,
+ * stopping early once the packets would take more than max_bytes (0 for no limit, but at least one packet is always read).
+ * The arena grows as needed, so once it is big enough a bulk read doesn't allocate at all.
+ *
+ * Returns the number of packets read, EOF if there's nothing left or a negative number on error.
+ * An error after some packets were read ends the batch there and is returned by the next call.
+ * Packets of types we don't know how to read are skipped.
+ */
+int pueo_ll_read_batch(pueo_handle_t *h, pueo_packet_arena_t * arena, int max_packets, size_t max_bytes);
+
+/** The ith packet of the last batch, valid until the next batch. */
+pueo_packet_t * pueo_packet_arena_get(const pueo_packet_arena_t * arena, int i);
+
+void pueo_packet_arena_free(pueo_packet_arena_t * arena);
+
+/** Reads the next header (if it hasn't been already) without touching the payload, so you can
+ * decide what to do with the packet. Returns NULL at the end (or on error), otherwise &h->last_read_header.
+ * Follow with pueo_ll_read (or a view, or pueo_read_X) to get the payload, or pueo_ll_skip to not.
+ */
+const pueo_packet_head_t * pueo_ll_peek(pueo_handle_t *h);
+
+/** Skips the next packet (or the one whose header was just peeked) without decoding or copying its payload.
+ * Backends that can seek past it (files, gz) do, the rest view or read it into a scratch buffer.
+ * Returns the number of payload bytes skipped, EOF if there's nothing left or another negative number on error.
+ */
+int pueo_ll_skip(pueo_handle_t *h);
+
+/** The bit for type in a type filter mask (0 for a type we don't know about). */
+uint64_t pueo_type_mask(pueo_datatype_t type);
+
+/** Only read packets whose type is in mask (e.g. pueo_type_mask(PUEO_DAQ_HSK) | pueo_type_mask(PUEO_SLOW)),
+ * everything else is skipped as with pueo_ll_skip. This applies to all the reading functions. A mask of 0 reads everything (the default).
+ */
+void pueo_handle_set_type_filter(pueo_handle_t *h, uint64_t mask);
+
+/** Write waveforms (PUEO_FULL_WAVEFORMS and PUEO_SINGLE_WAVEFORM, including compact events) with their samples bit-packed,
+ * at the narrowest width that holds every sample of each waveform (usually 12 bits, so a quarter smaller).
+ * These are the _PACKED_VER versions, which everything reads back as usual except the in-place views. Off by default.
+ */
+void pueo_handle_set_pack_samples(pueo_handle_t *h, bool pack);
+
 int pueo_dump_packet(FILE *f, const pueo_packet_t * p);
 
+
+/** A read-only view of a packet, pointing directly into the data held by the handle.
+ *
+ * This only works with handles that implement view_bytes (currently mmap, or anything with pueo_handle_set_buffer).
+ * The payload is exactly what was written, i.e. num_bytes long, and is only
+ * valid until the next read (for mmap, until the handle is closed). head points to h->last_read_header, so is only valid until the next read.
+ *
+ * Note that the payload pointer is only as aligned as the stream is (some
+ * packets have odd lengths). That's fine on x86_64 and aarch64, but you may
+ * want to memcpy if you care about other platforms.
+ */
+typedef struct pueo_packet_view
+{
+  const pueo_packet_head_t * head;
+  const uint8_t * payload;
+} pueo_packet_view_t;
+
+/** Like pueo_ll_read, but doesn't copy anything. Returns the number of payload bytes, EOF if there's nothing left,
+ * -ENOTSUP if the handle can't do views or another negative number on error. */
+int pueo_ll_view(pueo_handle_t *h, pueo_packet_view_t * v);
+
+
+/** View of a pueo_full_waveforms_t without materializing one.
+ *
+ * evt points at the event header in place; only the members before wfs may
+ * be accessed through it (and readout_time does not exist for version 0).
+ * wfs[i] points to each waveform in place; only channel_id, surf_word, length
+ * and the first length samples of data may be accessed.
+ */
+typedef struct pueo_full_waveforms_view
+{
+  const pueo_packet_head_t * head;
+  const pueo_full_waveforms_t * evt;
+  const pueo_waveform_t * wfs[PUEO_NCHAN];
+} pueo_full_waveforms_view_t;
+
+/** Same idea for a pueo_single_waveform_t. Only the members before wf may be
+ * accessed through evt (readout_time is absent for version 0, prio for versions 0 and 1).
+ */
+typedef struct pueo_single_waveform_view
+{
+  const pueo_packet_head_t * head;
+  const pueo_single_waveform_t * evt;
+  const pueo_waveform_t * wf;
+} pueo_single_waveform_view_t;
+
+/** These behave like pueo_read_X: EOF if there's nothing left, 0 if the next packet is the wrong type, negative on error, otherwise number of bytes.
+ * Packed waveforms (see pueo_handle_set_pack_samples) can't be viewed in place, those give -ENOTSUP without consuming the packet, so read it instead.
+ */
+int pueo_view_full_waveforms(pueo_handle_t *h, pueo_full_waveforms_view_t * v);
+int pueo_view_single_waveform(pueo_handle_t *h, pueo_single_waveform_view_t * v);
+
+/** Which channels pueo_read_full_waveforms_partial should decode. Zero-initialize, then PUEO_CHANNEL_MASK_SET the ones you want. */
+typedef struct pueo_channel_mask
+{
+  uint64_t bits[(PUEO_NCHAN + 63) / 64];
+} pueo_channel_mask_t;
+
+#define PUEO_CHANNEL_MASK_SET(mask, ichan) ((mask)->bits[(ichan) / 64] |= UINT64_C(1) << ((ichan) % 64))
+#define PUEO_CHANNEL_MASK_TEST(mask, ichan) ((mask)->bits[(ichan) / 64] >> ((ichan) % 64) & 1)
+
+/** Like pueo_read_full_waveforms, but only decodes the event header and the channels in mask (NULL for just the header).
+ * The other channels are skipped without being copied (see pueo_ll_skip) and left with length 0.
+ * Returns the same as pueo_read_full_waveforms (the number of bytes consumed, whether decoded or not).
+ */
+int pueo_read_full_waveforms_partial(pueo_handle_t *h, pueo_full_waveforms_t * p, const pueo_channel_mask_t * mask);
+
+/** A pueo_full_waveforms_t takes the same (large) amount of memory no matter how long its waveforms are.
+ * A compact event only takes what the waveforms need: it holds the packet payload as written
+ * (the event header, then each waveform's channel_id, surf_word, length and length samples)
+ * plus a table of where each waveform starts, all in one allocation.
+ *
+ * They're allocated (and grown) by pueo_compact_event_from_full and pueo_read_compact_event, which
+ * take a pointer to a pointer like pueo_ll_read_realloc (start from NULL and reuse it), and freed with free().
+ */
+typedef struct pueo_compact_event
+{
+  uint32_t size;     // bytes used, including this struct
+  uint32_t capacity; // bytes allocated
+  uint32_t reserved[2];
+  uint32_t offsets[PUEO_NCHAN]; // where each waveform starts in data, use pueo_compact_event_waveform
+  uint8_t data[];
+} pueo_compact_event_t;
+
+/** Packs fw into *dest. Returns the size of *dest or negative on error. */
+int pueo_compact_event_from_full(pueo_compact_event_t ** dest, const pueo_full_waveforms_t * fw);
+
+/** Unpacks ce into fw. Samples past each waveform's length are left alone. */
+int pueo_compact_event_to_full(const pueo_compact_event_t * ce, pueo_full_waveforms_t * fw);
+
+/** Only the members before wfs may be accessed through this (as with pueo_full_waveforms_view_t) */
+const pueo_full_waveforms_t * pueo_compact_event_header(const pueo_compact_event_t * ce);
+
+/** Only channel_id, surf_word, length and the first length samples of data may be accessed through this */
+const pueo_waveform_t * pueo_compact_event_waveform(const pueo_compact_event_t * ce, int i);
+
+/** Reads a PUEO_FULL_WAVEFORMS packet straight into *dest, without going through a pueo_full_waveforms_t.
+ * Behaves like pueo_read_full_waveforms: EOF if there's nothing left, 0 if the next packet is the wrong type, negative on error, otherwise number of bytes.
+ */
+int pueo_read_compact_event(pueo_handle_t *h, pueo_compact_event_t ** dest);
+// (packed waveforms are unpacked on the way in, so a compact event always holds the unpacked layout)
+
+/** Writes ce as a PUEO_FULL_WAVEFORMS packet, the same as pueo_write_full_waveforms would */
+int pueo_write_compact_event(pueo_handle_t *h, const pueo_compact_event_t * ce);
+
 const char * pueo_packet_name(const pueo_packet_t * p);
+const char * pueo_type_name(pueo_datatype_t type);
 
 /** IO dispatch table, for use with X macros. See https://en.wikipedia.org/wiki/X_Macro if you don't know what this is.
  *
@@ -188,16 +749,20 @@ const char * pueo_packet_name(const pueo_packet_t * p);
   X(PUEO_DAQ_HSK_SUMMARY, daq_hsk_summary)\
   X(PUEO_FILE_DOWNLOAD, file_download)\
   X(PUEO_SAVED_PRIORITIES, saved_priorities)\
-  X(PUEO_PRIO_STATUS, prio_status)
-
+  X(PUEO_PRIO_STATUS, prio_status)\
+  X(PUEO_ENCODED_WAVEFORM, encoded_waveform)
 
-//  X(PUEO_ENCODED_WAVEFORM, encoded_waveform)
 
 
 // Set up write method for each type
 #define X_PUEO_WRITE(IGNORE,STRUCT_NAME) \
   int pueo_write_##STRUCT_NAME(pueo_handle_t *h, const pueo_##STRUCT_NAME##_t * p);
 
+// Set up serialization into a buffer for each type (see pueo_ll_serialize)
+#define X_PUEO_SERIALIZE(IGNORE,STRUCT_NAME) \
+  int pueo_serialize_##STRUCT_NAME(const pueo_##STRUCT_NAME##_t * p, void * buf, size_t cap);\
+  int pueo_serialized_size_##STRUCT_NAME(const pueo_##STRUCT_NAME##_t * p);
+
 // Set up read method for each type
 #define X_PUEO_READ(IGNORE,STRUCT_NAME) \
   int pueo_read_##STRUCT_NAME(pueo_handle_t *h, pueo_##STRUCT_NAME##_t * p);
@@ -206,6 +771,12 @@ const char * pueo_packet_name(const pueo_packet_t * p);
 #define X_PUEO_CAST(IGNORE,STRUCT_NAME) \
   const pueo_##STRUCT_NAME##_t* pueo_packet_as_##STRUCT_NAME(const pueo_packet_t * p);
 
+// For types whose on-wire payload is just the (possibly truncated) struct, cast a view to the struct. Will return NULL
+// for the wrong type, an old version, or types with more complicated layouts (i.e. the waveforms, see pueo_view_X for those).
+// Only the first head->num_bytes of the struct may be accessed!
+#define X_PUEO_VIEW_AS(IGNORE,STRUCT_NAME) \
+  const pueo_##STRUCT_NAME##_t* pueo_packet_view_as_##STRUCT_NAME(const pueo_packet_view_t * v);
+
 // This sets up a dumper
 #define X_PUEO_DUMP(IGNORE,STRUCT_NAME) \
   int  pueo_dump_##STRUCT_NAME(FILE* f, const pueo_##STRUCT_NAME##_t * p);
@@ -244,8 +815,10 @@ void pueo_db_handle_close(pueo_db_handle_t ** h);
 int pueo_db_insert_packet(pueo_db_handle_t * db,  const pueo_packet_t * p);
 
 PUEO_IO_DISPATCH_TABLE(X_PUEO_WRITE)
+PUEO_IO_DISPATCH_TABLE(X_PUEO_SERIALIZE)
 PUEO_IO_DISPATCH_TABLE(X_PUEO_READ)
 PUEO_IO_DISPATCH_TABLE(X_PUEO_CAST)
+PUEO_IO_DISPATCH_TABLE(X_PUEO_VIEW_AS)
 PUEO_IO_DISPATCH_TABLE(X_PUEO_DUMP)
 PUEO_IO_DISPATCH_TABLE(X_PUEO_INSERT_DB)
 
@@ -0,0 +1,56 @@
+#define _GNU_SOURCE
+#include "pueo/rawio.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+int main(int nargs, char **args)
+{
+  if (nargs < 2)
+  {
+    fprintf(stderr,"Usage: pueo-index data [index=data.idx] [run event]\n");
+    fprintf(stderr,"Builds the sidecar index for data (any uri pueo_handle_init understands).\n");
+    fprintf(stderr,"If a run and event are given, uses the existing index to find that event instead.\n");
+    return 1;
+  }
+
+  char * index_file = NULL;
+  if (nargs > 2) index_file = strdup(args[2]);
+  else asprintf(&index_file, "%s.idx", args[1]);
+
+  if (nargs > 4)
+  {
+    pueo_index_t * idx = pueo_index_open(index_file);
+    if (!idx)
+    {
+      fprintf(stderr,"Couldn't open index %s\n", index_file);
+      return 1;
+    }
+
+    pueo_handle_t h;
+    pueo_handle_init(&h, args[1], "r");
+    int r = pueo_handle_seek_event(&h, idx, atoi(args[3]), atoi(args[4]));
+    if (r)
+    {
+      fprintf(stderr,"Couldn't find run %s event %s (%d)\n", args[3], args[4], r);
+      return 1;
+    }
+    pueo_packet_t * packet = 0;
+    if (pueo_ll_read_realloc(&h, &packet) > 0) pueo_dump_packet(stdout, packet);
+    free(packet);
+    pueo_handle_close(&h);
+    pueo_index_close(idx);
+    free(index_file);
+    return 0;
+  }
+
+  pueo_index_t * idx = pueo_index_build(args[1], index_file);
+  if (!idx) return 1;
+  size_t n;
+  pueo_index_entries(idx, &n);
+  printf("Indexed %zu waveform packets from %s into %s\n", n, args[1], index_file);
+  pueo_index_close(idx);
+  free(index_file);
+  return 0;
+}
@@ -0,0 +1,781 @@
+#include "pueo/encode.h"
+#include <string.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#elif defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+/* All the arithmetic is modulo 2^16, so any residual fits in 16 bits after zigzagging
+ * and decoding gets back exactly what went in.
+ *
+ * The loops over whole vectors have SIMD kernels in front of them (see below): working out
+ * both predictors' residuals, and packing and unpacking fixed-width fields, for the block codec
+ * and plain bit-packing alike. Rebuilding each sample from the ones before it stays scalar.
+ */
+
+static inline uint16_t zigzag(uint16_t r)
+{
+  return (uint16_t) (r << 1) ^ (uint16_t) -(r >> 15);
+}
+
+static inline uint16_t unzigzag(uint16_t z)
+{
+  return (z >> 1) ^ (uint16_t) -(z & 1);
+}
+
+static inline int bit_width(uint32_t v)
+{
+  return v ? 32 - __builtin_clz(v) : 0;
+}
+
+/* SIMD kernels: NEON, which every aarch64 has, and AVX2, picked at runtime on x86 (unless we're built for AVX2 anyway).
+ * Each takes as many samples as it can in whole vectors and returns how many that was (0 if there's nothing to
+ * do it with), leaving the rest to the scalar loop after it.
+ *
+ *  - residuals_simd: both predictors' zigzagged residuals, and the OR of each, given the two samples before
+ *  - pack_fields_simd / unpack_fields_simd: the low w bits of each sample, back to back. Eight samples are always
+ *    w whole bytes, so the vectors build up four samples in each 64 bit lane (pairs in 32 bits first) and every
+ *    two lanes are stitched into w bytes.
+ *  - pack12_simd / unpack12_simd: 12 bits (what the digitizer gives us), two samples to three bytes directly
+ */
+
+#if defined(__ARM_NEON) || defined(__x86_64__)
+
+// eight w bit fields, four in each of lo and hi, to w bytes
+static inline void put_group(uint64_t lo, uint64_t hi, int w, uint8_t * out)
+{
+  uint64_t a = w < 16 ? lo | hi << 4 * w : lo;  // the first 64 bits
+  uint64_t b = w < 16 ? hi >> (64 - 4 * w) : hi; // and the rest
+  memcpy(out, &a, w < 8 ? w : 8);
+  if (w > 8) memcpy(out + 8, &b, w - 8);
+}
+
+// the reverse. If there are 16 bytes to read, reading them all and masking is quicker than reading just w
+static inline void get_group(const uint8_t * in, int w, bool room, uint64_t * lo, uint64_t * hi)
+{
+  uint64_t a = 0, b = 0;
+  if (room)
+  {
+    memcpy(&a, in, 8);
+    memcpy(&b, in + 8, 8);
+    if (w < 8) a &= (1ull << 8 * w) - 1;
+    b = w <= 8 ? 0 : w < 16 ? b & ((1ull << 8 * (w - 8)) - 1) : b;
+  }
+  else
+  {
+    memcpy(&a, in, w < 8 ? w : 8);
+    if (w > 8) memcpy(&b, in + 8, w - 8);
+  }
+  *lo = w < 16 ? a & ((1ull << 4 * w) - 1) : a;
+  *hi = w < 16 ? a >> 4 * w | b << (64 - 4 * w) : b;
+}
+
+#endif
+
+#if defined(__ARM_NEON)
+
+static inline uint16x8_t zigzag_neon(uint16x8_t r)
+{
+  return veorq_u16(vshlq_n_u16(r, 1), vreinterpretq_u16_s16(vshrq_n_s16(vreinterpretq_s16_u16(r), 15)));
+}
+
+static int residuals_simd(const uint16_t * t, int n, uint16_t * z1, uint16_t * z2, uint16_t * or1, uint16_t * or2)
+{
+  uint16x8_t o1 = vdupq_n_u16(0), o2 = vdupq_n_u16(0);
+  int j = 0;
+  for (; j + 8 <= n; j += 8)
+  {
+    uint16x8_t x = vld1q_u16(t + j + 2), p1 = vld1q_u16(t + j + 1), p2 = vld1q_u16(t + j);
+    uint16x8_t r1 = vsubq_u16(x, p1);
+    uint16x8_t r2 = vaddq_u16(vsubq_u16(r1, p1), p2);
+    r1 = zigzag_neon(r1);
+    r2 = zigzag_neon(r2);
+    vst1q_u16(z1 + j, r1);
+    vst1q_u16(z2 + j, r2);
+    o1 = vorrq_u16(o1, r1);
+    o2 = vorrq_u16(o2, r2);
+  }
+  uint16_t l1[8], l2[8];
+  vst1q_u16(l1, o1);
+  vst1q_u16(l2, o2);
+  for (int k = 0; k < 8; k++)
+  {
+    *or1 |= l1[k];
+    *or2 |= l2[k];
+  }
+  return j;
+}
+
+// 16 samples at a time: deinterleave into even and odd samples to make the pairs, then deinterleave the pairs to make the fours
+static int pack_fields_simd(const uint16_t * x, int n, int w, uint8_t * out)
+{
+  const uint16x8_t mask = vdupq_n_u16((1u << w) - 1);
+  const int32x4_t sw = vdupq_n_s32(w);
+  const int64x2_t s2w = vdupq_n_s64(2 * w);
+  int i = 0;
+  for (; i + 16 <= n; i += 16)
+  {
+    uint16x8x2_t v = vld2q_u16(x + i);
+    uint16x8_t a = vandq_u16(v.val[0], mask), b = vandq_u16(v.val[1], mask);
+    uint32x4_t plo = vorrq_u32(vmovl_u16(vget_low_u16(a)), vshlq_u32(vmovl_u16(vget_low_u16(b)), sw));
+    uint32x4_t phi = vorrq_u32(vmovl_u16(vget_high_u16(a)), vshlq_u32(vmovl_u16(vget_high_u16(b)), sw));
+    uint32x4x2_t p = vuzpq_u32(plo, phi);
+    uint64_t q[4];
+    vst1q_u64(q, vorrq_u64(vmovl_u32(vget_low_u32(p.val[0])), vshlq_u64(vmovl_u32(vget_low_u32(p.val[1])), s2w)));
+    vst1q_u64(q + 2, vorrq_u64(vmovl_u32(vget_high_u32(p.val[0])), vshlq_u64(vmovl_u32(vget_high_u32(p.val[1])), s2w)));
+    put_group(q[0], q[1], w, out + i / 8 * w);
+    put_group(q[2], q[3], w, out + i / 8 * w + w);
+  }
+  return i;
+}
+
+static int unpack_fields_simd(const uint8_t * in, int n, int w, uint16_t * x)
+{
+  const int nbytes = (n * w + 7) / 8;
+  const uint64x2_t m2w = vdupq_n_u64((1ull << 2 * w) - 1);
+  const int64x2_t r2w = vdupq_n_s64(-2 * w);
+  const uint32x4_t mw = vdupq_n_u32((1u << w) - 1);
+  const int32x4_t rw = vdupq_n_s32(-w);
+  int i = 0;
+  for (; i + 16 <= n; i += 16)
+  {
+    uint64_t q[4];
+    get_group(in + i / 8 * w, w, i / 8 * w + 16 <= nbytes, &q[0], &q[1]);
+    get_group(in + i / 8 * w + w, w, i / 8 * w + w + 16 <= nbytes, &q[2], &q[3]);
+    uint64x2_t q01 = vld1q_u64(q), q23 = vld1q_u64(q + 2);
+    uint32x4_t pe = vcombine_u32(vmovn_u64(vandq_u64(q01, m2w)), vmovn_u64(vandq_u64(q23, m2w)));
+    uint32x4_t po = vcombine_u32(vmovn_u64(vshlq_u64(q01, r2w)), vmovn_u64(vshlq_u64(q23, r2w)));
+    uint32x4x2_t p = vzipq_u32(pe, po);
+    uint16x8x2_t s;
+    s.val[0] = vcombine_u16(vmovn_u32(vandq_u32(p.val[0], mw)), vmovn_u32(vandq_u32(p.val[1], mw)));
+    s.val[1] = vcombine_u16(vmovn_u32(vshlq_u32(p.val[0], rw)), vmovn_u32(vshlq_u32(p.val[1], rw)));
+    vst2q_u16(x + i, s);
+  }
+  return i;
+}
+
+// 16 samples to 24 bytes: deinterleave into even and odd samples, make the three bytes of each pair, interleave those
+static int pack12_simd(const int16_t * samples, int n, uint8_t * out)
+{
+  const uint16x8_t mask = vdupq_n_u16(0xfff);
+  int i = 0;
+  for (; i + 16 <= n; i += 16)
+  {
+    uint16x8x2_t v = vld2q_u16((const uint16_t*) samples + i);
+    uint16x8_t a = vandq_u16(v.val[0], mask);
+    uint16x8_t b = vandq_u16(v.val[1], mask);
+    uint8x8x3_t o;
+    o.val[0] = vmovn_u16(a);
+    o.val[1] = vmovn_u16(vorrq_u16(vshrq_n_u16(a, 8), vshlq_n_u16(b, 4)));
+    o.val[2] = vmovn_u16(vshrq_n_u16(b, 4));
+    vst3_u8(out + 3 * (i / 2), o);
+  }
+  return i;
+}
+
+static int unpack12_simd(const uint8_t * in, int n, int16_t * samples)
+{
+  const uint16x8_t hi_nibble = vdupq_n_u16(0xf0);
+  int i = 0;
+  for (; i + 16 <= n; i += 16)
+  {
+    uint8x8x3_t t = vld3_u8(in + 3 * (i / 2));
+    uint16x8_t b0 = vmovl_u8(t.val[0]), b1 = vmovl_u8(t.val[1]), b2 = vmovl_u8(t.val[2]);
+    // each sample lands in the top 12 bits, then an arithmetic shift brings it down sign-extended
+    int16x8x2_t s;
+    s.val[0] = vshrq_n_s16(vreinterpretq_s16_u16(vshlq_n_u16(vorrq_u16(b0, vshlq_n_u16(b1, 8)), 4)), 4);
+    s.val[1] = vshrq_n_s16(vreinterpretq_s16_u16(vorrq_u16(vshlq_n_u16(b2, 8), vandq_u16(b1, hi_nibble))), 4);
+    vst2q_s16(samples + i, s);
+  }
+  return i;
+}
+
+#elif defined(__x86_64__)
+
+// exactly 12 bytes in and out, so the last vector doesn't touch anything past the samples
+__attribute__((target("avx2"))) static inline __m128i load12(const uint8_t * p)
+{
+  int64_t lo;
+  int32_t hi;
+  memcpy(&lo, p, sizeof(lo));
+  memcpy(&hi, p + 8, sizeof(hi));
+  return _mm_insert_epi32(_mm_cvtsi64_si128(lo), hi, 2);
+}
+
+__attribute__((target("avx2"))) static inline void store12(uint8_t * p, __m128i v)
+{
+  int32_t hi = _mm_extract_epi32(v, 2);
+  _mm_storel_epi64((__m128i*) p, v);
+  memcpy(p + 8, &hi, sizeof(hi));
+}
+
+// 16 samples to 24 bytes: each pair of samples becomes a + (b << 12) in a 32 bit lane (one madd), then the top byte of each lane is squeezed out
+__attribute__((target("avx2"))) static int pack12_avx2(const int16_t * samples, int n, uint8_t * out)
+{
+  const __m256i mask = _mm256_set1_epi16(0xfff);
+  const __m256i pair = _mm256_set1_epi32(0x10000001); // (1, 4096) for each pair
+  const __m256i squeeze = _mm256_setr_epi8(0,1,2, 4,5,6, 8,9,10, 12,13,14, -1,-1,-1,-1,
+                                           0,1,2, 4,5,6, 8,9,10, 12,13,14, -1,-1,-1,-1);
+  int i = 0;
+  for (; i + 16 <= n; i += 16)
+  {
+    __m256i v = _mm256_loadu_si256((const __m256i*) (samples + i));
+    v = _mm256_madd_epi16(_mm256_and_si256(v, mask), pair);
+    v = _mm256_shuffle_epi8(v, squeeze);
+    store12(out + 3 * (i / 2), _mm256_castsi256_si128(v));
+    store12(out + 3 * (i / 2) + 12, _mm256_extracti128_si256(v, 1));
+  }
+  return i;
+}
+
+// the reverse: spread each three bytes over two 16 bit lanes, move both samples to the top 12 bits, and shift them back down sign-extended
+__attribute__((target("avx2"))) static int unpack12_avx2(const uint8_t * in, int n, int16_t * samples)
+{
+  const __m256i spread = _mm256_setr_epi8(0,1,1,2, 3,4,4,5, 6,7,7,8, 9,10,10,11,
+                                          0,1,1,2, 3,4,4,5, 6,7,7,8, 9,10,10,11);
+  const __m256i shift = _mm256_set1_epi32(0x00010010); // (16, 1) for each pair
+  const __m256i mask = _mm256_set1_epi16((int16_t) 0xfff0);
+  int i = 0;
+  for (; i + 16 <= n; i += 16)
+  {
+    const uint8_t * b = in + 3 * (i / 2);
+    __m256i v = _mm256_inserti128_si256(_mm256_castsi128_si256(load12(b)), load12(b + 12), 1);
+    v = _mm256_shuffle_epi8(v, spread);
+    v = _mm256_and_si256(_mm256_mullo_epi16(v, shift), mask);
+    _mm256_storeu_si256((__m256i*) (samples + i), _mm256_srai_epi16(v, 4));
+  }
+  return i;
+}
+
+__attribute__((target("avx2"))) static inline __m256i zigzag_avx2(__m256i r)
+{
+  return _mm256_xor_si256(_mm256_slli_epi16(r, 1), _mm256_srai_epi16(r, 15));
+}
+
+__attribute__((target("avx2"))) static inline uint16_t or_lanes(__m256i v)
+{
+  __m128i x = _mm_or_si128(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+  x = _mm_or_si128(x, _mm_srli_si128(x, 8));
+  x = _mm_or_si128(x, _mm_srli_si128(x, 4));
+  x = _mm_or_si128(x, _mm_srli_si128(x, 2));
+  return _mm_extract_epi16(x, 0);
+}
+
+__attribute__((target("avx2"))) static int residuals_avx2(const uint16_t * t, int n, uint16_t * z1, uint16_t * z2, uint16_t * or1, uint16_t * or2)
+{
+  __m256i o1 = _mm256_setzero_si256(), o2 = _mm256_setzero_si256();
+  int j = 0;
+  for (; j + 16 <= n; j += 16)
+  {
+    __m256i x = _mm256_loadu_si256((const __m256i*) (t + j + 2));
+    __m256i p1 = _mm256_loadu_si256((const __m256i*) (t + j + 1));
+    __m256i p2 = _mm256_loadu_si256((const __m256i*) (t + j));
+    __m256i r1 = _mm256_sub_epi16(x, p1);
+    __m256i r2 = _mm256_add_epi16(_mm256_sub_epi16(r1, p1), p2);
+    r1 = zigzag_avx2(r1);
+    r2 = zigzag_avx2(r2);
+    _mm256_storeu_si256((__m256i*) (z1 + j), r1);
+    _mm256_storeu_si256((__m256i*) (z2 + j), r2);
+    o1 = _mm256_or_si256(o1, r1);
+    o2 = _mm256_or_si256(o2, r2);
+  }
+  *or1 |= or_lanes(o1);
+  *or2 |= or_lanes(o2);
+  return j;
+}
+
+// 16 samples at a time: a | b << w for each pair in its 32 bit lane, then p | q << 2w for each two pairs in their 64 bit lane
+__attribute__((target("avx2"))) static int pack_fields_avx2(const uint16_t * x, int n, int w, uint8_t * out)
+{
+  const __m256i mask = _mm256_set1_epi16((1u << w) - 1);
+  const __m256i lo16 = _mm256_set1_epi32(0xffff);
+  const __m256i lo32 = _mm256_set1_epi64x(0xffffffff);
+  const __m128i sw = _mm_cvtsi32_si128(w), s2w = _mm_cvtsi32_si128(2 * w);
+  int i = 0;
+  for (; i + 16 <= n; i += 16)
+  {
+    __m256i v = _mm256_and_si256(_mm256_loadu_si256((const __m256i*) (x + i)), mask);
+    v = _mm256_or_si256(_mm256_and_si256(v, lo16), _mm256_sll_epi32(_mm256_srli_epi32(v, 16), sw));
+    v = _mm256_or_si256(_mm256_and_si256(v, lo32), _mm256_sll_epi64(_mm256_srli_epi64(v, 32), s2w));
+    uint64_t q[4];
+    _mm256_storeu_si256((__m256i*) q, v);
+    put_group(q[0], q[1], w, out + i / 8 * w);
+    put_group(q[2], q[3], w, out + i / 8 * w + w);
+  }
+  return i;
+}
+
+// the reverse, splitting each 64 bit lane into pairs and each 32 bit lane into samples
+__attribute__((target("avx2"))) static int unpack_fields_avx2(const uint8_t * in, int n, int w, uint16_t * x)
+{
+  const int nbytes = (n * w + 7) / 8;
+  const __m256i m2w = _mm256_set1_epi64x((1ull << 2 * w) - 1);
+  const __m256i mw = _mm256_set1_epi32((1u << w) - 1);
+  const __m128i sw = _mm_cvtsi32_si128(w), s2w = _mm_cvtsi32_si128(2 * w);
+  int i = 0;
+  for (; i + 16 <= n; i += 16)
+  {
+    uint64_t q[4];
+    get_group(in + i / 8 * w, w, i / 8 * w + 16 <= nbytes, &q[0], &q[1]);
+    get_group(in + i / 8 * w + w, w, i / 8 * w + w + 16 <= nbytes, &q[2], &q[3]);
+    __m256i v = _mm256_loadu_si256((const __m256i*) q);
+    v = _mm256_or_si256(_mm256_and_si256(v, m2w), _mm256_slli_epi64(_mm256_srl_epi64(v, s2w), 32));
+    v = _mm256_or_si256(_mm256_and_si256(v, mw), _mm256_slli_epi32(_mm256_srl_epi32(v, sw), 16));
+    _mm256_storeu_si256((__m256i*) (x + i), v);
+  }
+  return i;
+}
+
+static bool have_avx2(void)
+{
+#ifdef __AVX2__
+  return true;
+#else
+  return __builtin_cpu_supports("avx2");
+#endif
+}
+
+static int pack12_simd(const int16_t * samples, int n, uint8_t * out)
+{
+  return have_avx2() ? pack12_avx2(samples, n, out) : 0;
+}
+
+static int unpack12_simd(const uint8_t * in, int n, int16_t * samples)
+{
+  return have_avx2() ? unpack12_avx2(in, n, samples) : 0;
+}
+
+static int residuals_simd(const uint16_t * t, int n, uint16_t * z1, uint16_t * z2, uint16_t * or1, uint16_t * or2)
+{
+  return have_avx2() ? residuals_avx2(t, n, z1, z2, or1, or2) : 0;
+}
+
+static int pack_fields_simd(const uint16_t * x, int n, int w, uint8_t * out)
+{
+  return have_avx2() ? pack_fields_avx2(x, n, w, out) : 0;
+}
+
+static int unpack_fields_simd(const uint8_t * in, int n, int w, uint16_t * x)
+{
+  return have_avx2() ? unpack_fields_avx2(in, n, w, x) : 0;
+}
+
+#else
+
+static int pack12_simd(const int16_t * samples, int n, uint8_t * out) { (void) samples; (void) n; (void) out; return 0; }
+static int unpack12_simd(const uint8_t * in, int n, int16_t * samples) { (void) in; (void) n; (void) samples; return 0; }
+static int residuals_simd(const uint16_t * t, int n, uint16_t * z1, uint16_t * z2, uint16_t * or1, uint16_t * or2)
+{
+  (void) t; (void) n; (void) z1; (void) z2; (void) or1; (void) or2;
+  return 0;
+}
+static int pack_fields_simd(const uint16_t * x, int n, int w, uint8_t * out) { (void) x; (void) n; (void) w; (void) out; return 0; }
+static int unpack_fields_simd(const uint8_t * in, int n, int w, uint16_t * x) { (void) in; (void) n; (void) w; (void) x; return 0; }
+
+#endif
+
+// zigzagged residuals of both predictors for one block, returning the width each needs
+static void block_residuals(const uint16_t * x, int n, uint16_t p1, uint16_t p2,
+                            uint16_t z1[PUEO_ENCODE_BLOCK], uint16_t z2[PUEO_ENCODE_BLOCK], int * w1, int * w2)
+{
+  // the two samples before the block, then the block, so sample j is predicted from t[j+1] and t[j]
+  uint16_t t[PUEO_ENCODE_BLOCK + 2];
+  t[0] = p2;
+  t[1] = p1;
+  memcpy(t + 2, x, n * sizeof(*x));
+
+  uint16_t or1 = 0, or2 = 0;
+  for (int j = residuals_simd(t, n, z1, z2, &or1, &or2); j < n; j++)
+  {
+    z1[j] = zigzag(t[j+2] - t[j+1]);
+    z2[j] = zigzag(t[j+2] - 2 * t[j+1] + t[j]);
+    or1 |= z1[j];
+    or2 |= z2[j];
+  }
+  *w1 = bit_width(or1);
+  *w2 = bit_width(or2);
+}
+
+// the low w bits of each of n samples, back to back from the lowest bit, in (n * w + 7) / 8 bytes
+static int pack_fields(const uint16_t * x, int n, int w, uint8_t * out)
+{
+  int i = w ? pack_fields_simd(x, n, w, out) : 0; // (nothing to pack at 0 bits)
+  uint16_t mask = (1u << w) - 1;
+  uint64_t acc = 0;
+  int nacc = 0, nout = i / 8 * w;
+  for (; i < n; i++)
+  {
+    acc |= (uint64_t) (x[i] & mask) << nacc;
+    nacc += w;
+    while (nacc >= 8)
+    {
+      out[nout++] = acc;
+      acc >>= 8;
+      nacc -= 8;
+    }
+  }
+  if (nacc) out[nout++] = acc;
+  return nout;
+}
+
+// the reverse, returning how many bytes that was
+static int unpack_fields(const uint8_t * in, int n, int w, uint16_t * x)
+{
+  int i = w ? unpack_fields_simd(in, n, w, x) : 0;
+  uint16_t mask = (1u << w) - 1;
+  uint64_t acc = 0;
+  int nacc = 0, pos = i / 8 * w;
+  for (; i < n; i++)
+  {
+    while (nacc < w)
+    {
+      acc |= (uint64_t) in[pos++] << nacc;
+      nacc += 8;
+    }
+    x[i] = acc & mask;
+    acc >>= w;
+    nacc -= w;
+  }
+  return pos;
+}
+
+static int encode_packed(const uint16_t * x, int nsamples, uint8_t * out, int capacity)
+{
+  uint16_t z1[PUEO_ENCODE_BLOCK], z2[PUEO_ENCODE_BLOCK];
+  uint16_t p1 = 0, p2 = 0;
+  int nout = 0;
+  for (int i = 0; i < nsamples; i += PUEO_ENCODE_BLOCK)
+  {
+    int n = nsamples - i < PUEO_ENCODE_BLOCK ? nsamples - i : PUEO_ENCODE_BLOCK;
+    int w1, w2;
+    block_residuals(x + i, n, p1, p2, z1, z2, &w1, &w2);
+    bool second = w2 < w1;
+    int w = second ? w2 : w1;
+
+    int nbytes = 1 + (n * w + 7) / 8;
+    if (nout + nbytes > capacity) return -1;
+    out[nout++] = w | (second ? 0x80 : 0);
+    nout += pack_fields(second ? z2 : z1, n, w, out + nout);
+
+    p2 = n > 1 ? x[i + n - 2] : p1;
+    p1 = x[i + n - 1];
+  }
+  return nout;
+}
+
+int pueo_encode_samples(const int16_t * samples, int nsamples, uint8_t * out, int capacity, uint16_t * flags)
+{
+  if (nsamples < 0) return -1;
+  int raw_size = nsamples * sizeof(*samples);
+
+  // only worth it if it's smaller than the raw samples
+  int limit = capacity < raw_size ? capacity : raw_size - 1;
+  int nbytes = encode_packed((const uint16_t*) samples, nsamples, out, limit);
+  if (nbytes >= 0)
+  {
+    *flags = (*flags & ~PUEO_ENCODING_MASK) | PUEO_ENCODING_PACKED;
+    return nbytes;
+  }
+
+  if (raw_size > capacity) return -1;
+  memcpy(out, samples, raw_size);
+  *flags = (*flags & ~PUEO_ENCODING_MASK) | PUEO_ENCODING_RAW;
+  return raw_size;
+}
+
+static int decode_packed(const uint8_t * in, int nbytes, uint16_t * x, int nsamples)
+{
+  uint16_t p1 = 0, p2 = 0;
+  int pos = 0;
+  for (int i = 0; i < nsamples; i += PUEO_ENCODE_BLOCK)
+  {
+    int n = nsamples - i < PUEO_ENCODE_BLOCK ? nsamples - i : PUEO_ENCODE_BLOCK;
+    if (pos >= nbytes) return -1;
+    int w = in[pos] & 0x1f;
+    bool second = in[pos] & 0x80;
+    pos++;
+    if (w > 16 || pos + (n * w + 7) / 8 > nbytes) return -1;
+
+    uint16_t z[PUEO_ENCODE_BLOCK];
+    pos += unpack_fields(in + pos, n, w, z);
+    for (int j = 0; j < n; j++)
+    {
+      uint16_t r = unzigzag(z[j]);
+      uint16_t v = second ? r + 2 * p1 - p2 : r + p1;
+      x[i + j] = v;
+      p2 = p1;
+      p1 = v;
+    }
+  }
+  return pos == nbytes ? nsamples : -1;
+}
+
+/* Lossy encoding: the kept samples are requantized to q = round((x - offset) / step), then encoded as usual.
+ * Decoding gives offset + q * step for each kept sample and linearly interpolates between them.
+ */
+_Static_assert(sizeof(pueo_quantized_head_t) == 8, "the quantized header is part of the encoded bytes");
+#define QHEAD_SIZE sizeof(pueo_quantized_head_t)
+
+static inline int32_t div_round(int32_t num, int32_t den)
+{
+  return num >= 0 ? (num + den / 2) / den : -((-num + den / 2) / den);
+}
+
+static inline int16_t clamp16(int32_t v)
+{
+  return v > INT16_MAX ? INT16_MAX : v < INT16_MIN ? INT16_MIN : v;
+}
+
+static void dequantize(const int16_t * q, int nq, const pueo_quantized_head_t * qh, int16_t * samples, int nsamples)
+{
+  int d = qh->decimation > 1 ? qh->decimation : 1;
+  for (int j = 0; j < nsamples; j++)
+  {
+    int k = j / d, r = j % d;
+    int32_t a = qh->offset + (int32_t) q[k] * qh->step;
+    if (r == 0 || k + 1 >= nq)
+    {
+      samples[j] = clamp16(a); // past the last kept sample, it's held
+      continue;
+    }
+    int32_t b = qh->offset + (int32_t) q[k+1] * qh->step;
+    samples[j] = clamp16(a + div_round((b - a) * r, d));
+  }
+}
+
+static int encode_quantized(const int16_t * x, int nsamples, uint8_t * out, int capacity, const pueo_quantize_opts_t * opts, int * max_error)
+{
+  int d = opts->decimation > 1 ? opts->decimation : 1;
+  int nq = (nsamples + d - 1) / d;
+  if (nsamples > PUEO_MAX_BUFFER_LENGTH || capacity < (int) QHEAD_SIZE) return -1;
+  int bits = opts->bits < 2 ? 2 : opts->bits > 16 ? 16 : opts->bits;
+  int32_t qmax = (1 << (bits - 1)) - 1;
+
+  pueo_quantized_head_t qh = { .offset = opts->offset, .step = opts->step, .decimation = d };
+  if (!qh.step)
+  {
+    // centered on the waveform's range, with the step just big enough to cover it
+    int32_t lo = INT16_MAX, hi = INT16_MIN;
+    for (int i = 0; i < nq; i++)
+    {
+      if (x[i*d] < lo) lo = x[i*d];
+      if (x[i*d] > hi) hi = x[i*d];
+    }
+    if (!nq) lo = hi = 0;
+    qh.offset = (lo + hi) >> 1;
+    int32_t half = hi - qh.offset > qh.offset - lo ? hi - qh.offset : qh.offset - lo;
+    qh.step = half > qmax ? (half + qmax - 1) / qmax : 1;
+  }
+
+  int16_t q[PUEO_MAX_BUFFER_LENGTH];
+  for (int i = 0; i < nq; i++)
+  {
+    int32_t v = div_round(x[i*d] - qh.offset, qh.step);
+    q[i] = v > qmax ? qmax : v < -qmax - 1 ? -qmax - 1 : v;
+  }
+
+  // the error bound is measured on what decoding will actually give
+  int16_t y[PUEO_MAX_BUFFER_LENGTH];
+  dequantize(q, nq, &qh, y, nsamples);
+  int32_t err = 0;
+  for (int i = 0; i < nsamples; i++)
+  {
+    int32_t e = y[i] > x[i] ? y[i] - x[i] : x[i] - y[i];
+    if (e > err) err = e;
+  }
+  qh.max_error = err > UINT16_MAX ? UINT16_MAX : err;
+
+  uint16_t inner = 0;
+  int nbytes = pueo_encode_samples(q, nq, out + QHEAD_SIZE, capacity - QHEAD_SIZE, &inner);
+  if (nbytes < 0) return nbytes;
+  qh.inner = inner & PUEO_ENCODING_MASK;
+  memcpy(out, &qh, QHEAD_SIZE);
+  if (max_error) *max_error = err;
+  return QHEAD_SIZE + nbytes;
+}
+
+static int decode_quantized(const uint8_t * in, int nbytes, int16_t * samples, int nsamples)
+{
+  if (nbytes < (int) QHEAD_SIZE) return -1;
+  pueo_quantized_head_t qh;
+  memcpy(&qh, in, QHEAD_SIZE);
+  int d = qh.decimation > 1 ? qh.decimation : 1;
+  int nq = (nsamples + d - 1) / d;
+  if (!qh.step || nq > PUEO_MAX_BUFFER_LENGTH || (qh.inner != PUEO_ENCODING_RAW && qh.inner != PUEO_ENCODING_PACKED)) return -1;
+
+  int16_t q[PUEO_MAX_BUFFER_LENGTH];
+  if (pueo_decode_samples(in + QHEAD_SIZE, nbytes - QHEAD_SIZE, qh.inner, q, nq) != nq) return -1;
+  dequantize(q, nq, &qh, samples, nsamples);
+  return nsamples;
+}
+
+int pueo_decode_samples(const uint8_t * in, int nbytes, uint16_t flags, int16_t * samples, int nsamples)
+{
+  if (nsamples < 0) return -1;
+  switch (flags & PUEO_ENCODING_MASK)
+  {
+    case PUEO_ENCODING_RAW:
+      if (nbytes != nsamples * (int) sizeof(*samples)) return -1;
+      memcpy(samples, in, nbytes);
+      return nsamples;
+    case PUEO_ENCODING_PACKED:
+      return decode_packed(in, nbytes, (uint16_t*) samples, nsamples);
+    case PUEO_ENCODING_QUANTIZED:
+      return decode_quantized(in, nbytes, samples, nsamples);
+    default:
+      return -1;
+  }
+}
+
+int pueo_encode_samples_lossy(const int16_t * samples, int nsamples, uint8_t * out, int capacity, uint16_t * flags,
+                              const pueo_quantize_opts_t * opts, int * max_error)
+{
+  if (max_error) *max_error = 0;
+  if (!opts || !opts->bits) return pueo_encode_samples(samples, nsamples, out, capacity, flags);
+  if (nsamples < 0) return -1;
+
+  int nbytes = encode_quantized(samples, nsamples, out, capacity, opts, max_error);
+  if (nbytes < 0) return nbytes;
+  *flags = (*flags & ~PUEO_ENCODING_MASK) | PUEO_ENCODING_QUANTIZED;
+  return nbytes;
+}
+
+int pueo_encode_waveform(const pueo_waveform_t * wf, pueo_encoded_waveform_t * enc)
+{
+  return pueo_encode_waveform_lossy(wf, enc, NULL);
+}
+
+int pueo_encode_single_waveform(const pueo_single_waveform_t * wf, pueo_encoded_waveform_t * enc)
+{
+  return pueo_encode_single_waveform_lossy(wf, enc, NULL);
+}
+
+int pueo_encode_waveform_lossy(const pueo_waveform_t * wf, pueo_encoded_waveform_t * enc, const pueo_quantize_opts_t * opts)
+{
+  if (wf->length > PUEO_MAX_BUFFER_LENGTH) return -1;
+  enc->channel_id = wf->channel_id;
+  enc->nsamples = wf->length;
+  int nbytes = pueo_encode_samples_lossy(wf->data, wf->length, enc->encoded, sizeof(enc->encoded), &enc->encoded_flags, opts, NULL);
+  if (nbytes < 0) return nbytes;
+  enc->encoded_nbytes = nbytes;
+  return nbytes;
+}
+
+int pueo_encode_single_waveform_lossy(const pueo_single_waveform_t * wf, pueo_encoded_waveform_t * enc, const pueo_quantize_opts_t * opts)
+{
+  enc->run = wf->run;
+  enc->event = wf->event;
+  enc->readout_time = wf->readout_time;
+  return pueo_encode_waveform_lossy(&wf->wf, enc, opts);
+}
+
+int pueo_encode_single_waveform_by_priority(const pueo_single_waveform_t * wf, pueo_encoded_waveform_t * enc, const pueo_quantize_opts_t opts[4])
+{
+  enc->flags = wf->prio.signal_level;
+  return pueo_encode_single_waveform_lossy(wf, enc, opts ? &opts[wf->prio.signal_level] : NULL);
+}
+
+int pueo_encoded_waveform_max_error(const pueo_encoded_waveform_t * enc)
+{
+  if ((enc->encoded_flags & PUEO_ENCODING_MASK) != PUEO_ENCODING_QUANTIZED) return 0;
+  if (enc->encoded_nbytes < QHEAD_SIZE) return -1;
+  pueo_quantized_head_t qh;
+  memcpy(&qh, enc->encoded, QHEAD_SIZE);
+  return qh.max_error;
+}
+
+int pueo_decode_waveform(const pueo_encoded_waveform_t * enc, pueo_waveform_t * wf)
+{
+  if (enc->nsamples > PUEO_MAX_BUFFER_LENGTH || enc->encoded_nbytes > sizeof(enc->encoded)) return -1;
+  wf->channel_id = enc->channel_id;
+  wf->surf_word = 0;
+  int n = pueo_decode_samples(enc->encoded, enc->encoded_nbytes, enc->encoded_flags, wf->data, enc->nsamples);
+  wf->length = n < 0 ? 0 : n;
+  return n;
+}
+
+int pueo_decode_single_waveform(const pueo_encoded_waveform_t * enc, pueo_single_waveform_t * wf)
+{
+  memset(wf, 0, offsetof(pueo_single_waveform_t, wf));
+  wf->run = enc->run;
+  wf->event = enc->event;
+  wf->readout_time = enc->readout_time;
+  return pueo_decode_waveform(enc, &wf->wf);
+}
+
+/* Plain bit-packing. 12 bits has its own loop, two samples to three bytes, as does 16 (nothing to do);
+ * everything else is packed as fields.
+ */
+
+int pueo_pack_width(const int16_t * samples, int n)
+{
+  uint16_t bits = 0;
+  for (int i = 0; i < n; i++)
+  {
+    bits |= (uint16_t) (samples[i] ^ (samples[i] >> 15)); // magnitude bits, for either sign
+  }
+  return bit_width(bits) + 1;
+}
+
+int pueo_pack_samples(const int16_t * samples, int n, int width, uint8_t * out)
+{
+  const uint16_t * x = (const uint16_t*) samples;
+  int nbytes = (n * width + 7) / 8;
+  if (width == 16)
+  {
+    memcpy(out, x, nbytes);
+    return nbytes;
+  }
+
+  int i = 0;
+  if (width == 12)
+  {
+    for (i = pack12_simd(samples, n, out); i + 1 < n; i += 2)
+    {
+      uint16_t a = x[i] & 0xfff, b = x[i+1] & 0xfff;
+      out[3*(i/2)]   = a;
+      out[3*(i/2)+1] = (a >> 8) | (b << 4);
+      out[3*(i/2)+2] = b >> 4;
+    }
+    if (i < n) out[3*(i/2)] = x[i], out[3*(i/2)+1] = (x[i] >> 8) & 0xf;
+    return nbytes;
+  }
+
+  return pack_fields(x, n, width, out);
+}
+
+int pueo_unpack_samples(const uint8_t * in, int n, int width, int16_t * samples)
+{
+  uint16_t * x = (uint16_t*) samples;
+  int nbytes = (n * width + 7) / 8;
+  if (width == 16)
+  {
+    memcpy(x, in, nbytes);
+    return nbytes;
+  }
+
+  if (width == 12)
+  {
+    int nsimd = unpack12_simd(in, n, samples);
+    int i;
+    for (i = nsimd; i + 1 < n; i += 2)
+    {
+      const uint8_t * b = in + 3*(i/2);
+      x[i]   = (uint16_t) ((b[0] | (b[1] << 8)) << 4);
+      x[i+1] = (uint16_t) ((b[1] | (b[2] << 8)) & 0xfff0);
+    }
+    if (i < n) x[i] = (uint16_t) ((in[3*(i/2)] | (in[3*(i/2)+1] << 8)) << 4);
+    for (int j = nsimd; j < n; j++) samples[j] = (int16_t) x[j] >> 4;
+    return nbytes;
+  }
+
+  // sign extension, by moving the top bit up to bit 15 and back
+  unpack_fields(in, n, width, x);
+  int shift = 16 - width;
+  for (int i = 0; i < n; i++) samples[i] = (int16_t) (uint16_t) (x[i] << shift) >> shift;
+  return nbytes;
+}
@@ -24,6 +24,8 @@
 
 #include "pueo/rawio.h"
 #include "rawio_packets.h"
+#include "rawio_bgz.h"
+#include "pueocrc.h"
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -36,20 +38,124 @@
 #include <sys/types.h>
 #include <arpa/inet.h>
 #include <netdb.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <time.h>
 
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#define PUEO_HAVE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#endif
 
-enum pueo_handle_flags
+#ifdef ZSTD_ENABLED
+#include <zstd.h>
+#endif
+
+
+#define UDP_BUF_SIZE 65536 // slightly bigger than max UDP packet size of 65507
+#define UDP_MAX 65507
+
+// Packets too big for a datagram are split into fragments, each starting with this instead of a packet header
+struct udp_frag_head
+{
+  uint32_t seq;     // which packet, counted by the writer
+  uint8_t marker;   // UDP_FRAG_MARKER, in the same place as a packet header's f1
+  uint8_t index;    // which fragment
+  uint8_t nfrags;
+  uint8_t reserved;
+  uint32_t total;   // bytes in the whole packet
+};
+
+#define UDP_FRAG_MARKER 0xf2
+#define UDP_FRAG_PAYLOAD (UDP_MAX - sizeof(struct udp_frag_head))
+#define UDP_FRAG_MAX_TOTAL (sizeof(pueo_packet_head_t) + (1 << 20)) // num_bytes is 20 bits
+
+// a packet being reassembled
+struct udp_reasm
 {
-  PUEO_HANDLE_ALREADY_READ_HEAD = 1,
+  uint8_t * buf;
+  size_t cap;
+  uint32_t seq;
+  uint32_t total;
+  uint32_t have;  // bitmap of fragments received
+  int nfrags;     // 0 if the slot is free
+  struct timespec started;
 };
 
 struct udp_aux
 {
   int socket;
-  uint16_t nin;
-  uint16_t nout;
-  char buf[65524]; // slightly bigger than max UDP packet size of 65507 so that we pad the page
-                   // we could save some memory by making this smaller,but if we don't use it it's just virtual memory anyway.
+  int batch;         // datagrams per recvmmsg / sendmmsg
+  int max_delay_ms;  // writing: how long a packet may sit in the queue or in a coalesced datagram
+  int coalesce;      // writing: keep adding packets to a datagram until it's this big (0 for one packet per datagram)
+  bool at_packet_start; // writing: the next write is a packet header
+  uint32_t packet_start; // writing: where the packet being written starts in the current datagram
+  uint8_t * pool;    // batch buffers of UDP_BUF_SIZE. Mostly virtual memory if unused.
+  struct mmsghdr * msgs;
+  struct iovec * iovs;
+  uint8_t * cmsgs;   // reading: room for the SO_RXQ_OVFL counter of each datagram
+  int ndgrams;       // reading: datagrams in the pool. writing: datagrams queued
+  int cur;           // reading: the datagram being read
+  struct timespec first_queued;
+  struct timespec dgram_started; // writing: when the first packet went into the current datagram
+  uint32_t nin;      // bytes in the current datagram (or reassembled packet)
+  uint32_t nout;     // reading: bytes already read from the current datagram
+  const uint8_t * rbuf; // reading: the current datagram (or reassembled packet)
+
+  // fragmentation
+  uint32_t frag_seq;   // writing: sequence number of the last fragmented packet
+  uint32_t frag_total; // writing: size of the packet being fragmented, 0 if not fragmenting
+  int frag_index;      // writing: fragment being filled
+  struct udp_reasm * reasm; // reading
+  int nreasm;
+  int reasm_timeout_ms;
+  uint64_t kernel_dropped;
+  uint64_t reasm_dropped;
+
+  // writing with batch or coalesce: a thread sends whatever has waited max_delay_ms, even if nothing else gets written.
+  // While it runs, everything above is protected by mu.
+  bool timed;
+  bool closing;
+  bool flusher_idle;   // waiting for something to be held back
+  uint64_t send_dropped; // datagrams that couldn't be sent, not yet added to packets_dropped
+  pthread_mutex_t mu;
+  pthread_cond_t cv;
+  pthread_t flusher;
+};
+
+#define UDP_DGRAM(aux,i) ((aux)->pool + (size_t) (i) * UDP_BUF_SIZE)
+#define UDP_CMSG_SIZE CMSG_SPACE(sizeof(uint32_t))
+
+struct stream_aux
+{
+  int fd;
+  int timeout_ms;   // how long to wait for the other end, -1 for forever
+  bool cork;
+  char * unlink_path; // unix socket we're listening on, removed on close
+};
+
+struct mmap_aux
+{
+  const uint8_t * base;
+  size_t size;
+  size_t pos;
+};
+
+struct mem_aux
+{
+  uint8_t * buf;
+  size_t len;  // bytes written (or the size of the span)
+  size_t cap;  // 0 if buf is the caller's
+  size_t pos;  // read position
 };
 
 
@@ -73,77 +179,631 @@ static int fd_writebytes(size_t nbytes, const void * bytes, pueo_handle_t * h)
   return write(fd, bytes, nbytes);
 }
 
+static int fd_writebytesv(const struct iovec * iov, int iovcnt, pueo_handle_t * h)
+{
+  int fd = (intptr_t) h->aux;
+  return writev(fd, iov, iovcnt);
+}
+
 static int fd_readbytes(size_t nbytes, void * bytes, pueo_handle_t  *h)
 {
   int fd = (intptr_t) h->aux;
   return read(fd, bytes, nbytes);
 }
 
+static int fd_seek(uint64_t offset, pueo_handle_t *h)
+{
+  int fd = (intptr_t) h->aux;
+  return lseek(fd, offset, SEEK_SET) == (off_t) offset ? 0 : -1;
+}
+
+// fails for pipes and sockets, which then get read through
+static int fd_skipbytes(size_t nbytes, pueo_handle_t *h)
+{
+  int fd = (intptr_t) h->aux;
+  return lseek(fd, nbytes, SEEK_CUR) < 0 ? -1 : (int) nbytes;
+}
+
 static int fd_close(pueo_handle_t * h)
 {
   int fd = (intptr_t) h->aux;
   return close(fd);
 }
 
+static void udp_free(struct udp_aux * aux)
+{
+  if (aux->socket >= 0) close(aux->socket);
+  free(aux->pool);
+  free(aux->msgs);
+  free(aux->iovs);
+  free(aux->cmsgs);
+  for (int i = 0; i < aux->nreasm; i++) free(aux->reasm[i].buf);
+  free(aux->reasm);
+  free(aux);
+}
+
+// sends all queued datagrams. Any that can't be sent are counted as dropped.
+static int socket_send_queued(struct udp_aux * aux)
+{
+  int nsent = 0;
+  int r = 0;
+  while (nsent < aux->ndgrams)
+  {
+    int n = sendmmsg(aux->socket, aux->msgs + nsent, aux->ndgrams - nsent, 0);
+    if (n < 0)
+    {
+      if (errno == EINTR) continue;
+      aux->send_dropped += aux->ndgrams - nsent;
+      r = -1;
+      break;
+    }
+    nsent += n;
+  }
+  aux->ndgrams = 0;
+  return r;
+}
+
+static long ms_since(const struct timespec * then)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - then->tv_sec) * 1000 + (now.tv_nsec - then->tv_nsec) / 1000000;
+}
+
+// finishes the datagram being written, either sending it or adding it to the queue
+static int socket_end_dgram(struct udp_aux * aux)
+{
+  int r = 0;
+  int socket = aux->socket;
+  if (!aux->nin) return 0;
+  if (aux->batch == 1)
+  {
+    if (write(socket, UDP_DGRAM(aux,0), aux->nin) < 0)
+    {
+      r = -1;
+    }
+    aux->nin = 0;
+    return r;
+  }
+
+  // queue it, and send the batch when it's full or has been sitting around too long
+  if (!aux->ndgrams) clock_gettime(CLOCK_MONOTONIC, &aux->first_queued);
+  aux->iovs[aux->ndgrams].iov_len = aux->nin;
+  aux->ndgrams++;
+  aux->nin = 0;
+
+  if (aux->ndgrams < aux->batch && ms_since(&aux->first_queued) < aux->max_delay_ms) return 0;
+  return socket_send_queued(aux);
+}
+
+static void udp_lock(struct udp_aux * aux)
+{
+  if (aux->timed) pthread_mutex_lock(&aux->mu);
+}
+
+// also hands over what the flusher dropped, and wakes it if something is now being held back
+static void udp_unlock(pueo_handle_t * h)
+{
+  struct udp_aux  * aux = ( struct udp_aux*)  h->aux;
+  h->packets_dropped += aux->send_dropped;
+  aux->send_dropped = 0;
+  if (!aux->timed) return;
+  if (aux->flusher_idle && aux->at_packet_start && (aux->nin || aux->ndgrams)) pthread_cond_signal(&aux->cv);
+  pthread_mutex_unlock(&aux->mu);
+}
+
+// when the oldest held-back packet is due, if there is one
+static bool udp_deadline(const struct udp_aux * aux, struct timespec * when)
+{
+  const struct timespec * oldest = NULL;
+  if (aux->ndgrams) oldest = &aux->first_queued;
+  if (aux->coalesce && aux->nin && (!oldest || aux->dgram_started.tv_sec < oldest->tv_sec ||
+      (aux->dgram_started.tv_sec == oldest->tv_sec && aux->dgram_started.tv_nsec < oldest->tv_nsec)))
+  {
+    oldest = &aux->dgram_started;
+  }
+  if (!oldest) return false;
+
+  *when = *oldest;
+  when->tv_sec += aux->max_delay_ms / 1000;
+  when->tv_nsec += (aux->max_delay_ms % 1000) * 1000000L;
+  if (when->tv_nsec >= 1000000000L)
+  {
+    when->tv_sec++;
+    when->tv_nsec -= 1000000000L;
+  }
+  return true;
+}
+
+// sends held-back datagrams once they're due. Only between packets, so nothing half-written goes out.
+static void * udp_flusher(void * arg)
+{
+  struct udp_aux * aux = (struct udp_aux*) arg;
+  pthread_mutex_lock(&aux->mu);
+  while (!aux->closing)
+  {
+    struct timespec due, now;
+    if (!aux->at_packet_start || !udp_deadline(aux, &due))
+    {
+      aux->flusher_idle = true;
+      pthread_cond_wait(&aux->cv, &aux->mu);
+      aux->flusher_idle = false;
+      continue;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (now.tv_sec > due.tv_sec || (now.tv_sec == due.tv_sec && now.tv_nsec >= due.tv_nsec))
+    {
+      socket_end_dgram(aux);
+      if (aux->ndgrams) socket_send_queued(aux);
+    }
+    else pthread_cond_timedwait(&aux->cv, &aux->mu, &due);
+  }
+  pthread_mutex_unlock(&aux->mu);
+  return NULL;
+}
+
 static int socket_close(pueo_handle_t *h)
 {
   struct udp_aux  * aux = ( struct udp_aux*)  h->aux;
   if (!aux) return 0;
-  close(aux->socket);
-  free(aux);
+  if (aux->timed)
+  {
+    pthread_mutex_lock(&aux->mu);
+    aux->closing = true;
+    pthread_cond_signal(&aux->cv);
+    pthread_mutex_unlock(&aux->mu);
+    pthread_join(aux->flusher, NULL);
+    pthread_mutex_destroy(&aux->mu);
+    pthread_cond_destroy(&aux->cv);
+    aux->timed = false;
+  }
+  int r = aux->nin ? socket_end_dgram(aux) : 0;
+  if (aux->ndgrams && socket_send_queued(aux)) r = -1;
+  h->packets_dropped += aux->send_dropped;
+  udp_free(aux);
   h->aux = NULL;
-  return 0;
+  return r;
 }
 
-#define UDP_MAX 65507
-static int socket_writebytes(size_t nbytes, const void * bytes, pueo_handle_t *h)
+static void socket_start_fragment(struct udp_aux * aux)
 {
-  struct udp_aux  * aux = ( struct udp_aux*)  h->aux;
+  struct udp_frag_head fh =
+  {
+    .seq = aux->frag_seq,
+    .marker = UDP_FRAG_MARKER,
+    .index = aux->frag_index,
+    .nfrags = (aux->frag_total + UDP_FRAG_PAYLOAD - 1) / UDP_FRAG_PAYLOAD,
+    .total = aux->frag_total
+  };
+  memcpy(UDP_DGRAM(aux, aux->ndgrams), &fh, sizeof(fh));
+  aux->nin = sizeof(fh);
+}
+
+static int socket_write(size_t nbytes, const void * bytes, struct udp_aux * aux)
+{
+  if (aux->at_packet_start)
+  {
+    // the header tells us how big the packet will be
+    const pueo_packet_head_t * hd = (const pueo_packet_head_t*) bytes;
+    size_t packet_size = nbytes >= sizeof(*hd) ? sizeof(*hd) + hd->num_bytes : nbytes;
+    if (packet_size > UDP_MAX)
+    {
+      // too big for one datagram, so it goes out in fragments
+      if (socket_end_dgram(aux)) return -1;
+      aux->frag_seq++;
+      aux->frag_total = packet_size;
+      aux->frag_index = 0;
+      socket_start_fragment(aux);
+    }
+    else if (aux->coalesce)
+    {
+      // send what we have first if it won't fit
+      if (aux->nin && aux->nin + packet_size > (size_t) aux->coalesce && socket_end_dgram(aux)) return -1;
+      if (!aux->nin) clock_gettime(CLOCK_MONOTONIC, &aux->dgram_started);
+    }
+    aux->packet_start = aux->nin;
+  }
+  aux->at_packet_start = false;
+
+  if (aux->frag_total)
+  {
+    size_t ncopied = 0;
+    while (ncopied < nbytes)
+    {
+      if (aux->nin == UDP_MAX)
+      {
+        if (socket_end_dgram(aux)) return ncopied ? (int) ncopied : -1;
+        aux->frag_index++;
+        socket_start_fragment(aux);
+      }
+      size_t room = UDP_MAX - aux->nin;
+      size_t ncopy = room < nbytes - ncopied ? room : nbytes - ncopied;
+      memcpy(UDP_DGRAM(aux, aux->ndgrams) + aux->nin, (const uint8_t*) bytes + ncopied, ncopy);
+      aux->nin += ncopy;
+      ncopied += ncopy;
+    }
+    return ncopied;
+  }
 
   if (aux->nin + nbytes > UDP_MAX)
   {
     fprintf(stderr,"Trying to write more than UDP_MAX bytes to a socket. Will be truncated.\n");
     nbytes = UDP_MAX-aux->nin;
   }
-  memcpy(aux->buf + aux->nin, bytes, nbytes);
+  memcpy(UDP_DGRAM(aux, aux->ndgrams) + aux->nin, bytes, nbytes);
   aux->nin +=nbytes;
   return nbytes;
 }
 
+static int socket_writebytes(size_t nbytes, const void * bytes, pueo_handle_t *h)
+{
+  struct udp_aux  * aux = ( struct udp_aux*)  h->aux;
+  udp_lock(aux);
+  int r = socket_write(nbytes, bytes, aux);
+  udp_unlock(h);
+  return r;
+}
+
+// a whole packet that fits in a datagram can be sent straight from the iovec, when there's nothing to add it to
+static int socket_writebytesv(const struct iovec * iov, int iovcnt, pueo_handle_t *h)
+{
+  struct udp_aux  * aux = ( struct udp_aux*)  h->aux;
+  size_t total = 0;
+  for (int i = 0; i < iovcnt; i++) total += iov[i].iov_len;
+
+  const pueo_packet_head_t * hd = (const pueo_packet_head_t*) iov[0].iov_base;
+  if (aux->batch == 1 && !aux->coalesce && !aux->nin && aux->at_packet_start &&
+      iov[0].iov_len >= sizeof(*hd) && total == sizeof(*hd) + hd->num_bytes && total <= UDP_MAX)
+  {
+    struct msghdr msg = { .msg_iov = (struct iovec*) iov, .msg_iovlen = iovcnt };
+    return sendmsg(aux->socket, &msg, 0) == (ssize_t) total ? (int) total : -1;
+  }
+
+  size_t nwritten = 0;
+  int r = 0;
+  udp_lock(aux);
+  for (int i = 0; i < iovcnt; i++)
+  {
+    r = socket_write(iov[i].iov_len, iov[i].iov_base, aux);
+    if (r < 0) break;
+    nwritten += r;
+  }
+  udp_unlock(h);
+  return r < 0 && !nwritten ? -1 : (int) nwritten;
+}
+
+static int socket_flush(pueo_handle_t * h)
+{
+  struct udp_aux  * aux = ( struct udp_aux*)  h->aux;
+  udp_lock(aux);
+  int r = socket_end_dgram(aux);
+  if (aux->ndgrams && socket_send_queued(aux)) r = -1;
+  udp_unlock(h);
+  return r;
+}
+
+// a packet that failed partway never got to socket_done, so throw away what there is of it
+static void socket_begin(pueo_handle_t * h)
+{
+  struct udp_aux  * aux = ( struct udp_aux*)  h->aux;
+  udp_lock(aux);
+  if (!aux->at_packet_start)
+  {
+    // fragments already sent are given up on by the reader
+    aux->nin = aux->frag_total ? 0 : aux->packet_start;
+    aux->frag_total = 0;
+    aux->at_packet_start = true;
+  }
+  udp_unlock(h);
+}
+
 static int socket_done(pueo_handle_t * h)
 {
   struct udp_aux  * aux = ( struct udp_aux*)  h->aux;
   int r = 0;
-  int socket = aux->socket;
-  if (write(socket, aux->buf, aux->nin) < 0)
+  udp_lock(aux);
+  aux->at_packet_start = true;
+
+  if (aux->frag_total)
   {
-    r = -1;
+    aux->frag_total = 0;
+    r = socket_end_dgram(aux);
   }
-  aux->nin = 0;
+  // when coalescing, hold on to the datagram until it's full or the first packet in it is due (the flusher sends it then if nothing else does)
+  else if (!aux->coalesce || aux->nin >= (uint32_t) aux->coalesce || ms_since(&aux->dgram_started) >= aux->max_delay_ms)
+  {
+    r = socket_end_dgram(aux);
+  }
+  udp_unlock(h);
   return r;
 }
 
-static int socket_readbytes(size_t nbytes, void * bytes, pueo_handle_t  *h)
+// adds the fragment in the current datagram to its packet. Returns true if that completed the packet, which then becomes the current datagram.
+static bool socket_add_fragment(pueo_handle_t *h)
 {
   struct udp_aux  * aux = ( struct udp_aux*)  h->aux;
+  struct udp_frag_head fh;
+  memcpy(&fh, aux->rbuf, sizeof(fh));
+  size_t len = aux->nin - sizeof(fh);
 
-  //we have a new thing
-  if (aux->nin == aux->nout )
+  // make sure it makes sense
+  if (!fh.nfrags || fh.nfrags > 32 || fh.index >= fh.nfrags || fh.total > UDP_FRAG_MAX_TOTAL ||
+      fh.nfrags != (fh.total + UDP_FRAG_PAYLOAD - 1) / UDP_FRAG_PAYLOAD ||
+      len != (fh.index < fh.nfrags - 1 ? UDP_FRAG_PAYLOAD : fh.total - fh.index * UDP_FRAG_PAYLOAD))
+  {
+    return false;
+  }
+
+  // give up on anything that's taking too long, and find this packet's slot (or a free one, or the oldest one)
+  struct udp_reasm * slot = NULL;
+  struct udp_reasm * free_slot = NULL;
+  struct udp_reasm * oldest = NULL;
+  for (int i = 0; i < aux->nreasm; i++)
+  {
+    struct udp_reasm * r = &aux->reasm[i];
+    if (r->nfrags && ms_since(&r->started) > aux->reasm_timeout_ms)
+    {
+      r->nfrags = 0;
+      aux->reasm_dropped++;
+    }
+
+    if (!r->nfrags)
+    {
+      if (!free_slot) free_slot = r;
+      continue;
+    }
+    if (r->seq == fh.seq && r->total == fh.total && r->nfrags == fh.nfrags) slot = r;
+    if (!oldest || r->started.tv_sec < oldest->started.tv_sec ||
+        (r->started.tv_sec == oldest->started.tv_sec && r->started.tv_nsec < oldest->started.tv_nsec))
+    {
+      oldest = r;
+    }
+  }
+
+  if (!slot)
+  {
+    slot = free_slot;
+    if (!slot)
+    {
+      slot = oldest;
+      aux->reasm_dropped++;
+    }
+    if (slot->cap < fh.total)
+    {
+      uint8_t * newbuf = realloc(slot->buf, fh.total);
+      if (!newbuf)
+      {
+        slot->nfrags = 0;
+        return false;
+      }
+      slot->buf = newbuf;
+      slot->cap = fh.total;
+    }
+    slot->seq = fh.seq;
+    slot->total = fh.total;
+    slot->nfrags = fh.nfrags;
+    slot->have = 0;
+    clock_gettime(CLOCK_MONOTONIC, &slot->started);
+  }
+
+  memcpy(slot->buf + fh.index * UDP_FRAG_PAYLOAD, aux->rbuf + sizeof(fh), len);
+  slot->have |= 1u << fh.index;
+  if (slot->have != (uint32_t) ((1ull << slot->nfrags) - 1)) return false;
+
+  // done. The slot is free again, but nothing will be written to it until the next datagram is needed
+  slot->nfrags = 0;
+  aux->rbuf = slot->buf;
+  aux->nin = slot->total;
+  aux->nout = 0;
+  return true;
+}
+
+// moves on to the next datagram, receiving a new batch if we've gone through the pool
+static int socket_next_dgram(pueo_handle_t *h)
+{
+  struct udp_aux  * aux = ( struct udp_aux*)  h->aux;
+  while (true)
   {
-    ssize_t  s = recv(aux->socket, aux->buf, sizeof(aux->buf), 0);
-    if (s < 0) return -1;
+    if (++aux->cur >= aux->ndgrams)
+    {
+      for (int i = 0; i < aux->batch; i++)
+      {
+        aux->iovs[i].iov_len = UDP_BUF_SIZE;
+        aux->msgs[i].msg_hdr.msg_controllen = UDP_CMSG_SIZE;
+      }
+
+      int n;
+      do
+      {
+        n = recvmmsg(aux->socket, aux->msgs, aux->batch, MSG_WAITFORONE, NULL);
+      } while (n < 0 && errno == EINTR);
+      if (n < 0) return -1;
+
+      aux->ndgrams = n;
+      aux->cur = 0;
+
+      // the kernel tells us how many datagrams it has dropped on this socket so far
+      for (int i = 0; i < n; i++)
+      {
+        struct msghdr * m = &aux->msgs[i].msg_hdr;
+        for (struct cmsghdr * c = CMSG_FIRSTHDR(m); c; c = CMSG_NXTHDR(m,c))
+        {
+          if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SO_RXQ_OVFL)
+          {
+            uint32_t ndropped;
+            memcpy(&ndropped, CMSG_DATA(c), sizeof(ndropped));
+            aux->kernel_dropped = ndropped;
+          }
+        }
+      }
+    }
+
     h->flags |= PUEO_HANDLE_ALREADY_READ_HEAD;
-    aux->nin = s;
+    aux->rbuf = UDP_DGRAM(aux,aux->cur);
+    aux->nin = aux->msgs[aux->cur].msg_len;
     aux->nout = 0;
+
+    bool is_fragment = aux->nin >= sizeof(struct udp_frag_head) && aux->rbuf[offsetof(struct udp_frag_head, marker)] == UDP_FRAG_MARKER;
+    bool ready = !is_fragment || socket_add_fragment(h);
+    h->packets_dropped = aux->kernel_dropped + aux->reasm_dropped;
+    if (ready) return 0;
+  }
+}
+
+// Datagrams may hold several packets, but a tail too short to be a header must be padding or garbage
+static bool socket_need_dgram(const struct udp_aux * aux, size_t nbytes)
+{
+  size_t nleft = aux->nin - aux->nout;
+  return !nleft || (nleft < nbytes && nleft < sizeof(pueo_packet_head_t));
+}
+
+static int socket_readbytes(size_t nbytes, void * bytes, pueo_handle_t  *h)
+{
+  struct udp_aux  * aux = ( struct udp_aux*)  h->aux;
+
+  //we have a new thing
+  if (socket_need_dgram(aux, nbytes))
+  {
+    if (socket_next_dgram(h)) return -1;
   }
 
    uint32_t nleft = aux->nin - aux->nout;
    uint32_t ncopy = nleft < nbytes ? nleft : nbytes;
-   memcpy(bytes, aux->buf+aux->nout, ncopy);
+   memcpy(bytes, aux->rbuf+aux->nout, ncopy);
    aux->nout += ncopy;
    return ncopy;
 }
 
+// datagrams stay in the pool until the next receive, so they can be viewed in place
+static int socket_viewbytes(size_t nbytes, const void ** bytes, pueo_handle_t  *h)
+{
+  struct udp_aux  * aux = ( struct udp_aux*)  h->aux;
+
+  if (socket_need_dgram(aux, nbytes))
+  {
+    if (socket_next_dgram(h)) return -1;
+  }
+
+   uint32_t nleft = aux->nin - aux->nout;
+   uint32_t nview = nleft < nbytes ? nleft : nbytes;
+   *bytes = aux->rbuf+aux->nout;
+   aux->nout += nview;
+   return nview;
+}
+
+
+// waits for the stream socket to be ready for events, giving up after the timeout
+static int stream_wait(struct stream_aux * aux, short events)
+{
+  struct pollfd pfd = { .fd = aux->fd, .events = events };
+  while (true)
+  {
+    int r = poll(&pfd, 1, aux->timeout_ms);
+    if (r < 0 && errno == EINTR) continue;
+    if (r == 0) errno = ETIMEDOUT;
+    return r > 0 ? 0 : -1;
+  }
+}
+
+// writes everything, waiting for room if the other end is slow (i.e. back-pressure)
+static int stream_writebytes(size_t nbytes, const void * bytes, pueo_handle_t *h)
+{
+  struct stream_aux * aux = (struct stream_aux*) h->aux;
+  size_t nwritten = 0;
+  while (nwritten < nbytes)
+  {
+    ssize_t r = send(aux->fd, (const uint8_t*) bytes + nwritten, nbytes - nwritten, MSG_NOSIGNAL);
+    if (r < 0)
+    {
+      if (errno == EINTR) continue;
+      if ((errno == EAGAIN || errno == EWOULDBLOCK) && !stream_wait(aux, POLLOUT)) continue;
+      return nwritten ? (int) nwritten : -1;
+    }
+    nwritten += r;
+  }
+  return nwritten;
+}
+
+static int stream_writebytesv(const struct iovec * iov, int iovcnt, pueo_handle_t *h)
+{
+  struct stream_aux * aux = (struct stream_aux*) h->aux;
+  struct iovec left[iovcnt];
+  memcpy(left, iov, sizeof(left));
+  struct msghdr msg = { .msg_iov = left, .msg_iovlen = iovcnt };
+  size_t nwritten = 0;
+  while (msg.msg_iovlen)
+  {
+    ssize_t r = sendmsg(aux->fd, &msg, MSG_NOSIGNAL);
+    if (r < 0)
+    {
+      if (errno == EINTR) continue;
+      if ((errno == EAGAIN || errno == EWOULDBLOCK) && !stream_wait(aux, POLLOUT)) continue;
+      return nwritten ? (int) nwritten : -1;
+    }
+    nwritten += r;
+
+    // skip past whatever went out
+    while (msg.msg_iovlen && (size_t) r >= msg.msg_iov->iov_len)
+    {
+      r -= msg.msg_iov->iov_len;
+      msg.msg_iov++;
+      msg.msg_iovlen--;
+    }
+    if (msg.msg_iovlen)
+    {
+      msg.msg_iov->iov_base = (uint8_t*) msg.msg_iov->iov_base + r;
+      msg.msg_iov->iov_len -= r;
+    }
+  }
+  return nwritten;
+}
+
+// reads everything asked for (unless the other end hangs up)
+static int stream_readbytes(size_t nbytes, void * bytes, pueo_handle_t *h)
+{
+  struct stream_aux * aux = (struct stream_aux*) h->aux;
+  size_t nread = 0;
+  while (nread < nbytes)
+  {
+    ssize_t r = recv(aux->fd, (uint8_t*) bytes + nread, nbytes - nread, 0);
+    if (r < 0)
+    {
+      if (errno == EINTR) continue;
+      if ((errno == EAGAIN || errno == EWOULDBLOCK) && !stream_wait(aux, POLLIN)) continue;
+      return nread ? (int) nread : -1;
+    }
+    if (r == 0) break;
+    nread += r;
+  }
+  return nread;
+}
+
+// with TCP_CORK, partial frames are held back until uncorked
+static int stream_flush(pueo_handle_t *h)
+{
+  struct stream_aux * aux = (struct stream_aux*) h->aux;
+  if (!aux->cork) return 0;
+  int off = 0, on = 1;
+  if (setsockopt(aux->fd, IPPROTO_TCP, TCP_CORK, &off, sizeof(off))) return -1;
+  return setsockopt(aux->fd, IPPROTO_TCP, TCP_CORK, &on, sizeof(on));
+}
+
+static int stream_close(pueo_handle_t *h)
+{
+  struct stream_aux * aux = (struct stream_aux*) h->aux;
+  if (!aux) return 0;
+  int r = close(aux->fd);
+  if (aux->unlink_path)
+  {
+    unlink(aux->unlink_path);
+    free(aux->unlink_path);
+  }
+  free(aux);
+  h->aux = NULL;
+  return r;
+}
+
 
 static int file_writebytes(size_t nbytes, const void * bytes, pueo_handle_t *h )
 {
@@ -157,123 +817,2293 @@ static int file_readbytes(size_t nbytes, void * bytes, pueo_handle_t * h)
   return fread(bytes, 1, nbytes, f);
 }
 
-static int file_close(pueo_handle_t * h)
-{
-  FILE * f = (FILE*) h->aux;
-  return fclose(f);
+static int file_flush(pueo_handle_t * h)
+{
+  FILE *f = (FILE*) h->aux;
+  return fflush(f);
+}
+
+static int file_seek(uint64_t offset, pueo_handle_t *h)
+{
+  FILE *f = (FILE*) h->aux;
+  return fseeko(f, offset, SEEK_SET);
+}
+
+static int file_skipbytes(size_t nbytes, pueo_handle_t *h)
+{
+  FILE *f = (FILE*) h->aux;
+  return fseeko(f, nbytes, SEEK_CUR) ? -1 : (int) nbytes;
+}
+
+static int file_close(pueo_handle_t * h)
+{
+  FILE * f = (FILE*) h->aux;
+  return fclose(f);
+}
+
+static int gz_writebytes(size_t nbytes, const void * bytes, pueo_handle_t *h)
+{
+  gzFile  f  = (gzFile) h->aux;
+  return gzwrite(f, bytes, nbytes);
+}
+static int gz_readbytes(size_t nbytes, void * bytes, pueo_handle_t *h)
+{
+  gzFile f = (gzFile) h->aux;
+  return gzread(f, bytes, nbytes);
+}
+
+static int gz_flush(pueo_handle_t  * h)
+{
+  gzFile f = (gzFile) h->aux;
+  return gzflush(f, Z_SYNC_FLUSH) == Z_OK ? 0 : -1;
+}
+
+static int gz_seek(uint64_t offset, pueo_handle_t *h)
+{
+  gzFile f = (gzFile) h->aux;
+  return gzseek(f, offset, SEEK_SET) == (z_off_t) offset ? 0 : -1;
+}
+
+// still has to decompress, but nothing is copied out
+static int gz_skipbytes(size_t nbytes, pueo_handle_t *h)
+{
+  gzFile f = (gzFile) h->aux;
+  return gzseek(f, nbytes, SEEK_CUR) < 0 ? -1 : (int) nbytes;
+}
+
+static int gz_close(pueo_handle_t  * h)
+{
+  gzFile f = (gzFile) h->aux;
+  return gzclose(f);
+}
+
+#ifdef ZSTD_ENABLED
+
+struct zstd_aux
+{
+  int fd;
+  ZSTD_CCtx * cctx;
+  ZSTD_DCtx * dctx;
+
+  // compressed side: output buffer when writing, input buffer when reading
+  uint8_t * zbuf;
+  size_t zcap;
+  ZSTD_inBuffer zin;
+
+  // decompressed side (reading only)
+  uint8_t * dbuf;
+  size_t dcap;
+  size_t dsize;
+  size_t dpos;
+  bool eof;
+};
+
+// write(2) everything, dealing with partial writes
+static int write_all(int fd, const void * bytes, size_t nbytes)
+{
+  size_t nwritten = 0;
+  while (nwritten < nbytes)
+  {
+    ssize_t r = write(fd, (const uint8_t*) bytes + nwritten, nbytes - nwritten);
+    if (r < 0)
+    {
+      if (errno == EINTR) continue;
+      return -1;
+    }
+    nwritten += r;
+  }
+  return nwritten;
+}
+
+static int zstd_compress(struct zstd_aux * aux, ZSTD_inBuffer * in, ZSTD_EndDirective mode)
+{
+  bool done = false;
+  while (!done)
+  {
+    ZSTD_outBuffer out = { aux->zbuf, aux->zcap, 0 };
+    size_t remaining = ZSTD_compressStream2(aux->cctx, &out, in, mode);
+    if (ZSTD_isError(remaining))
+    {
+      fprintf(stderr,"zstd compression error: %s\n", ZSTD_getErrorName(remaining));
+      return -1;
+    }
+    if (out.pos && write_all(aux->fd, aux->zbuf, out.pos) < 0) return -1;
+
+    // continue just needs the input consumed, flush/end need everything out
+    done = mode == ZSTD_e_continue ? in->pos == in->size : remaining == 0;
+  }
+  return 0;
+}
+
+static int zstd_writebytes(size_t nbytes, const void * bytes, pueo_handle_t *h)
+{
+  struct zstd_aux * aux = (struct zstd_aux*) h->aux;
+  ZSTD_inBuffer in = { bytes, nbytes, 0 };
+  if (zstd_compress(aux, &in, ZSTD_e_continue)) return -1;
+  return nbytes;
+}
+
+// decompress as much as fits into dbuf
+static int zstd_refill(struct zstd_aux * aux)
+{
+  ZSTD_outBuffer out = { aux->dbuf, aux->dcap, 0 };
+  while (out.pos < out.size)
+  {
+    if (aux->zin.pos == aux->zin.size)
+    {
+      if (aux->eof) break;
+      ssize_t n = read(aux->fd, aux->zbuf, aux->zcap);
+      if (n < 0)
+      {
+        if (errno == EINTR) continue;
+        return -1;
+      }
+      if (n == 0)
+      {
+        aux->eof = true;
+        break;
+      }
+      aux->zin.src = aux->zbuf;
+      aux->zin.size = n;
+      aux->zin.pos = 0;
+    }
+
+    size_t r = ZSTD_decompressStream(aux->dctx, &out, &aux->zin);
+    if (ZSTD_isError(r))
+    {
+      fprintf(stderr,"zstd decompression error: %s\n", ZSTD_getErrorName(r));
+      return -1;
+    }
+  }
+  aux->dsize = out.pos;
+  aux->dpos = 0;
+  return out.pos;
+}
+
+static int zstd_readbytes(size_t nbytes, void * bytes, pueo_handle_t *h)
+{
+  struct zstd_aux * aux = (struct zstd_aux*) h->aux;
+  size_t ncopied = 0;
+  while (ncopied < nbytes)
+  {
+    if (aux->dpos == aux->dsize)
+    {
+      int r = zstd_refill(aux);
+      if (r < 0) return ncopied ? (int) ncopied : -1;
+      if (r == 0) break;
+    }
+    size_t nleft = aux->dsize - aux->dpos;
+    size_t ncopy = nleft < nbytes - ncopied ? nleft : nbytes - ncopied;
+    memcpy((uint8_t*) bytes + ncopied, aux->dbuf + aux->dpos, ncopy);
+    aux->dpos += ncopy;
+    ncopied += ncopy;
+  }
+  return ncopied;
+}
+
+static int zstd_flush(pueo_handle_t *h)
+{
+  struct zstd_aux * aux = (struct zstd_aux*) h->aux;
+  if (!aux->cctx) return 0;
+  ZSTD_inBuffer in = { NULL, 0, 0 };
+  return zstd_compress(aux, &in, ZSTD_e_flush);
+}
+
+static void zstd_free(struct zstd_aux * aux)
+{
+  ZSTD_freeCCtx(aux->cctx);
+  ZSTD_freeDCtx(aux->dctx);
+  free(aux->zbuf);
+  free(aux->dbuf);
+  free(aux);
+}
+
+static int zstd_close(pueo_handle_t *h)
+{
+  struct zstd_aux * aux = (struct zstd_aux*) h->aux;
+  if (!aux) return 0;
+  int r = 0;
+  if (aux->cctx)
+  {
+    ZSTD_inBuffer in = { NULL, 0, 0 };
+    r = zstd_compress(aux, &in, ZSTD_e_end);
+  }
+  if (close(aux->fd)) r = -1;
+  zstd_free(aux);
+  h->aux = NULL;
+  return r;
+}
+
+#define ZSTD_CHECK_PARAM(x) { size_t zr = x; if (ZSTD_isError(zr)) fprintf(stderr,"pueo_handle_init_zstd: %s failed (%s)\n", #x, ZSTD_getErrorName(zr)); }
+
+#endif
+
+static int mmap_readbytes(size_t nbytes, void * bytes, pueo_handle_t *h)
+{
+  struct mmap_aux * aux = (struct mmap_aux*) h->aux;
+  size_t nleft = aux->size - aux->pos;
+  size_t ncopy = nleft < nbytes ? nleft : nbytes;
+  memcpy(bytes, aux->base + aux->pos, ncopy);
+  aux->pos += ncopy;
+  return ncopy;
+}
+
+static int mmap_viewbytes(size_t nbytes, const void ** bytes, pueo_handle_t *h)
+{
+  struct mmap_aux * aux = (struct mmap_aux*) h->aux;
+  size_t nleft = aux->size - aux->pos;
+  size_t nview = nleft < nbytes ? nleft : nbytes;
+  *bytes = aux->base + aux->pos;
+  aux->pos += nview;
+  return nview;
+}
+
+static int mmap_seek(uint64_t offset, pueo_handle_t *h)
+{
+  struct mmap_aux * aux = (struct mmap_aux*) h->aux;
+  if (offset > aux->size) return -1;
+  aux->pos = offset;
+  return 0;
+}
+
+static int mmap_close(pueo_handle_t *h)
+{
+  struct mmap_aux * aux = (struct mmap_aux*) h->aux;
+  if (!aux) return 0;
+  int r = aux->size ? munmap((void*) aux->base, aux->size) : 0;
+  free(aux);
+  h->aux = NULL;
+  return r;
+}
+
+static int mem_writebytes(size_t nbytes, const void * bytes, pueo_handle_t *h)
+{
+  struct mem_aux * aux = (struct mem_aux*) h->aux;
+  if (aux->len + nbytes > aux->cap)
+  {
+    size_t cap = aux->cap * 2 > aux->len + nbytes ? aux->cap * 2 : aux->len + nbytes;
+    uint8_t * buf = realloc(aux->buf, cap);
+    if (!buf) return -1;
+    aux->buf = buf;
+    aux->cap = cap;
+  }
+  memcpy(aux->buf + aux->len, bytes, nbytes);
+  aux->len += nbytes;
+  return nbytes;
+}
+
+static int mem_readbytes(size_t nbytes, void * bytes, pueo_handle_t *h)
+{
+  struct mem_aux * aux = (struct mem_aux*) h->aux;
+  size_t nleft = aux->len - aux->pos;
+  size_t ncopy = nleft < nbytes ? nleft : nbytes;
+  memcpy(bytes, aux->buf + aux->pos, ncopy);
+  aux->pos += ncopy;
+  return ncopy;
+}
+
+static int mem_viewbytes(size_t nbytes, const void ** bytes, pueo_handle_t *h)
+{
+  struct mem_aux * aux = (struct mem_aux*) h->aux;
+  size_t nleft = aux->len - aux->pos;
+  size_t nview = nleft < nbytes ? nleft : nbytes;
+  *bytes = aux->buf + aux->pos;
+  aux->pos += nview;
+  return nview;
+}
+
+static int mem_seek(uint64_t offset, pueo_handle_t *h)
+{
+  struct mem_aux * aux = (struct mem_aux*) h->aux;
+  if (offset > aux->len) return -1;
+  aux->pos = offset;
+  return 0;
+}
+
+static int mem_close(pueo_handle_t *h)
+{
+  struct mem_aux * aux = (struct mem_aux*) h->aux;
+  if (!aux) return 0;
+  if (aux->cap) free(aux->buf);
+  free(aux);
+  h->aux = NULL;
+  return 0;
+}
+
+
+
+// adds what inner has dropped since last time (*seen) to *dropped, so wrappers report what's dropped underneath them too
+static void add_inner_dropped(uint64_t * dropped, const pueo_handle_t * inner, uint64_t * seen)
+{
+  *dropped += inner->packets_dropped - *seen;
+  *seen = inner->packets_dropped;
+}
+
+/* The buffered layer. This sits in front of another handle (kept in the aux) */
+struct buffered_aux
+{
+  pueo_handle_t inner;
+  uint64_t inner_dropped; // inner's packets_dropped, as last added to ours
+  uint8_t * buf;
+  size_t cap;
+  size_t len; // bytes in the buffer
+  size_t pos; // read position in the buffer
+};
+
+static int buffered_flush_buf(struct buffered_aux * aux)
+{
+  size_t nflushed = 0;
+  while (nflushed < aux->len)
+  {
+    int r = aux->inner.write_bytes(aux->len - nflushed, aux->buf + nflushed, &aux->inner);
+    if (r <= 0)
+    {
+      // keep whatever didn't make it
+      memmove(aux->buf, aux->buf + nflushed, aux->len - nflushed);
+      aux->len -= nflushed;
+      return -1;
+    }
+    nflushed += r;
+  }
+  aux->len = 0;
+  return 0;
+}
+
+static int buffered_writebytes(size_t nbytes, const void * bytes, pueo_handle_t *h)
+{
+  struct buffered_aux * aux = (struct buffered_aux*) h->aux;
+  if (aux->len + nbytes > aux->cap && buffered_flush_buf(aux)) return -1;
+
+  // too big to bother buffering
+  if (nbytes >= aux->cap)
+  {
+    size_t nwritten = 0;
+    while (nwritten < nbytes)
+    {
+      int r = aux->inner.write_bytes(nbytes - nwritten, (const uint8_t*) bytes + nwritten, &aux->inner);
+      if (r <= 0) return nwritten ? (int) nwritten : -1;
+      nwritten += r;
+    }
+    return nwritten;
+  }
+
+  memcpy(aux->buf + aux->len, bytes, nbytes);
+  aux->len += nbytes;
+  return nbytes;
+}
+
+static int buffered_done(pueo_handle_t *h)
+{
+  struct buffered_aux * aux = (struct buffered_aux*) h->aux;
+  int r = buffered_flush_buf(aux) ? -1 :
+          aux->inner.done_write_packet ? aux->inner.done_write_packet(&aux->inner) : 0;
+  add_inner_dropped(&h->packets_dropped, &aux->inner, &aux->inner_dropped);
+  return r;
+}
+
+static void buffered_begin(pueo_handle_t *h)
+{
+  struct buffered_aux * aux = (struct buffered_aux*) h->aux;
+  if (aux->inner.begin_write_packet) aux->inner.begin_write_packet(&aux->inner);
+}
+
+static int buffered_flush(pueo_handle_t *h)
+{
+  struct buffered_aux * aux = (struct buffered_aux*) h->aux;
+  int r = aux->inner.write_bytes && buffered_flush_buf(aux) ? -1 :
+          aux->inner.flush ? aux->inner.flush(&aux->inner) : 0;
+  add_inner_dropped(&h->packets_dropped, &aux->inner, &aux->inner_dropped);
+  return r;
+}
+
+static int buffered_readbytes(size_t nbytes, void * bytes, pueo_handle_t *h)
+{
+  struct buffered_aux * aux = (struct buffered_aux*) h->aux;
+  size_t ncopied = 0;
+  int r = 0;
+  while (ncopied < nbytes)
+  {
+    if (aux->pos == aux->len)
+    {
+      // too big to bother buffering
+      if (nbytes - ncopied >= aux->cap)
+      {
+        r = aux->inner.read_bytes(nbytes - ncopied, (uint8_t*) bytes + ncopied, &aux->inner);
+        if (r <= 0) break;
+        ncopied += r;
+        continue;
+      }
+
+      r = aux->inner.read_bytes(aux->cap, aux->buf, &aux->inner);
+      if (r <= 0) break;
+      aux->len = r;
+      aux->pos = 0;
+    }
+
+    size_t nleft = aux->len - aux->pos;
+    size_t ncopy = nleft < nbytes - ncopied ? nleft : nbytes - ncopied;
+    memcpy((uint8_t*) bytes + ncopied, aux->buf + aux->pos, ncopy);
+    aux->pos += ncopy;
+    ncopied += ncopy;
+  }
+  add_inner_dropped(&h->packets_dropped, &aux->inner, &aux->inner_dropped);
+  return ncopied || r >= 0 ? (int) ncopied : r;
+}
+
+static int buffered_viewbytes(size_t nbytes, const void ** bytes, pueo_handle_t *h)
+{
+  struct buffered_aux * aux = (struct buffered_aux*) h->aux;
+
+  if (nbytes > aux->cap)
+  {
+    size_t newcap = aux->cap;
+    while (newcap < nbytes) newcap *= 2;
+    uint8_t * newbuf = realloc(aux->buf, newcap);
+    if (!newbuf) return -1;
+    aux->buf = newbuf;
+    aux->cap = newcap;
+  }
+
+  // make the bytes contiguous at the start of the buffer, then top up
+  if (aux->len - aux->pos < nbytes)
+  {
+    memmove(aux->buf, aux->buf + aux->pos, aux->len - aux->pos);
+    aux->len -= aux->pos;
+    aux->pos = 0;
+    while (aux->len < nbytes)
+    {
+      int r = aux->inner.read_bytes(aux->cap - aux->len, aux->buf + aux->len, &aux->inner);
+      if (r <= 0) break;
+      aux->len += r;
+    }
+    add_inner_dropped(&h->packets_dropped, &aux->inner, &aux->inner_dropped);
+  }
+
+  size_t nleft = aux->len - aux->pos;
+  size_t nview = nleft < nbytes ? nleft : nbytes;
+  *bytes = aux->buf + aux->pos;
+  aux->pos += nview;
+  return nview;
+}
+
+static int buffered_seek(uint64_t offset, pueo_handle_t *h)
+{
+  struct buffered_aux * aux = (struct buffered_aux*) h->aux;
+  aux->len = 0;
+  aux->pos = 0;
+  return aux->inner.seek(offset, &aux->inner);
+}
+
+static int buffered_close(pueo_handle_t *h)
+{
+  struct buffered_aux * aux = (struct buffered_aux*) h->aux;
+  if (!aux) return 0;
+  int r = aux->inner.write_bytes ? buffered_flush_buf(aux) : 0;
+  if (aux->inner.close && aux->inner.close(&aux->inner)) r = -1;
+  free(aux->buf);
+  free(aux);
+  h->aux = NULL;
+  return r;
+}
+
+
+/* The async layer. The caller serializes into cur, and done_write_packet moves it into the queue, which a thread drains into inner */
+struct async_aux
+{
+  pueo_handle_t inner;
+  pueo_async_policy_t policy;
+  int depth;
+  size_t slot_size;
+
+  uint8_t * mem;     // (depth+1) slots
+  size_t * lens;     // bytes in each slot
+  int cur;           // the slot being filled by the caller
+  bool cur_overflow; // the packet being filled didn't fit
+
+  // everything below here is protected by mu
+  pthread_mutex_t mu;
+  pthread_cond_t cv_work;
+  pthread_cond_t cv_room;
+  int * queue;       // slot indices, oldest first. queue[0] is being written if busy
+  int nqueued;
+  int * free_slots;
+  int nfree;
+  bool busy;
+  bool closing;
+  uint64_t write_errors;
+  uint64_t inner_seen;    // inner's packets_dropped, as last looked at
+  uint64_t inner_dropped; // what inner dropped since, not yet added to packets_dropped
+  pthread_t thread;
+};
+
+#define ASYNC_SLOT(aux,i) ((aux)->mem + (size_t) (i) * (aux)->slot_size)
+
+static void * async_thread(void * arg)
+{
+  struct async_aux * aux = (struct async_aux*) arg;
+
+  pthread_mutex_lock(&aux->mu);
+  while (true)
+  {
+    while (!aux->nqueued && !aux->closing) pthread_cond_wait(&aux->cv_work, &aux->mu);
+    if (!aux->nqueued) break;
+
+    int slot = aux->queue[0];
+    aux->busy = true;
+    pthread_mutex_unlock(&aux->mu);
+
+    const uint8_t * buf = ASYNC_SLOT(aux,slot);
+    size_t len = aux->lens[slot];
+    size_t nwritten = 0;
+    bool ok = true;
+    if (aux->inner.begin_write_packet) aux->inner.begin_write_packet(&aux->inner);
+    while (ok && nwritten < len)
+    {
+      int r = aux->inner.write_bytes(len - nwritten, buf + nwritten, &aux->inner);
+      if (r <= 0) ok = false;
+      else nwritten += r;
+    }
+    if (ok && aux->inner.done_write_packet && aux->inner.done_write_packet(&aux->inner)) ok = false;
+    if (ok)
+    {
+      aux->inner.bytes_written += len;
+      aux->inner.packet_write_counter++;
+    }
+
+    pthread_mutex_lock(&aux->mu);
+    if (!ok && !aux->write_errors++)
+    {
+      fprintf(stderr,"async handle: failed to write to %s\n", aux->inner.description);
+    }
+    add_inner_dropped(&aux->inner_dropped, &aux->inner, &aux->inner_seen);
+    aux->busy = false;
+    aux->nqueued--;
+    memmove(aux->queue, aux->queue + 1, aux->nqueued * sizeof(int));
+    aux->free_slots[aux->nfree++] = slot;
+    pthread_cond_broadcast(&aux->cv_room);
+  }
+  pthread_mutex_unlock(&aux->mu);
+  return NULL;
+}
+
+// waveforms are the least important, then by signal level
+static int async_priority(const uint8_t * pkt, size_t len)
+{
+  const pueo_packet_head_t * hd = (const pueo_packet_head_t*) pkt;
+  if (hd->type == PUEO_FULL_WAVEFORMS) return 0;
+  if (hd->type == PUEO_SINGLE_WAVEFORM)
+  {
+    size_t prio_offs = sizeof(pueo_packet_head_t) + offsetof(pueo_single_waveform_t, prio);
+    if (hd->version < 2 || len < prio_offs + sizeof(pueo_priority_t)) return 0;
+    pueo_priority_t prio;
+    memcpy(&prio, pkt + prio_offs, sizeof(prio));
+    return 1 + prio.signal_level;
+  }
+  return 8;
+}
+
+static int async_writebytes(size_t nbytes, const void * bytes, pueo_handle_t *h)
+{
+  struct async_aux * aux = (struct async_aux*) h->aux;
+  size_t * len = &aux->lens[aux->cur];
+  if (*len + nbytes > aux->slot_size)
+  {
+    if (!aux->cur_overflow) fprintf(stderr,"async handle: packet doesn't fit in slot of %zu bytes, will be dropped\n", aux->slot_size);
+    aux->cur_overflow = true;
+    return -1;
+  }
+  memcpy(ASYNC_SLOT(aux,aux->cur) + *len, bytes, nbytes);
+  *len += nbytes;
+  return nbytes;
+}
+
+// start cur afresh. Whatever was in it didn't make it into the queue, so counts as dropped
+static void async_reset_cur(pueo_handle_t *h)
+{
+  struct async_aux * aux = (struct async_aux*) h->aux;
+  if (aux->cur_overflow || aux->lens[aux->cur]) h->packets_dropped++;
+  aux->cur_overflow = false;
+  aux->lens[aux->cur] = 0;
+}
+
+static int async_done(pueo_handle_t *h)
+{
+  struct async_aux * aux = (struct async_aux*) h->aux;
+
+  // a packet too big for a slot is an error, unlike what the policy drops
+  if (aux->cur_overflow || !aux->lens[aux->cur])
+  {
+    int r = aux->cur_overflow ? -1 : 0;
+    async_reset_cur(h);
+    return r;
+  }
+
+  pthread_mutex_lock(&aux->mu);
+  h->packets_dropped += aux->inner_dropped;
+  aux->inner_dropped = 0;
+
+  if (aux->policy == PUEO_ASYNC_BLOCK)
+  {
+    while (aux->nqueued == aux->depth) pthread_cond_wait(&aux->cv_room, &aux->mu);
+  }
+
+  if (aux->nqueued < aux->depth)
+  {
+    aux->queue[aux->nqueued++] = aux->cur;
+    aux->cur = aux->free_slots[--aux->nfree];
+    pthread_cond_signal(&aux->cv_work);
+  }
+  else
+  {
+    h->packets_dropped++;
+    if (aux->policy == PUEO_ASYNC_DROP_LOWEST_PRIORITY)
+    {
+      // find the least important packet that isn't being written right now (the oldest, if tied)
+      int lowest = -1;
+      int lowest_prio = async_priority(ASYNC_SLOT(aux,aux->cur), aux->lens[aux->cur]);
+      for (int i = aux->busy ? 1 : 0; i < aux->nqueued; i++)
+      {
+        int prio = async_priority(ASYNC_SLOT(aux,aux->queue[i]), aux->lens[aux->queue[i]]);
+        if (prio < lowest_prio)
+        {
+          lowest = i;
+          lowest_prio = prio;
+        }
+      }
+
+      // swap it out for ours
+      if (lowest >= 0)
+      {
+        int evicted = aux->queue[lowest];
+        memmove(aux->queue + lowest, aux->queue + lowest + 1, (aux->nqueued - lowest - 1) * sizeof(int));
+        aux->queue[aux->nqueued-1] = aux->cur;
+        aux->cur = evicted;
+      }
+    }
+  }
+  pthread_mutex_unlock(&aux->mu);
+
+  aux->lens[aux->cur] = 0;
+  return 0;
+}
+
+static int async_flush(pueo_handle_t *h)
+{
+  struct async_aux * aux = (struct async_aux*) h->aux;
+  pthread_mutex_lock(&aux->mu);
+  while (aux->nqueued) pthread_cond_wait(&aux->cv_room, &aux->mu);
+  int r = aux->write_errors ? -1 : 0;
+  // the thread is idle now, so we can touch inner
+  if (aux->inner.flush && aux->inner.flush(&aux->inner)) r = -1;
+  add_inner_dropped(&aux->inner_dropped, &aux->inner, &aux->inner_seen);
+  h->packets_dropped += aux->inner_dropped;
+  aux->inner_dropped = 0;
+  pthread_mutex_unlock(&aux->mu);
+  return r;
+}
+
+static void async_free(struct async_aux * aux)
+{
+  pthread_mutex_destroy(&aux->mu);
+  pthread_cond_destroy(&aux->cv_work);
+  pthread_cond_destroy(&aux->cv_room);
+  free(aux->mem);
+  free(aux->lens);
+  free(aux->queue);
+  free(aux->free_slots);
+  free(aux);
+}
+
+static int async_close(pueo_handle_t *h)
+{
+  struct async_aux * aux = (struct async_aux*) h->aux;
+  if (!aux) return 0;
+  async_reset_cur(h);
+  pthread_mutex_lock(&aux->mu);
+  aux->closing = true;
+  pthread_cond_signal(&aux->cv_work);
+  pthread_mutex_unlock(&aux->mu);
+  pthread_join(aux->thread, NULL);
+
+  int r = aux->write_errors ? -1 : 0;
+  if (pueo_handle_close(&aux->inner)) r = -1;
+  async_free(aux);
+  h->aux = NULL;
+  return r;
+}
+
+
+/* The prefetching reader. A thread reads blocks from inner into a ring ahead of the
+ * caller, who copies (or views) out of them. The block being read from stays
+ * in the ring until the caller moves past it, so views into it stay valid until the next read.
+ */
+struct prefetch_aux
+{
+  pueo_handle_t inner;
+  int block_size;
+  int nblocks;
+  uint8_t * mem;
+  int * lens;
+  size_t pos;        // in the head block
+  uint8_t * scratch; // for views that straddle blocks
+  size_t scratch_cap;
+
+  // everything below here is protected by mu
+  pthread_mutex_t mu;
+  pthread_cond_t cv_work;
+  pthread_cond_t cv_data;
+  int head;          // the block the caller is reading from
+  int nfull;         // blocks ready, starting at head
+  bool eof;          // the thread has hit the end (or an error)
+  bool error;
+  bool closing;
+  uint64_t seek_offset;
+  unsigned seek_gen; // bumped by each seek
+  unsigned thread_gen;
+  int seek_result;
+  uint64_t inner_seen;    // inner's packets_dropped, as last looked at
+  uint64_t inner_dropped; // what inner dropped since, not yet added to packets_dropped
+  pthread_t thread;
+};
+
+#define PREFETCH_BLOCK(aux,i) ((aux)->mem + (size_t) (i) * (aux)->block_size)
+
+static void * prefetch_thread(void * arg)
+{
+  struct prefetch_aux * aux = (struct prefetch_aux*) arg;
+  pthread_mutex_lock(&aux->mu);
+  while (true)
+  {
+    while (!aux->closing && aux->seek_gen == aux->thread_gen && (aux->nfull == aux->nblocks || aux->eof)) pthread_cond_wait(&aux->cv_work, &aux->mu);
+    if (aux->closing) break;
+
+    if (aux->seek_gen != aux->thread_gen)
+    {
+      // the caller has already emptied the ring
+      unsigned gen = aux->seek_gen;
+      uint64_t offset = aux->seek_offset;
+      pthread_mutex_unlock(&aux->mu);
+      int r = aux->inner.seek(offset, &aux->inner);
+      pthread_mutex_lock(&aux->mu);
+      aux->thread_gen = gen;
+      aux->seek_result = r;
+      aux->eof = false;
+      aux->error = false;
+      pthread_cond_broadcast(&aux->cv_data);
+      continue;
+    }
+
+    // one read per block, so live sources aren't held up waiting for a whole block
+    int b = (aux->head + aux->nfull) % aux->nblocks;
+    unsigned gen = aux->thread_gen;
+    pthread_mutex_unlock(&aux->mu);
+    int n = aux->inner.read_bytes(aux->block_size, PREFETCH_BLOCK(aux,b), &aux->inner);
+    pthread_mutex_lock(&aux->mu);
+    add_inner_dropped(&aux->inner_dropped, &aux->inner, &aux->inner_seen);
+
+    if (gen != aux->seek_gen) continue; // seeked while we were reading, so it's stale
+    if (n <= 0)
+    {
+      aux->eof = true;
+      aux->error = n < 0;
+    }
+    else
+    {
+      aux->lens[b] = n;
+      aux->nfull++;
+    }
+    pthread_cond_broadcast(&aux->cv_data);
+  }
+  pthread_mutex_unlock(&aux->mu);
+  return NULL;
+}
+
+// makes sure the head block has something left in it (and catches up on what inner dropped). Returns false at the end.
+static bool prefetch_next(pueo_handle_t * h)
+{
+  struct prefetch_aux * aux = (struct prefetch_aux*) h->aux;
+  pthread_mutex_lock(&aux->mu);
+  if (aux->nfull && aux->pos == (size_t) aux->lens[aux->head])
+  {
+    aux->head = (aux->head + 1) % aux->nblocks;
+    aux->nfull--;
+    aux->pos = 0;
+    pthread_cond_signal(&aux->cv_work);
+  }
+  while (!aux->nfull && !aux->eof) pthread_cond_wait(&aux->cv_data, &aux->mu);
+  h->packets_dropped += aux->inner_dropped;
+  aux->inner_dropped = 0;
+  bool ok = aux->nfull > 0;
+  pthread_mutex_unlock(&aux->mu);
+  return ok;
+}
+
+static int prefetch_readbytes(size_t nbytes, void * bytes, pueo_handle_t *h)
+{
+  struct prefetch_aux * aux = (struct prefetch_aux*) h->aux;
+  size_t nread = 0;
+  while (nread < nbytes && prefetch_next(h))
+  {
+    // the head block is ours, so no need to lock
+    size_t nleft = aux->lens[aux->head] - aux->pos;
+    size_t ncopy = nleft < nbytes - nread ? nleft : nbytes - nread;
+    memcpy((uint8_t*) bytes + nread, PREFETCH_BLOCK(aux,aux->head) + aux->pos, ncopy);
+    aux->pos += ncopy;
+    nread += ncopy;
+  }
+  if (!nread && aux->error) return -1;
+  return nread;
+}
+
+static int prefetch_viewbytes(size_t nbytes, const void ** bytes, pueo_handle_t *h)
+{
+  struct prefetch_aux * aux = (struct prefetch_aux*) h->aux;
+  if (!prefetch_next(h)) return aux->error ? -1 : 0;
+
+  size_t nleft = aux->lens[aux->head] - aux->pos;
+  if (nleft >= nbytes)
+  {
+    *bytes = PREFETCH_BLOCK(aux,aux->head) + aux->pos;
+    aux->pos += nbytes;
+    return nbytes;
+  }
+
+  // straddles blocks, so copy it out
+  if (aux->scratch_cap < nbytes)
+  {
+    uint8_t * scratch = realloc(aux->scratch, nbytes);
+    if (!scratch) return -1;
+    aux->scratch = scratch;
+    aux->scratch_cap = nbytes;
+  }
+  *bytes = aux->scratch;
+  return prefetch_readbytes(nbytes, aux->scratch, h);
+}
+
+static int prefetch_seek(uint64_t offset, pueo_handle_t *h)
+{
+  struct prefetch_aux * aux = (struct prefetch_aux*) h->aux;
+  pthread_mutex_lock(&aux->mu);
+  aux->nfull = 0;
+  aux->pos = 0;
+  aux->seek_offset = offset;
+  unsigned gen = ++aux->seek_gen;
+  pthread_cond_signal(&aux->cv_work);
+  while (aux->thread_gen != gen) pthread_cond_wait(&aux->cv_data, &aux->mu);
+  int r = aux->seek_result;
+  pthread_mutex_unlock(&aux->mu);
+  return r;
+}
+
+static void prefetch_free(struct prefetch_aux * aux)
+{
+  pthread_mutex_destroy(&aux->mu);
+  pthread_cond_destroy(&aux->cv_work);
+  pthread_cond_destroy(&aux->cv_data);
+  free(aux->mem);
+  free(aux->lens);
+  free(aux->scratch);
+  free(aux);
+}
+
+static int prefetch_close(pueo_handle_t *h)
+{
+  struct prefetch_aux * aux = (struct prefetch_aux*) h->aux;
+  if (!aux) return 0;
+  pthread_mutex_lock(&aux->mu);
+  aux->closing = true;
+  pthread_cond_signal(&aux->cv_work);
+  pthread_mutex_unlock(&aux->mu);
+  pthread_join(aux->thread, NULL);
+
+  int r = pueo_handle_close(&aux->inner);
+  prefetch_free(aux);
+  h->aux = NULL;
+  return r;
+}
+
+/* The resynchronising reader. Packets are checked (marker, type, checksum) before they are handed out;
+ * anything that doesn't check out is skipped a byte at a time until something does.
+ * A packet is always buffered whole, so the payload reads (and views) that follow its header come from here.
+ */
+struct resync_aux
+{
+  pueo_handle_t inner;
+  pueo_resync_opts_t opts;
+  uint8_t * buf;
+  size_t cap;
+  size_t start;      // next byte handed out
+  size_t end;        // end of what has been read from inner
+  size_t remaining;  // bytes left of the packet being handed out
+  bool eof;
+  uint64_t offset;   // stream offset of buf[start]
+  pueo_resync_stats_t stats;
+  uint64_t inner_seen;    // inner's packets_dropped, as last looked at
+  uint64_t inner_dropped; // what inner dropped since, not yet added to packets_dropped
+};
+
+#define X_PUEO_KNOWN_TYPE(PACKET_TYPE, STRUCT_NAME) case PACKET_TYPE: return true;
+static bool known_type(uint16_t type)
+{
+  switch(type)
+  {
+    PUEO_IO_DISPATCH_TABLE(X_PUEO_KNOWN_TYPE)
+    default: return false;
+  }
+}
+
+// make sure at least need bytes are buffered (fewer at the end, or if there's no memory for them), asking inner for no more than that
+static size_t resync_fill(struct resync_aux * aux, size_t need)
+{
+  size_t most = sizeof(pueo_packet_head_t) + (size_t) aux->opts.max_bytes;
+  if (need > most) need = most;
+  if (aux->end - aux->start >= need || aux->eof) return aux->end - aux->start;
+
+  if (aux->start + need > aux->cap)
+  {
+    if (aux->start) memmove(aux->buf, aux->buf + aux->start, aux->end - aux->start);
+    aux->end -= aux->start;
+    aux->start = 0;
+    if (need > aux->cap)
+    {
+      uint8_t * buf = realloc(aux->buf, need);
+      if (!buf) return aux->end - aux->start;
+      aux->buf = buf;
+      aux->cap = need;
+    }
+  }
+
+  while (aux->end - aux->start < need)
+  {
+    int nrd = aux->inner.read_bytes(need - (aux->end - aux->start), aux->buf + aux->end, &aux->inner);
+    add_inner_dropped(&aux->inner_dropped, &aux->inner, &aux->inner_seen);
+    if (nrd <= 0)
+    {
+      aux->eof = true;
+      break;
+    }
+    aux->end += nrd;
+  }
+  return aux->end - aux->start;
+}
+
+static void resync_skip(struct resync_aux * aux, size_t n)
+{
+  aux->start += n;
+  aux->offset += n;
+  aux->stats.bytes_skipped += n;
+}
+
+// find the next packet that checks out. Returns false at the end.
+static bool resync_next(struct resync_aux * aux)
+{
+  const size_t hdsize = sizeof(pueo_packet_head_t);
+  const size_t marker = offsetof(pueo_packet_head_t, cksum) + sizeof(uint16_t); // where the 0xf1 lives
+  uint64_t skipped_before = aux->stats.bytes_skipped;
+  uint64_t lost_at = aux->offset;
+  bool found = false;
+
+  while (true)
+  {
+    size_t avail = resync_fill(aux, hdsize);
+    if (avail < hdsize)
+    {
+      resync_skip(aux, avail); // trailing garbage (or a truncated header)
+      break;
+    }
+
+    pueo_packet_head_t hd;
+    memcpy(&hd, aux->buf + aux->start, hdsize);
+    if (hd.f1 == 0xf1 && known_type(hd.type) && hd.num_bytes <= aux->opts.max_bytes &&
+        resync_fill(aux, hdsize + hd.num_bytes) == hdsize + hd.num_bytes &&
+        (aux->opts.skip_crc || pueo_crc16(aux->buf + aux->start + hdsize, hd.num_bytes) == hd.cksum))
+    {
+      aux->remaining = hdsize + hd.num_bytes;
+      found = true;
+      break;
+    }
+
+    // no good, jump to the next possible marker in what we have
+    const uint8_t * next = aux->end - aux->start > marker + 1 ?
+      memchr(aux->buf + aux->start + marker + 1, 0xf1, aux->end - aux->start - marker - 1) : NULL;
+    size_t n = next ? (size_t) (next - aux->buf) - marker - aux->start : aux->end - aux->start - marker;
+    resync_skip(aux, n);
+  }
+
+  uint64_t nskipped = aux->stats.bytes_skipped - skipped_before;
+  if (nskipped)
+  {
+    aux->stats.resyncs++;
+    if (aux->opts.callback) aux->opts.callback(lost_at, nskipped, aux->opts.callback_arg);
+  }
+  return found;
+}
+
+static int resync_viewbytes(size_t nbytes, const void ** bytes, pueo_handle_t * h)
+{
+  struct resync_aux * aux = (struct resync_aux*) h->aux;
+  bool more = aux->remaining || resync_next(aux);
+  h->packets_dropped += aux->inner_dropped;
+  aux->inner_dropped = 0;
+  if (!more) return 0;
+  if (nbytes > aux->remaining) nbytes = aux->remaining;
+  *bytes = aux->buf + aux->start;
+  aux->start += nbytes;
+  aux->offset += nbytes;
+  aux->remaining -= nbytes;
+  return nbytes;
+}
+
+static int resync_readbytes(size_t nbytes, void * bytes, pueo_handle_t * h)
+{
+  const void * src;
+  int n = resync_viewbytes(nbytes, &src, h);
+  if (n > 0) memcpy(bytes, src, n);
+  return n;
+}
+
+static int resync_seek(uint64_t offset, pueo_handle_t *h)
+{
+  struct resync_aux * aux = (struct resync_aux*) h->aux;
+  aux->start = aux->end = aux->remaining = 0;
+  aux->eof = false;
+  aux->offset = offset;
+  return aux->inner.seek(offset, &aux->inner);
+}
+
+static int resync_close(pueo_handle_t *h)
+{
+  struct resync_aux * aux = (struct resync_aux*) h->aux;
+  if (!aux) return 0;
+  int r = pueo_handle_close(&aux->inner);
+  free(aux->buf);
+  free(aux);
+  h->aux = NULL;
+  return r;
+}
+
+/* The rotating writer. Packets go to cur, and a background thread opens the next file
+ * ahead of time (under a temporary name) and closes the old one, so a rotation is just a rename.
+ */
+struct rotate_aux
+{
+  pueo_handle_t cur;
+  bool have_cur;
+  char * prefix;
+  const char * suffix;
+  pueo_rotate_opts_t opts;
+  bool at_packet_start;
+  uint64_t cur_bytes;
+  uint32_t cur_packets;
+  struct timespec opened;
+  char * cur_name;
+
+  // everything below here is protected by mu
+  pthread_mutex_t mu;
+  pthread_cond_t cv;
+  bool want_next;
+  bool next_ready;    // next is open (or failed to open, if next_name is NULL)
+  pueo_handle_t next;
+  char * next_name;
+  unsigned nopened;
+  bool have_old;
+  pueo_handle_t old;  // to be closed
+  bool closing;
+  uint64_t close_errors;
+  pthread_t thread;
+};
+
+static void * rotate_thread(void * arg)
+{
+  struct rotate_aux * aux = (struct rotate_aux*) arg;
+  pthread_mutex_lock(&aux->mu);
+  while (true)
+  {
+    while (!aux->have_old && !(aux->want_next && !aux->next_ready) && !aux->closing) pthread_cond_wait(&aux->cv, &aux->mu);
+
+    if (aux->have_old)
+    {
+      pueo_handle_t old = aux->old;
+      pthread_mutex_unlock(&aux->mu);
+      int r = pueo_handle_close(&old);
+      pthread_mutex_lock(&aux->mu);
+      if (r) aux->close_errors++;
+      aux->have_old = false;
+      pthread_cond_broadcast(&aux->cv);
+    }
+    else if (aux->want_next && !aux->next_ready)
+    {
+      char * name = NULL;
+      asprintf(&name, "%s.next-%d-%u%s", aux->prefix, (int) getpid(), aux->nopened++, aux->suffix);
+      pthread_mutex_unlock(&aux->mu);
+      pueo_handle_t next;
+      if (pueo_handle_init_file(&next, name, "w"))
+      {
+        fprintf(stderr,"rotating handle: couldn't open %s\n", name);
+        free(name);
+        name = NULL;
+      }
+      pthread_mutex_lock(&aux->mu);
+      aux->next = next;
+      aux->next_name = name;
+      aux->next_ready = true;
+      pthread_cond_broadcast(&aux->cv);
+    }
+    else break;
+  }
+  pthread_mutex_unlock(&aux->mu);
+  return NULL;
+}
+
+// moves on to the (pre-opened) next file, handing the current one to the thread to close
+static int rotate_next(struct rotate_aux * aux)
+{
+  pthread_mutex_lock(&aux->mu);
+  aux->want_next = true;
+  pthread_cond_broadcast(&aux->cv);
+  while (!aux->next_ready || aux->have_old) pthread_cond_wait(&aux->cv, &aux->mu);
+
+  pueo_handle_t next = aux->next;
+  char * next_name = aux->next_name;
+  aux->next_ready = false;
+  aux->next_name = NULL;
+  if (aux->have_cur)
+  {
+    aux->old = aux->cur;
+    aux->have_old = true;
+    aux->have_cur = false;
+  }
+  // start on the one after
+  pthread_cond_broadcast(&aux->cv);
+  pthread_mutex_unlock(&aux->mu);
+
+  if (!next_name) return -1;
+
+  clock_gettime(CLOCK_REALTIME, &aux->opened);
+  free(aux->cur_name);
+  aux->cur_name = NULL;
+  asprintf(&aux->cur_name, "%s%ld.%09ld%s", aux->prefix, (long) aux->opened.tv_sec, aux->opened.tv_nsec, aux->suffix);
+  if (rename(next_name, aux->cur_name))
+  {
+    fprintf(stderr,"rotating handle: couldn't rename %s to %s (%s)\n", next_name, aux->cur_name, strerror(errno));
+  }
+  free(next_name);
+
+  aux->cur = next;
+  aux->have_cur = true;
+  aux->cur_bytes = 0;
+  aux->cur_packets = 0;
+  return 0;
+}
+
+static bool rotate_due(struct rotate_aux * aux)
+{
+  if (!aux->have_cur) return true;
+  if (aux->opts.max_bytes && aux->cur_bytes >= aux->opts.max_bytes) return true;
+  if (aux->opts.max_packets && aux->cur_packets >= aux->opts.max_packets) return true;
+  if (aux->opts.max_secs)
+  {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    if ((now.tv_sec - aux->opened.tv_sec) * 1000 + (now.tv_nsec - aux->opened.tv_nsec) / 1000000 >= aux->opts.max_secs * 1000L) return true;
+  }
+  return false;
+}
+
+static int rotate_writebytes(size_t nbytes, const void * bytes, pueo_handle_t *h)
+{
+  struct rotate_aux * aux = (struct rotate_aux*) h->aux;
+
+  // packets never straddle files, so this is the only place we rotate
+  if (aux->at_packet_start)
+  {
+    aux->at_packet_start = false;
+    if (rotate_due(aux) && rotate_next(aux)) return -1;
+  }
+  if (!aux->have_cur) return -1;
+
+  int r = aux->cur.write_bytes(nbytes, bytes, &aux->cur);
+  if (r > 0) aux->cur_bytes += r;
+  return r;
+}
+
+// a packet that failed partway never got to rotate_done, but the next one must still be able to rotate
+static void rotate_begin(pueo_handle_t *h)
+{
+  struct rotate_aux * aux = (struct rotate_aux*) h->aux;
+  aux->at_packet_start = true;
+  if (aux->have_cur && aux->cur.begin_write_packet) aux->cur.begin_write_packet(&aux->cur);
+}
+
+static int rotate_done(pueo_handle_t *h)
+{
+  struct rotate_aux * aux = (struct rotate_aux*) h->aux;
+  aux->at_packet_start = true;
+  if (!aux->have_cur) return 0;
+  aux->cur_packets++;
+  return aux->cur.done_write_packet ? aux->cur.done_write_packet(&aux->cur) : 0;
+}
+
+static int rotate_flush(pueo_handle_t *h)
+{
+  struct rotate_aux * aux = (struct rotate_aux*) h->aux;
+  return aux->have_cur && aux->cur.flush ? aux->cur.flush(&aux->cur) : 0;
+}
+
+static int rotate_close(pueo_handle_t *h)
+{
+  struct rotate_aux * aux = (struct rotate_aux*) h->aux;
+  if (!aux) return 0;
+
+  pthread_mutex_lock(&aux->mu);
+  aux->closing = true;
+  pthread_cond_broadcast(&aux->cv);
+  pthread_mutex_unlock(&aux->mu);
+  pthread_join(aux->thread, NULL);
+
+  int r = aux->close_errors ? -1 : 0;
+  if (aux->have_cur && pueo_handle_close(&aux->cur)) r = -1;
+
+  // throw away the file we opened ahead of time
+  if (aux->next_ready && aux->next_name)
+  {
+    pueo_handle_close(&aux->next);
+    unlink(aux->next_name);
+    free(aux->next_name);
+  }
+
+  pthread_mutex_destroy(&aux->mu);
+  pthread_cond_destroy(&aux->cv);
+  free(aux->cur_name);
+  free(aux->prefix);
+  free(aux);
+  h->aux = NULL;
+  return r;
+}
+
+
+/* io_uring backend, using the raw syscalls so we don't need liburing.
+ *
+ * The file is read or written in blocks that live in buffers registered with the kernel. When reading,
+ * all the blocks are kept in flight as readahead; when writing, full blocks are submitted and we only wait when
+ * we come back around to a block that's still being written.
+ */
+#ifdef PUEO_HAVE_IO_URING
+
+enum uring_block_state
+{
+  URING_BLOCK_FREE,
+  URING_BLOCK_INFLIGHT,
+  URING_BLOCK_READY
+};
+
+struct uring_block
+{
+  enum uring_block_state state;
+  uint64_t offset; // file offset
+  int len;         // valid bytes (or the result of the io)
+  int pos;         // consumed (reading) or filled (writing)
+};
+
+struct uring_aux
+{
+  int ring_fd;
+  int fd;
+  bool writing;
+
+  // the rings, mmaped from the kernel
+  void * sq_ptr;
+  size_t sq_sz;
+  void * cq_ptr;
+  size_t cq_sz;
+  struct io_uring_sqe * sqes;
+  size_t sqes_sz;
+  unsigned * sq_tail;
+  unsigned * sq_mask;
+  unsigned * sq_array;
+  unsigned * cq_head;
+  unsigned * cq_tail;
+  unsigned * cq_mask;
+  struct io_uring_cqe * cqes;
+  unsigned to_submit;
+
+  uint8_t * mem;
+  size_t block_size;
+  int nblocks;
+  struct uring_block * blocks;
+  int cur;  // block being consumed / filled
+  int next; // next block to submit a read for
+  uint64_t next_offset; // where the next read or write goes
+  bool eof;
+  bool failed;
+};
+
+#define URING_BLOCK_BUF(aux,i) ((aux)->mem + (size_t) (i) * (aux)->block_size)
+
+static int uring_enter(struct uring_aux * aux, unsigned min_complete)
+{
+  while (true)
+  {
+    int r = syscall(__NR_io_uring_enter, aux->ring_fd, aux->to_submit, min_complete, min_complete ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    if (r < 0)
+    {
+      if (errno == EINTR) continue;
+      return -1;
+    }
+    aux->to_submit -= (unsigned) r < aux->to_submit ? (unsigned) r : aux->to_submit;
+    return 0;
+  }
+}
+
+static void uring_queue_block(struct uring_aux * aux, int i)
+{
+  struct uring_block * b = &aux->blocks[i];
+  unsigned tail = *aux->sq_tail;
+  unsigned idx = tail & *aux->sq_mask;
+  struct io_uring_sqe * sqe = &aux->sqes[idx];
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = aux->writing ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+  sqe->fd = aux->fd;
+  sqe->off = b->offset;
+  sqe->addr = (uintptr_t) URING_BLOCK_BUF(aux,i);
+  sqe->len = aux->writing ? (unsigned) b->pos : aux->block_size;
+  sqe->buf_index = i;
+  sqe->user_data = i;
+  aux->sq_array[idx] = idx;
+  __atomic_store_n(aux->sq_tail, tail + 1, __ATOMIC_RELEASE);
+  aux->to_submit++;
+  b->state = URING_BLOCK_INFLIGHT;
+}
+
+static void uring_reap(struct uring_aux * aux)
+{
+  unsigned head = *aux->cq_head;
+  unsigned tail = __atomic_load_n(aux->cq_tail, __ATOMIC_ACQUIRE);
+  while (head != tail)
+  {
+    struct io_uring_cqe * cqe = &aux->cqes[head & *aux->cq_mask];
+    struct uring_block * b = &aux->blocks[cqe->user_data];
+    b->len = cqe->res;
+    b->state = URING_BLOCK_READY;
+    head++;
+  }
+  __atomic_store_n(aux->cq_head, head, __ATOMIC_RELEASE);
+}
+
+// wait for block i to finish
+static int uring_wait(struct uring_aux * aux, int i)
+{
+  while (aux->blocks[i].state == URING_BLOCK_INFLIGHT)
+  {
+    if (uring_enter(aux, 1)) return -1;
+    uring_reap(aux);
+  }
+  return 0;
+}
+
+static void uring_submit_read(struct uring_aux * aux, int i)
+{
+  struct uring_block * b = &aux->blocks[i];
+  b->offset = aux->next_offset;
+  b->pos = 0;
+  aux->next_offset += aux->block_size;
+  uring_queue_block(aux, i);
+}
+
+static int uring_readbytes(size_t nbytes, void * bytes, pueo_handle_t *h)
+{
+  struct uring_aux * aux = (struct uring_aux*) h->aux;
+  size_t ncopied = 0;
+  while (ncopied < nbytes && !aux->failed)
+  {
+    struct uring_block * b = &aux->blocks[aux->cur];
+    if (b->state == URING_BLOCK_FREE) break; // past EOF
+    if (uring_wait(aux, aux->cur))
+    {
+      aux->failed = true;
+      break;
+    }
+    if (b->len < 0)
+    {
+      fprintf(stderr,"uring read failed: %s\n", strerror(-b->len));
+      aux->failed = true;
+      break;
+    }
+
+    int nleft = b->len - b->pos;
+    size_t ncopy = (size_t) nleft < nbytes - ncopied ? (size_t) nleft : nbytes - ncopied;
+    memcpy((uint8_t*) bytes + ncopied, URING_BLOCK_BUF(aux,aux->cur) + b->pos, ncopy);
+    b->pos += ncopy;
+    ncopied += ncopy;
+
+    if (b->pos == b->len)
+    {
+      // a short block means we hit the end of the file
+      if (b->len < (int) aux->block_size) aux->eof = true;
+      b->state = URING_BLOCK_FREE;
+      if (!aux->eof)
+      {
+        uring_submit_read(aux, aux->cur);
+        if (uring_enter(aux, 0))
+        {
+          fprintf(stderr,"uring submit failed: %s\n", strerror(errno));
+          aux->failed = true;
+        }
+      }
+      aux->cur = (aux->cur + 1) % aux->nblocks;
+    }
+  }
+  return ncopied || !aux->failed ? (int) ncopied : -1;
+}
+
+// make sure block i is done being written and check it went ok
+static int uring_finish_write(struct uring_aux * aux, int i)
+{
+  struct uring_block * b = &aux->blocks[i];
+  if (b->state == URING_BLOCK_FREE) return 0;
+  if (uring_wait(aux, i)) return -1;
+  b->state = URING_BLOCK_FREE;
+  if (b->len < 0)
+  {
+    fprintf(stderr,"uring write failed: %s\n", strerror(-b->len));
+    return -1;
+  }
+  // short writes are unlikely, but finish them synchronously
+  while (b->len < b->pos)
+  {
+    ssize_t r = pwrite(aux->fd, URING_BLOCK_BUF(aux,i) + b->len, b->pos - b->len, b->offset + b->len);
+    if (r <= 0) return -1;
+    b->len += r;
+  }
+  return 0;
+}
+
+// submit the block being filled and move on to the next one
+static int uring_submit_write(struct uring_aux * aux)
+{
+  struct uring_block * b = &aux->blocks[aux->cur];
+  if (!b->pos) return 0;
+  b->offset = aux->next_offset;
+  aux->next_offset += b->pos;
+  uring_queue_block(aux, aux->cur);
+  if (uring_enter(aux, 0)) return -1;
+  aux->cur = (aux->cur + 1) % aux->nblocks;
+  int r = uring_finish_write(aux, aux->cur);
+  aux->blocks[aux->cur].pos = 0;
+  return r;
+}
+
+static int uring_writebytes(size_t nbytes, const void * bytes, pueo_handle_t *h)
+{
+  struct uring_aux * aux = (struct uring_aux*) h->aux;
+  size_t nwritten = 0;
+  while (nwritten < nbytes)
+  {
+    struct uring_block * b = &aux->blocks[aux->cur];
+    size_t room = aux->block_size - b->pos;
+    size_t ncopy = room < nbytes - nwritten ? room : nbytes - nwritten;
+    memcpy(URING_BLOCK_BUF(aux,aux->cur) + b->pos, (const uint8_t*) bytes + nwritten, ncopy);
+    b->pos += ncopy;
+    nwritten += ncopy;
+    if (b->pos == (int) aux->block_size && uring_submit_write(aux)) return -1;
+  }
+  return nwritten;
+}
+
+static int uring_flush(pueo_handle_t *h)
+{
+  struct uring_aux * aux = (struct uring_aux*) h->aux;
+  if (!aux->writing) return 0;
+  int r = uring_submit_write(aux);
+  for (int i = 0; i < aux->nblocks; i++)
+  {
+    if (uring_finish_write(aux, i)) r = -1;
+  }
+  return r;
+}
+
+static void uring_free(struct uring_aux * aux)
+{
+  if (aux->sqes) munmap(aux->sqes, aux->sqes_sz);
+  if (aux->cq_ptr && aux->cq_ptr != aux->sq_ptr) munmap(aux->cq_ptr, aux->cq_sz);
+  if (aux->sq_ptr) munmap(aux->sq_ptr, aux->sq_sz);
+  if (aux->ring_fd >= 0) close(aux->ring_fd); // this also unregisters the buffers
+  if (aux->fd >= 0) close(aux->fd);
+  free(aux->mem);
+  free(aux->blocks);
+  free(aux);
+}
+
+static int uring_close(pueo_handle_t *h)
+{
+  struct uring_aux * aux = (struct uring_aux*) h->aux;
+  if (!aux) return 0;
+  int r = 0;
+  if (aux->writing) r = uring_flush(h);
+  else
+  {
+    // can't free the buffers under the kernel's nose
+    for (int i = 0; i < aux->nblocks; i++) uring_wait(aux, i);
+  }
+  uring_free(aux);
+  h->aux = NULL;
+  return r;
+}
+
+static int uring_setup(struct uring_aux * aux)
+{
+  struct io_uring_params p;
+  memset(&p, 0, sizeof(p));
+  aux->ring_fd = syscall(__NR_io_uring_setup, aux->nblocks, &p);
+  if (aux->ring_fd < 0) return -1;
+
+  aux->sq_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  aux->cq_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP)
+  {
+    if (aux->cq_sz > aux->sq_sz) aux->sq_sz = aux->cq_sz;
+    aux->cq_sz = aux->sq_sz;
+  }
+
+  aux->sq_ptr = mmap(NULL, aux->sq_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, aux->ring_fd, IORING_OFF_SQ_RING);
+  if (aux->sq_ptr == MAP_FAILED)
+  {
+    aux->sq_ptr = NULL;
+    return -1;
+  }
+
+  if (p.features & IORING_FEAT_SINGLE_MMAP)
+  {
+    aux->cq_ptr = aux->sq_ptr;
+  }
+  else
+  {
+    aux->cq_ptr = mmap(NULL, aux->cq_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, aux->ring_fd, IORING_OFF_CQ_RING);
+    if (aux->cq_ptr == MAP_FAILED)
+    {
+      aux->cq_ptr = NULL;
+      return -1;
+    }
+  }
+
+  aux->sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+  aux->sqes = mmap(NULL, aux->sqes_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, aux->ring_fd, IORING_OFF_SQES);
+  if (aux->sqes == MAP_FAILED)
+  {
+    aux->sqes = NULL;
+    return -1;
+  }
+
+  uint8_t * sq = aux->sq_ptr;
+  uint8_t * cq = aux->cq_ptr;
+  aux->sq_tail = (unsigned*) (sq + p.sq_off.tail);
+  aux->sq_mask = (unsigned*) (sq + p.sq_off.ring_mask);
+  aux->sq_array = (unsigned*) (sq + p.sq_off.array);
+  aux->cq_head = (unsigned*) (cq + p.cq_off.head);
+  aux->cq_tail = (unsigned*) (cq + p.cq_off.tail);
+  aux->cq_mask = (unsigned*) (cq + p.cq_off.ring_mask);
+  aux->cqes = (struct io_uring_cqe*) (cq + p.cq_off.cqes);
+
+  // register the block buffers
+  struct iovec * iovs = calloc(aux->nblocks, sizeof(struct iovec));
+  if (!iovs) return -1;
+  for (int i = 0; i < aux->nblocks; i++)
+  {
+    iovs[i].iov_base = URING_BLOCK_BUF(aux,i);
+    iovs[i].iov_len = aux->block_size;
+  }
+  int r = syscall(__NR_io_uring_register, aux->ring_fd, IORING_REGISTER_BUFFERS, iovs, aux->nblocks);
+  free(iovs);
+  return r;
+}
+
+#endif
+
+
+static int hinit(pueo_handle_t *h)
+{
+  // zero out
+  memset(h,0,sizeof(pueo_handle_t));
+  return 0;
+}
+
+
+int pueo_handle_init_filep(pueo_handle_t *h, FILE* f, bool close)
+{
+
+  hinit(h);
+  if (!f) return -1;
+  h->aux = f;
+  h->close = close ? file_close : NULL;
+  h->read_bytes = file_readbytes;
+  h->write_bytes = file_writebytes;
+  h->flush = file_flush;
+  h->seek = file_seek;
+  h->skip_bytes = file_skipbytes;
+  asprintf(&h->description, "FILE* at 0x%p", f);
+  return 0;
+}
+
+int pueo_handle_init_file(pueo_handle_t *h, const char * file, const char * mode)
+{
+
+  hinit(h);
+
+  //check for .gz or .zst suffix
+
+  const char * suffix = rindex(file,'.');
+  if (suffix && !strcmp(suffix,".zst"))
+  {
+    return pueo_handle_init_zstd(h, file, mode, NULL);
+  }
+
+  if (suffix && !strcmp(suffix,".gz"))
+  {
+    if (strchr(mode,'r') && pueo_bgz_probe(file))
+    {
+      return pueo_handle_init_bgz(h, file, mode, NULL);
+    }
+
+    if (strchr(mode,'r'))
+    {
+      // open it ourselves so we can tell the kernel we'll be reading straight through
+      int fd = open(file, O_RDONLY);
+      if (fd < 0) return -1;
+      posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+      h->aux = gzdopen(fd, mode);
+      if (!h->aux) close(fd);
+    }
+    else
+    {
+      h->aux = gzopen(file, mode);
+    }
+    if (!h->aux)
+    {
+      return -1;
+    }
+    h->close = gz_close;
+    h->read_bytes = gz_readbytes;
+    h->write_bytes = gz_writebytes;
+    h->flush = gz_flush;
+    h->seek = gz_seek;
+    h->skip_bytes = gz_skipbytes;
+    asprintf(&h->description,"gzfile %s", file);
+    return 0;
+  }
+
+  //just use good old stdio
+  h->aux = fopen(file, mode);
+  if (!h->aux) return -1;
+  if (strchr(mode,'r')) posix_fadvise(fileno(h->aux), 0, 0, POSIX_FADV_SEQUENTIAL);
+  h->close = file_close;
+  h->read_bytes = file_readbytes;
+  h->write_bytes = file_writebytes;
+  h->flush = file_flush;
+  h->seek = file_seek;
+  h->skip_bytes = file_skipbytes;
+  h->description = strdup(file);
+  return 0;
+}
+
+
+int pueo_handle_init_zstd(pueo_handle_t *h, const char * file, const char * mode, const pueo_zstd_opts_t * opts)
+{
+  hinit(h);
+#ifndef ZSTD_ENABLED
+  (void) file;
+  (void) mode;
+  (void) opts;
+  fprintf(stderr, "You asked to open a zstd file but compiled without zstd support. What were you expecting to happen?\n");
+  return -1;
+#else
+
+  bool am_reading = !!strchr(mode,'r');
+  bool am_appending = !!strchr(mode,'a');
+  bool am_writing = !!strchr(mode,'w') || am_appending;
+  if (!(am_reading ^ am_writing))
+  {
+    fprintf(stderr,"pueo_handle_init_zstd: mode must have one of r, w or a in it\n");
+    return -1;
+  }
+
+  pueo_zstd_opts_t o = {0};
+  if (opts) o = *opts;
+  else
+  {
+    // like gzopen, allow the level to be in the mode
+    const char * digits = strpbrk(mode,"0123456789");
+    if (digits) o.level = atoi(digits);
+  }
+  size_t bufsize = o.buffer_size > 0 ? (size_t) o.buffer_size : 4 << 20;
+
+  int fd = am_reading ? open(file, O_RDONLY) :
+           open(file, O_WRONLY | O_CREAT | (am_appending ? O_APPEND : O_TRUNC), 0666);
+  if (fd < 0) return -1;
+
+  struct zstd_aux * aux = calloc(1, sizeof(struct zstd_aux));
+  if (!aux)
+  {
+    close(fd);
+    return -1;
+  }
+  aux->fd = fd;
+  if (am_reading)
+  {
+    aux->dctx = ZSTD_createDCtx();
+    aux->zcap = ZSTD_DStreamInSize() > bufsize / 4 ? ZSTD_DStreamInSize() : bufsize / 4;
+    aux->dcap = bufsize;
+    aux->dbuf = malloc(aux->dcap);
+  }
+  else
+  {
+    aux->cctx = ZSTD_createCCtx();
+    aux->zcap = bufsize;
+  }
+  aux->zbuf = malloc(aux->zcap);
+  if (!aux->zbuf || (am_reading ? !aux->dctx || !aux->dbuf : !aux->cctx))
+  {
+    fprintf(stderr,"pueo_handle_init_zstd: couldn't allocate the zstd context and %zu byte buffers\n", bufsize);
+    close(fd);
+    zstd_free(aux);
+    return -1;
+  }
+
+  if (am_reading)
+  {
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    // allow reading anything written with long distance matching
+    ZSTD_CHECK_PARAM(ZSTD_DCtx_setParameter(aux->dctx, ZSTD_d_windowLogMax, ZSTD_dParam_getBounds(ZSTD_d_windowLogMax).upperBound));
+  }
+  else
+  {
+    if (o.level) ZSTD_CHECK_PARAM(ZSTD_CCtx_setParameter(aux->cctx, ZSTD_c_compressionLevel, o.level));
+    ZSTD_CHECK_PARAM(ZSTD_CCtx_setParameter(aux->cctx, ZSTD_c_checksumFlag, 1));
+    if (o.nthreads > 0) ZSTD_CHECK_PARAM(ZSTD_CCtx_setParameter(aux->cctx, ZSTD_c_nbWorkers, o.nthreads));
+    if (o.window_log > 0)
+    {
+      ZSTD_CHECK_PARAM(ZSTD_CCtx_setParameter(aux->cctx, ZSTD_c_enableLongDistanceMatching, 1));
+      ZSTD_CHECK_PARAM(ZSTD_CCtx_setParameter(aux->cctx, ZSTD_c_windowLog, o.window_log));
+    }
+  }
+
+  h->aux = aux;
+  h->close = zstd_close;
+  h->read_bytes = am_reading ? zstd_readbytes : NULL;
+  h->write_bytes = am_writing ? zstd_writebytes : NULL;
+  h->flush = am_writing ? zstd_flush : NULL;
+  if (am_reading) asprintf(&h->description, "zstd file %s", file);
+  else asprintf(&h->description, "zstd file %s (level %d, %d threads%s)", file, o.level ? o.level : ZSTD_CLEVEL_DEFAULT, o.nthreads, o.window_log ? ", ldm" : "");
+  return 0;
+#endif
+}
+
+
+int pueo_handle_init_fd_with_desc(pueo_handle_t *h, int fd, const char * desc)
+{
+  hinit(h) ;
+
+  if (fd < 0) return -1;
+
+  h->aux = (void*) ( (intptr_t) fd) ;
+  h->close = fd_close;
+  h->read_bytes = fd_readbytes;
+  h->write_bytes = fd_writebytes;
+  h->write_bytesv = fd_writebytesv;
+  h->seek = fd_seek;
+  h->skip_bytes = fd_skipbytes;
+  if (desc)
+  {
+    h->description = strdup(desc);
+  }
+  else
+  {
+    char fdbuf[64];
+    sprintf(fdbuf,"/proc/self/fds/%d", fd);
+    char * fdname =realpath(fdbuf,NULL);
+    asprintf(&h->description, "fd %d (%s)", fd, fdname);
+    free(fdname);
+  }
+  return 0;
+}
+
+int pueo_handle_init_fd(pueo_handle_t *h, int fd)
+{
+  return pueo_handle_init_fd_with_desc(h,fd,NULL);
+}
+
+int pueo_handle_init_mmap(pueo_handle_t *h, const char * file)
+{
+  hinit(h);
+
+  int fd = open(file, O_RDONLY);
+  if (fd < 0) return -1;
+
+  struct stat st;
+  if (fstat(fd, &st))
+  {
+    close(fd);
+    return -1;
+  }
+
+  struct mmap_aux * aux = calloc(1, sizeof(struct mmap_aux));
+  aux->size = st.st_size;
+
+  // can't map an empty file, but that's ok, we'll just always return EOF
+  if (aux->size)
+  {
+    void * base = mmap(NULL, aux->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (base == MAP_FAILED)
+    {
+      fprintf(stderr,"pueo_handle_init_mmap: couldn't mmap %s\n", file);
+      free(aux);
+      close(fd);
+      return -1;
+    }
+    madvise(base, aux->size, MADV_SEQUENTIAL);
+    aux->base = base;
+  }
+  close(fd); // the mapping keeps the file alive
+
+  h->aux = aux;
+  h->close = mmap_close;
+  h->read_bytes = mmap_readbytes;
+  h->view_bytes = mmap_viewbytes;
+  h->seek = mmap_seek;
+  asprintf(&h->description, "mmap %s", file);
+  return 0;
+}
+
+int pueo_handle_init_mem(pueo_handle_t *h, size_t capacity)
+{
+  hinit(h);
+  struct mem_aux * aux = calloc(1, sizeof(struct mem_aux));
+  aux->cap = capacity ? capacity : 64 << 10;
+  aux->buf = malloc(aux->cap);
+  if (!aux->buf)
+  {
+    free(aux);
+    return -1;
+  }
+
+  h->aux = aux;
+  h->close = mem_close;
+  h->write_bytes = mem_writebytes;
+  h->read_bytes = mem_readbytes;
+  h->view_bytes = mem_viewbytes;
+  h->seek = mem_seek;
+  asprintf(&h->description, "mem://");
+  return 0;
+}
+
+int pueo_handle_init_mem_span(pueo_handle_t *h, const void * data, size_t len)
+{
+  hinit(h);
+  struct mem_aux * aux = calloc(1, sizeof(struct mem_aux));
+  aux->buf = (uint8_t*) data; // never written through, since cap is 0
+  aux->len = len;
+
+  h->aux = aux;
+  h->close = mem_close;
+  h->read_bytes = mem_readbytes;
+  h->view_bytes = mem_viewbytes;
+  h->seek = mem_seek;
+  asprintf(&h->description, "mem span (%zu bytes)", len);
+  return 0;
+}
+
+const void * pueo_handle_mem_data(const pueo_handle_t *h, size_t * len)
+{
+  if (h->close != mem_close) return NULL;
+  const struct mem_aux * aux = (const struct mem_aux*) h->aux;
+  if (len) *len = aux->len;
+  return aux->buf;
+}
+
+int pueo_handle_mem_reset(pueo_handle_t *h)
+{
+  if (h->close != mem_close) return -1;
+  struct mem_aux * aux = (struct mem_aux*) h->aux;
+  if (!aux->cap) return -1;
+  aux->len = 0;
+  aux->pos = 0;
+  h->flags &= ~PUEO_HANDLE_ALREADY_READ_HEAD;
+  h->required_read_size = 0;
+  return 0;
+}
+
+int pueo_handle_close(pueo_handle_t *h)
+{
+  int r = h->close ? h->close(h) : 0;
+  free(h->description);
+  hinit(h);
+  return r;
+}
+
+int pueo_handle_init_uring(pueo_handle_t *h, const char * file, const char * mode, const pueo_uring_opts_t * opts)
+{
+  hinit(h);
+#ifndef PUEO_HAVE_IO_URING
+  (void) file;
+  (void) mode;
+  (void) opts;
+  fprintf(stderr, "You asked for an io_uring handle but this isn't a system with io_uring. What were you expecting to happen?\n");
+  return -1;
+#else
+  bool am_reading = !!strchr(mode,'r');
+  bool am_appending = !!strchr(mode,'a');
+  bool am_writing = !!strchr(mode,'w') || am_appending;
+  if (!(am_reading ^ am_writing))
+  {
+    fprintf(stderr,"pueo_handle_init_uring: mode must have one of r, w or a in it\n");
+    return -1;
+  }
+
+  pueo_uring_opts_t o = {0};
+  if (opts) o = *opts;
+  if (o.block_size <= 0) o.block_size = 1 << 20;
+  if (o.nblocks <= 0) o.nblocks = 8;
+
+  struct uring_aux * aux = calloc(1, sizeof(struct uring_aux));
+  if (!aux) return -1;
+  aux->ring_fd = -1;
+  aux->writing = am_writing;
+  aux->block_size = o.block_size;
+  aux->nblocks = o.nblocks;
+  aux->blocks = calloc(aux->nblocks, sizeof(struct uring_block));
+  aux->mem = aligned_alloc(4096, (size_t) aux->nblocks * aux->block_size);
+  aux->fd = am_reading ? open(file, O_RDONLY) : open(file, O_WRONLY | O_CREAT | (am_appending ? 0 : O_TRUNC), 0666);
+  if (aux->fd < 0 || !aux->mem || !aux->blocks)
+  {
+    uring_free(aux);
+    return -1;
+  }
+
+  if (uring_setup(aux))
+  {
+    fprintf(stderr,"pueo_handle_init_uring: couldn't set up io_uring (%s)\n", strerror(errno));
+    uring_free(aux);
+    return -1;
+  }
+
+  if (am_appending)
+  {
+    struct stat st;
+    fstat(aux->fd, &st);
+    aux->next_offset = st.st_size;
+  }
+
+  if (am_reading)
+  {
+    posix_fadvise(aux->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    // get all the readahead going
+    for (int i = 0; i < aux->nblocks; i++) uring_submit_read(aux, i);
+    if (uring_enter(aux, 0))
+    {
+      fprintf(stderr,"pueo_handle_init_uring: couldn't start reading %s (%s)\n", file, strerror(errno));
+      uring_free(aux);
+      return -1;
+    }
+  }
+
+  h->aux = aux;
+  h->close = uring_close;
+  h->read_bytes = am_reading ? uring_readbytes : NULL;
+  h->write_bytes = am_writing ? uring_writebytes : NULL;
+  h->flush = am_writing ? uring_flush : NULL;
+  asprintf(&h->description, "uring %s (%d x %d kB)", file, o.nblocks, o.block_size >> 10);
+  return 0;
+#endif
+}
+
+int pueo_handle_flush(pueo_handle_t *h)
+{
+  return h->flush ? h->flush(h) : 0;
+}
+
+int pueo_handle_seek(pueo_handle_t *h, uint64_t offset)
+{
+  if (!h->seek) return -ENOTSUP;
+  if (h->seek(offset, h)) return -1;
+
+  // whatever header we had is no longer next
+  h->flags &= ~PUEO_HANDLE_ALREADY_READ_HEAD;
+  h->required_read_size = 0;
+  h->bytes_read = offset;
+  return 0;
+}
+
+int pueo_handle_set_buffer(pueo_handle_t *h, size_t size)
+{
+  struct buffered_aux * aux = h->close == buffered_close ? (struct buffered_aux*) h->aux : NULL;
+
+  if (!aux)
+  {
+    if (!size) return 0;
+    aux = calloc(1, sizeof(struct buffered_aux));
+    aux->buf = malloc(size);
+    if (!aux->buf)
+    {
+      free(aux);
+      return -1;
+    }
+    aux->cap = size;
+
+    // the inner handle keeps the backend, the outer one keeps the counters and description
+    aux->inner = *h;
+    aux->inner.description = NULL;
+    aux->inner_dropped = h->packets_dropped;
+    h->aux = aux;
+    h->close = buffered_close;
+    h->flush = buffered_flush;
+    h->write_bytes = aux->inner.write_bytes ? buffered_writebytes : NULL;
+    h->write_bytesv = NULL;
+    h->done_write_packet = aux->inner.write_bytes ? buffered_done : NULL;
+    h->begin_write_packet = aux->inner.begin_write_packet ? buffered_begin : NULL;
+    h->read_bytes = aux->inner.read_bytes ? buffered_readbytes : NULL;
+    h->view_bytes = aux->inner.read_bytes ? buffered_viewbytes : NULL;
+    h->seek = aux->inner.read_bytes && aux->inner.seek ? buffered_seek : NULL;
+    h->skip_bytes = NULL; // buffered_viewbytes does it
+    return 0;
+  }
+
+  if (aux->inner.write_bytes && buffered_flush_buf(aux)) return -1;
+
+  // can't drop anything we've already read in
+  size_t nunread = aux->len - aux->pos;
+  if (nunread > size)
+  {
+    fprintf(stderr,"pueo_handle_set_buffer: %zu bytes are still buffered, can't shrink to %zu\n", nunread, size);
+    return -1;
+  }
+
+  if (!size)
+  {
+    // unwrap, putting the backend back
+    h->aux = aux->inner.aux;
+    h->close = aux->inner.close;
+    h->flush = aux->inner.flush;
+    h->write_bytes = aux->inner.write_bytes;
+    h->write_bytesv = aux->inner.write_bytesv;
+    h->done_write_packet = aux->inner.done_write_packet;
+    h->begin_write_packet = aux->inner.begin_write_packet;
+    h->read_bytes = aux->inner.read_bytes;
+    h->view_bytes = aux->inner.view_bytes;
+    h->seek = aux->inner.seek;
+    h->skip_bytes = aux->inner.skip_bytes;
+    free(aux->buf);
+    free(aux);
+    return 0;
+  }
+
+  memmove(aux->buf, aux->buf + aux->pos, nunread);
+  aux->len = nunread;
+  aux->pos = 0;
+  uint8_t * newbuf = realloc(aux->buf, size);
+  if (!newbuf) return -1;
+  aux->buf = newbuf;
+  aux->cap = size;
+  return 0;
 }
 
-static int gz_writebytes(size_t nbytes, const void * bytes, pueo_handle_t *h)
-{
-  gzFile  f  = (gzFile) h->aux;
-  return gzwrite(f, bytes, nbytes);
-}
-static int gz_readbytes(size_t nbytes, void * bytes, pueo_handle_t *h)
+int pueo_handle_init_async(pueo_handle_t *h, pueo_handle_t * inner, const pueo_async_opts_t * opts)
 {
-  gzFile f = (gzFile) h->aux;
-  return gzread(f, bytes, nbytes);
-}
+  hinit(h);
+  if (!inner || !inner->write_bytes)
+  {
+    fprintf(stderr,"pueo_handle_init_async: need a handle to write to\n");
+    return -1;
+  }
 
-static int gz_close(pueo_handle_t  * h)
-{
-  gzFile f = (gzFile) h->aux;
-  return gzclose(f);
-}
+  pueo_async_opts_t o = {0};
+  if (opts) o = *opts;
+  if (o.queue_depth <= 0) o.queue_depth = 8;
+  if (o.slot_size <= 0) o.slot_size = sizeof(pueo_packet_head_t) + (1 << 20); // num_bytes is 20 bits
 
+  struct async_aux * aux = calloc(1, sizeof(struct async_aux));
+  pthread_mutex_init(&aux->mu, NULL);
+  pthread_cond_init(&aux->cv_work, NULL);
+  pthread_cond_init(&aux->cv_room, NULL);
+  aux->policy = o.policy;
+  aux->depth = o.queue_depth;
+  aux->slot_size = o.slot_size;
+  int nslots = aux->depth + 1;
+  aux->mem = malloc((size_t) nslots * aux->slot_size);
+  aux->lens = calloc(nslots, sizeof(size_t));
+  aux->queue = calloc(aux->depth, sizeof(int));
+  aux->free_slots = calloc(nslots, sizeof(int));
+  if (!aux->mem || !aux->lens || !aux->queue || !aux->free_slots)
+  {
+    fprintf(stderr,"pueo_handle_init_async: couldn't allocate %d slots of %zu bytes\n", nslots, aux->slot_size);
+    async_free(aux);
+    return -1;
+  }
+  // touch everything now so we don't page fault while writing
+  memset(aux->mem, 0, (size_t) nslots * aux->slot_size);
 
-static int hinit(pueo_handle_t *h)
-{
-  // zero out
-  memset(h,0,sizeof(pueo_handle_t));
-  return 0;
-}
+  aux->cur = 0;
+  for (int i = 1; i < nslots; i++) aux->free_slots[aux->nfree++] = i;
 
+  // take over the inner handle
+  aux->inner = *inner;
+  hinit(inner);
 
-int pueo_handle_init_filep(pueo_handle_t *h, FILE* f, bool close)
-{
+  if (pthread_create(&aux->thread, NULL, async_thread, aux))
+  {
+    fprintf(stderr,"pueo_handle_init_async: couldn't start writer thread\n");
+    *inner = aux->inner;
+    async_free(aux);
+    return -1;
+  }
 
-  hinit(h);
-  if (!f) return -1;
-  h->aux = f;
-  h->close = close ? file_close : NULL;
-  h->read_bytes = file_readbytes;
-  h->write_bytes = file_writebytes;
-  asprintf(&h->description, "FILE* at 0x%p", f);
+  h->aux = aux;
+  h->write_bytes = async_writebytes;
+  h->done_write_packet = async_done;
+  h->begin_write_packet = async_reset_cur; // in case the last packet failed before async_done
+  h->flush = async_flush;
+  h->close = async_close;
+  asprintf(&h->description, "async(%s)", aux->inner.description);
   return 0;
 }
 
-int pueo_handle_init_file(pueo_handle_t *h, const char * file, const char * mode)
-{
 
+int pueo_handle_init_rotate(pueo_handle_t *h, const char * prefix, const pueo_rotate_opts_t * opts)
+{
   hinit(h);
+  struct rotate_aux * aux = calloc(1, sizeof(struct rotate_aux));
+  if (opts) aux->opts = *opts;
+  const char * compress = aux->opts.compress ? aux->opts.compress : "";
+  aux->suffix = !strcmp(compress,"zst") ? ".dat.zst" : !strcmp(compress,"gz") ? ".dat.gz" : ".dat";
+  aux->opts.compress = NULL; // we don't keep the string
+  if (*compress && strcmp(compress,"zst") && strcmp(compress,"gz"))
+  {
+    fprintf(stderr,"pueo_handle_init_rotate: don't know how to compress with %s\n", compress);
+    free(aux);
+    return -1;
+  }
+  aux->prefix = strdup(prefix);
+  aux->at_packet_start = true;
+  pthread_mutex_init(&aux->mu, NULL);
+  pthread_cond_init(&aux->cv, NULL);
+  aux->want_next = true; // have the first file ready for the first packet
 
-  //check for .gz or .zst suffix
-
-  const char * suffix = rindex(file,'.');
-  if ((suffix && !strcmp(suffix,".gz")) || ((suffix && !strcmp(suffix,".zst"))))
+  if (pthread_create(&aux->thread, NULL, rotate_thread, aux))
   {
-    h->aux = gzopen(file, mode);
-    if (!h->aux)
-    {
-      return -1;
-    }
-    h->close = gz_close;
-    h->read_bytes = gz_readbytes;
-    h->write_bytes = gz_writebytes;
-    asprintf(&h->description,"gzfile %s", file);
-    return 0;
+    fprintf(stderr,"pueo_handle_init_rotate: couldn't start thread\n");
+    pthread_mutex_destroy(&aux->mu);
+    pthread_cond_destroy(&aux->cv);
+    free(aux->prefix);
+    free(aux);
+    return -1;
   }
 
-  //just use good old stdio
-  h->aux = fopen(file, mode);
-  if (!h->aux) return -1;
-  h->close = file_close;
-  h->read_bytes = file_readbytes;
-  h->write_bytes = file_writebytes;
-  h->description = strdup(file);
+  h->aux = aux;
+  h->write_bytes = rotate_writebytes;
+  h->done_write_packet = rotate_done;
+  h->begin_write_packet = rotate_begin;
+  h->flush = rotate_flush;
+  h->close = rotate_close;
+  asprintf(&h->description, "rotate(%s*%s)", prefix, aux->suffix);
   return 0;
 }
 
+const char * pueo_handle_rotate_current(const pueo_handle_t *h)
+{
+  if (h->close != rotate_close) return NULL;
+  const struct rotate_aux * aux = (const struct rotate_aux*) h->aux;
+  return aux->have_cur ? aux->cur_name : NULL;
+}
 
-int pueo_handle_init_fd_with_desc(pueo_handle_t *h, int fd, const char * desc)
+int pueo_handle_init_prefetch(pueo_handle_t *h, pueo_handle_t * inner, const pueo_prefetch_opts_t * opts)
 {
-  hinit(h) ;
+  hinit(h);
+  if (!inner || !inner->read_bytes)
+  {
+    fprintf(stderr,"pueo_handle_init_prefetch: need a handle to read from\n");
+    return -1;
+  }
 
-  if (fd < 0) return -1;
+  pueo_prefetch_opts_t o = {0};
+  if (opts) o = *opts;
+  if (o.block_size <= 0) o.block_size = 1 << 20;
+  if (o.nblocks < 2) o.nblocks = 4;
 
-  h->aux = (void*) ( (intptr_t) fd) ;
-  h->close = fd_close;
-  h->read_bytes = fd_readbytes;
-  h->write_bytes = fd_writebytes;
-  if (desc)
+  struct prefetch_aux * aux = calloc(1, sizeof(struct prefetch_aux));
+  pthread_mutex_init(&aux->mu, NULL);
+  pthread_cond_init(&aux->cv_work, NULL);
+  pthread_cond_init(&aux->cv_data, NULL);
+  aux->block_size = o.block_size;
+  aux->nblocks = o.nblocks;
+  aux->mem = malloc((size_t) aux->nblocks * aux->block_size);
+  aux->lens = calloc(aux->nblocks, sizeof(int));
+  if (!aux->mem || !aux->lens)
   {
-    h->description = strdup(desc);
+    fprintf(stderr,"pueo_handle_init_prefetch: couldn't allocate %d blocks of %d bytes\n", aux->nblocks, aux->block_size);
+    prefetch_free(aux);
+    return -1;
   }
-  else
+
+  // take over the inner handle
+  aux->inner = *inner;
+  hinit(inner);
+
+  if (pthread_create(&aux->thread, NULL, prefetch_thread, aux))
   {
-    char fdbuf[64];
-    sprintf(fdbuf,"/proc/self/fds/%d", fd);
-    char * fdname =realpath(fdbuf,NULL);
-    asprintf(&h->description, "fd %d (%s)", fd, fdname);
-    free(fdname);
+    fprintf(stderr,"pueo_handle_init_prefetch: couldn't start reader thread\n");
+    *inner = aux->inner;
+    prefetch_free(aux);
+    return -1;
   }
+
+  h->aux = aux;
+  h->read_bytes = prefetch_readbytes;
+  h->view_bytes = prefetch_viewbytes;
+  h->seek = aux->inner.seek ? prefetch_seek : NULL;
+  h->close = prefetch_close;
+  asprintf(&h->description, "prefetch(%s)", aux->inner.description);
   return 0;
 }
 
-int pueo_handle_init_fd(pueo_handle_t *h, int fd)
+int pueo_handle_init_resync(pueo_handle_t *h, pueo_handle_t * inner, const pueo_resync_opts_t * opts)
 {
-  return pueo_handle_init_fd_with_desc(h,fd,NULL);
+  hinit(h);
+  if (!inner || !inner->read_bytes)
+  {
+    fprintf(stderr,"pueo_handle_init_resync: need a handle to read from\n");
+    return -1;
+  }
+
+  struct resync_aux * aux = calloc(1, sizeof(struct resync_aux));
+  if (!aux) return -1;
+  if (opts) aux->opts = *opts;
+  const uint32_t largest = (1 << 20) - 1; // num_bytes is 20 bits
+  if (!aux->opts.max_bytes || aux->opts.max_bytes > largest) aux->opts.max_bytes = largest;
+
+  // take over the inner handle
+  aux->inner = *inner;
+  hinit(inner);
+
+  h->aux = aux;
+  h->read_bytes = resync_readbytes;
+  h->view_bytes = resync_viewbytes;
+  h->seek = aux->inner.seek ? resync_seek : NULL;
+  h->close = resync_close;
+  asprintf(&h->description, "resync(%s)", aux->inner.description);
+  return 0;
 }
 
-int pueo_handle_close(pueo_handle_t *h)
+int pueo_handle_resync_stats(const pueo_handle_t *h, pueo_resync_stats_t * stats)
 {
-  if (h->close) h->close(h);
-  free(h->description);
-  return hinit(h);
+  if (!h || h->close != resync_close || !h->aux || !stats) return -1;
+  *stats = ((const struct resync_aux*) h->aux)->stats;
+  return 0;
 }
 
-
 int pueo_handle_init_udp(pueo_handle_t * h, int port, const char *hostname, const char * mode)
+{
+  return pueo_handle_init_udp_opts(h, port, hostname, mode, NULL);
+}
+
+int pueo_handle_init_udp_opts(pueo_handle_t * h, int port, const char *hostname, const char * mode, const pueo_udp_opts_t * opts)
 {
   hinit(h);
 
@@ -286,6 +3116,14 @@ int pueo_handle_init_udp(pueo_handle_t * h, int port, const char *hostname, cons
     return -1;
   }
 
+  pueo_udp_opts_t o = {0};
+  if (opts) o = *opts;
+  if (o.batch <= 0) o.batch = 1;
+  if (o.max_delay_ms <= 0) o.max_delay_ms = 10;
+  if (o.coalesce < 0 || o.coalesce > UDP_MAX) o.coalesce = UDP_MAX;
+  if (o.reassembly_slots <= 0) o.reassembly_slots = 4;
+  if (o.reassembly_timeout_ms <= 0) o.reassembly_timeout_ms = 1000;
+
 
   int sock = socket(AF_INET, SOCK_DGRAM, 0);
   if (sock < 0)
@@ -304,6 +3142,7 @@ int pueo_handle_init_udp(pueo_handle_t * h, int port, const char *hostname, cons
   if (getaddrinfo(hostname,NULL,&hints,&result))
   {
     fprintf(stderr,"pueo_handle_udp: problem with getaddrinfo(%s)\n", hostname);
+    close(sock);
     return -1;
   }
 
@@ -318,8 +3157,14 @@ int pueo_handle_init_udp(pueo_handle_t * h, int port, const char *hostname, cons
     if (bind(sock, (struct sockaddr*)  &sa, sizeof(sa)))
     {
       fprintf(stderr,"pueo_handle_udp: couldn't bind to %s:%d\n", inet_ntoa(sa.sin_addr),port);
+      close(sock);
       return -1;
     }
+
+    // so we can tell how many datagrams the kernel drops
+    int enable_ovfl = 1;
+    setsockopt(sock, SOL_SOCKET, SO_RXQ_OVFL, &enable_ovfl, sizeof(enable_ovfl));
+    if (o.bufsize > 0) setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &o.bufsize, sizeof(o.bufsize));
   }
   else
   {
@@ -327,25 +3172,238 @@ int pueo_handle_init_udp(pueo_handle_t * h, int port, const char *hostname, cons
     // we need to be allowed to broadcas
      int enable_broadcast = 1;
      setsockopt(sock, SOL_SOCKET, SO_BROADCAST, &enable_broadcast, sizeof(enable_broadcast));
-     int sndbufsize = 999999;
+     int sndbufsize = o.bufsize > 0 ? o.bufsize : 999999;
      setsockopt(sock, SOL_SOCKET, SO_SNDBUF, &sndbufsize, sizeof(sndbufsize));
 
     if (connect(sock,  (struct sockaddr*) &sa, sizeof(sa)))
     {
 
       fprintf(stderr,"pueo_handle_udp: couldn't connect to %s:%d\n", inet_ntoa(sa.sin_addr),port);
+      close(sock);
       return -1;
     }
 
   }
   struct udp_aux * aux = calloc(1,sizeof(struct udp_aux));
-  h->aux = (void*) aux;
   aux->socket = sock;
-  asprintf(&h->description, "udp-%s://%s:%d",mode, hostname, port);
+  aux->batch = o.batch;
+  aux->max_delay_ms = o.max_delay_ms;
+  aux->coalesce = o.coalesce;
+  aux->at_packet_start = true;
+  if (am_reading)
+  {
+    aux->nreasm = o.reassembly_slots;
+    aux->reasm = calloc(aux->nreasm, sizeof(struct udp_reasm));
+    aux->reasm_timeout_ms = o.reassembly_timeout_ms;
+  }
+  aux->pool = malloc((size_t) o.batch * UDP_BUF_SIZE);
+  aux->msgs = calloc(o.batch, sizeof(struct mmsghdr));
+  aux->iovs = calloc(o.batch, sizeof(struct iovec));
+  aux->cmsgs = calloc(o.batch, UDP_CMSG_SIZE);
+  if (!aux->pool || !aux->msgs || !aux->iovs || !aux->cmsgs || (am_reading && !aux->reasm))
+  {
+    fprintf(stderr,"pueo_handle_udp: couldn't allocate %d datagram buffers\n", o.batch);
+    udp_free(aux);
+    return -1;
+  }
+  for (int i = 0; i < o.batch; i++)
+  {
+    aux->iovs[i].iov_base = UDP_DGRAM(aux,i);
+    aux->msgs[i].msg_hdr.msg_iov = &aux->iovs[i];
+    aux->msgs[i].msg_hdr.msg_iovlen = 1;
+    if (am_reading) aux->msgs[i].msg_hdr.msg_control = aux->cmsgs + i * UDP_CMSG_SIZE;
+  }
+  aux->cur = -1; // nothing received yet
+
+  if (am_writing && (o.batch > 1 || o.coalesce))
+  {
+    // timed waits are against the monotonic clock, like the timestamps
+    pthread_condattr_t ca;
+    pthread_condattr_init(&ca);
+    pthread_condattr_setclock(&ca, CLOCK_MONOTONIC);
+    pthread_cond_init(&aux->cv, &ca);
+    pthread_condattr_destroy(&ca);
+    pthread_mutex_init(&aux->mu, NULL);
+    if (pthread_create(&aux->flusher, NULL, udp_flusher, aux))
+    {
+      fprintf(stderr,"pueo_handle_udp: couldn't start the flusher thread\n");
+      pthread_mutex_destroy(&aux->mu);
+      pthread_cond_destroy(&aux->cv);
+      udp_free(aux);
+      return -1;
+    }
+    aux->timed = true;
+  }
+
+  h->aux = (void*) aux;
+  if (o.batch > 1 || o.coalesce) asprintf(&h->description, "udp-%s://%s:%d (batch %d, coalesce %d)",mode, hostname, port, o.batch, o.coalesce);
+  else asprintf(&h->description, "udp-%s://%s:%d",mode, hostname, port);
   h->close = socket_close;
   h->write_bytes = am_writing ? socket_writebytes : NULL;
+  h->write_bytesv = am_writing ? socket_writebytesv : NULL;
   h->read_bytes = am_reading ? socket_readbytes: NULL;
+  h->view_bytes = am_reading ? socket_viewbytes: NULL;
   h->done_write_packet = am_writing ? socket_done : NULL;
+  h->begin_write_packet = am_writing ? socket_begin : NULL;
+  h->flush = am_writing ? socket_flush : NULL;
+  return 0;
+}
+
+
+// listens on sock and accepts one connection, waiting at most timeout_ms
+static int stream_accept(int sock, int timeout_ms)
+{
+  if (listen(sock, 1)) return -1;
+  struct pollfd pfd = { .fd = sock, .events = POLLIN };
+  int r;
+  do
+  {
+    r = poll(&pfd, 1, timeout_ms);
+  } while (r < 0 && errno == EINTR);
+  if (r <= 0) return -1;
+  return accept(sock, NULL, NULL);
+}
+
+// sets up a connected stream socket as a handle
+static int stream_init(pueo_handle_t *h, int fd, bool tcp, bool am_writing, const pueo_stream_opts_t * o)
+{
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+  int bufsize = o->bufsize > 0 ? o->bufsize : 4 << 20;
+  setsockopt(fd, SOL_SOCKET, am_writing ? SO_SNDBUF : SO_RCVBUF, &bufsize, sizeof(bufsize));
+  if (tcp && am_writing)
+  {
+    int nodelay = !o->cork;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+    if (o->cork)
+    {
+      int on = 1;
+      setsockopt(fd, IPPROTO_TCP, TCP_CORK, &on, sizeof(on));
+    }
+  }
+
+  struct stream_aux * aux = calloc(1, sizeof(struct stream_aux));
+  aux->fd = fd;
+  aux->cork = tcp && am_writing && o->cork;
+  aux->timeout_ms = o->timeout_ms > 0 ? o->timeout_ms : -1;
+  h->aux = aux;
+  h->close = stream_close;
+  h->read_bytes = am_writing ? NULL : stream_readbytes;
+  h->write_bytes = am_writing ? stream_writebytes : NULL;
+  h->write_bytesv = am_writing ? stream_writebytesv : NULL;
+  h->flush = am_writing ? stream_flush : NULL;
+  return 0;
+}
+
+static bool stream_mode(const char * mode, const char * who, bool * am_writing, bool * am_listening)
+{
+  bool am_reading = !!strchr(mode,'r');
+  *am_writing = !!strchr(mode,'w');
+  *am_listening = !!strchr(mode,'l');
+  if (!(am_reading ^ *am_writing))
+  {
+    fprintf(stderr,"%s: mode must have one of r and w in it\n", who);
+    return false;
+  }
+  return true;
+}
+
+int pueo_handle_init_tcp(pueo_handle_t *h, const char * host, int port, const char * mode, const pueo_stream_opts_t * opts)
+{
+  hinit(h);
+  bool am_writing, am_listening;
+  if (!stream_mode(mode, "pueo_handle_init_tcp", &am_writing, &am_listening)) return -1;
+  pueo_stream_opts_t o = {0};
+  if (opts) o = *opts;
+
+  char portstr[16];
+  snprintf(portstr, sizeof(portstr), "%d", port);
+  struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM, .ai_flags = am_listening ? AI_PASSIVE : 0 };
+  struct addrinfo * result = 0;
+  if (getaddrinfo(host && *host ? host : NULL, portstr, &hints, &result))
+  {
+    fprintf(stderr,"pueo_handle_init_tcp: problem with getaddrinfo(%s)\n", host);
+    return -1;
+  }
+
+  int fd = -1;
+  for (struct addrinfo * ai = result; ai && fd < 0; ai = ai->ai_next)
+  {
+    int sock = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+    if (sock < 0) continue;
+    if (am_listening)
+    {
+      int reuse = 1;
+      setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+      if (!bind(sock, ai->ai_addr, ai->ai_addrlen)) fd = stream_accept(sock, o.timeout_ms > 0 ? o.timeout_ms : -1);
+    }
+    else if (!connect(sock, ai->ai_addr, ai->ai_addrlen))
+    {
+      fd = sock;
+      continue;
+    }
+    close(sock);
+  }
+  freeaddrinfo(result);
+
+  if (fd < 0)
+  {
+    fprintf(stderr,"pueo_handle_init_tcp: couldn't %s %s:%d (%s)\n", am_listening ? "accept a connection on" : "connect to", host ? host : "*", port, strerror(errno));
+    return -1;
+  }
+
+  stream_init(h, fd, true, am_writing, &o);
+  asprintf(&h->description, "tcp-%s://%s:%d", mode, host ? host : "*", port);
+  return 0;
+}
+
+int pueo_handle_init_unix(pueo_handle_t *h, const char * path, const char * mode, const pueo_stream_opts_t * opts)
+{
+  hinit(h);
+  bool am_writing, am_listening;
+  if (!stream_mode(mode, "pueo_handle_init_unix", &am_writing, &am_listening)) return -1;
+  pueo_stream_opts_t o = {0};
+  if (opts) o = *opts;
+
+  struct sockaddr_un sa = { .sun_family = AF_UNIX };
+  if (strlen(path) >= sizeof(sa.sun_path))
+  {
+    fprintf(stderr,"pueo_handle_init_unix: path %s is too long\n", path);
+    return -1;
+  }
+  strcpy(sa.sun_path, path);
+
+  int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (sock < 0) return -1;
+
+  int fd = -1;
+  if (am_listening)
+  {
+    // clean up after a previous listener, but only if it's a socket
+    struct stat st;
+    if (!stat(path, &st) && S_ISSOCK(st.st_mode)) unlink(path);
+    if (!bind(sock, (struct sockaddr*) &sa, sizeof(sa)))
+    {
+      fd = stream_accept(sock, o.timeout_ms > 0 ? o.timeout_ms : -1);
+      if (fd < 0) unlink(path);
+    }
+    close(sock);
+  }
+  else
+  {
+    if (!connect(sock, (struct sockaddr*) &sa, sizeof(sa))) fd = sock;
+    else close(sock);
+  }
+
+  if (fd < 0)
+  {
+    fprintf(stderr,"pueo_handle_init_unix: couldn't %s %s (%s)\n", am_listening ? "accept a connection on" : "connect to", path, strerror(errno));
+    return -1;
+  }
+
+  stream_init(h, fd, false, am_writing, &o);
+  if (am_listening) ((struct stream_aux*) h->aux)->unlink_path = strdup(path);
+  asprintf(&h->description, "unix-%s://%s", mode, path);
   return 0;
 }
 
@@ -360,6 +3418,89 @@ int pueo_handle_init(pueo_handle_t * h, const char * uri, const char * mode)
   {
     return pueo_handle_init_file(h, remainder, mode);
   }
+  else if (check_uri_prefix(uri,"uring://", &remainder))
+  {
+    return pueo_handle_init_uring(h, remainder, mode, NULL);
+  }
+  else if (check_uri_prefix(uri,"tcp://", &remainder))
+  {
+    // host:port, host may be empty (or [ipv6]) for listening
+    const char * colon = strrchr(remainder,':');
+    if (!colon) return -1;
+    char host[256];
+    size_t hostlen = colon - remainder;
+    if (hostlen && remainder[0] == '[' && remainder[hostlen-1] == ']')
+    {
+      remainder++;
+      hostlen -= 2;
+    }
+    if (hostlen >= sizeof(host)) return -1;
+    memcpy(host, remainder, hostlen);
+    host[hostlen] = 0;
+    return pueo_handle_init_tcp(h, host, atoi(colon+1), mode, NULL);
+  }
+  else if (check_uri_prefix(uri,"unix://", &remainder))
+  {
+    return pueo_handle_init_unix(h, remainder, mode, NULL);
+  }
+  else if (check_uri_prefix(uri,"rotate://", &remainder))
+  {
+    if (!strchr(mode,'w'))
+    {
+      fprintf(stderr,"pueo_handle_init: rotate:// handles are for writing\n");
+      return -1;
+    }
+
+    // prefix?key=value&key=value...
+    char * prefix = strdup(remainder);
+    pueo_rotate_opts_t opts = {0};
+    char * query = strchr(prefix,'?');
+    if (query)
+    {
+      *query++ = 0;
+      char * save = NULL;
+      for (char * kv = strtok_r(query, "&", &save); kv; kv = strtok_r(NULL, "&", &save))
+      {
+        char * val = strchr(kv,'=');
+        if (!val) continue;
+        *val++ = 0;
+        if (!strcmp(kv,"max_bytes")) opts.max_bytes = strtoull(val, NULL, 0);
+        else if (!strcmp(kv,"max_packets")) opts.max_packets = strtoul(val, NULL, 0);
+        else if (!strcmp(kv,"max_secs")) opts.max_secs = atoi(val);
+        else if (!strcmp(kv,"compress")) opts.compress = val;
+        else fprintf(stderr,"pueo_handle_init: ignoring unknown rotate:// option %s\n", kv);
+      }
+    }
+    int r = pueo_handle_init_rotate(h, prefix, &opts);
+    free(prefix);
+    return r;
+  }
+  else if (check_uri_prefix(uri,"mem://", &remainder))
+  {
+    if (!strchr(mode,'w'))
+    {
+      fprintf(stderr,"pueo_handle_init: mem:// handles are for writing (use pueo_handle_init_mem_span to read from memory)\n");
+      return -1;
+    }
+    return pueo_handle_init_mem(h, strtoul(remainder, NULL, 0));
+  }
+  else if (check_uri_prefix(uri,"shm://", &remainder))
+  {
+    return pueo_handle_init_shm(h, remainder, mode, NULL);
+  }
+  else if (check_uri_prefix(uri,"bgz://", &remainder))
+  {
+    return pueo_handle_init_bgz(h, remainder, mode, NULL);
+  }
+  else if (check_uri_prefix(uri,"mmap://", &remainder))
+  {
+    if (strchr(mode,'w') || strchr(mode,'a'))
+    {
+      fprintf(stderr,"pueo_handle_init: mmap:// handles are read-only\n");
+      return -1;
+    }
+    return pueo_handle_init_mmap(h, remainder);
+  }
   else if (check_uri_prefix(uri,"udp:", &remainder))
   {
     //now look for a port and hostname
@@ -398,13 +3539,69 @@ int pueo_size_inmem(pueo_datatype_t type)
     case PACKET_TYPE:\
       return sizeof(pueo_##TYPENAME##_t);
 
-  switch (type)
+  switch (type)
+  {
+    PUEO_IO_DISPATCH_TABLE(X_INMEM_SIZE)
+
+    default:
+      return -1;
+  }
+}
+
+#define X_PUEO_TYPE_MASK(PACKET_TYPE, STRUCT_NAME) PUEO_TYPE_INDEX_##STRUCT_NAME,
+enum { PUEO_IO_DISPATCH_TABLE(X_PUEO_TYPE_MASK) PUEO_NTYPES };
+_Static_assert(PUEO_NTYPES <= 64, "type masks are 64 bits");
+
+#define X_PUEO_TYPE_MASK_CASE(PACKET_TYPE, STRUCT_NAME) case PACKET_TYPE: return UINT64_C(1) << PUEO_TYPE_INDEX_##STRUCT_NAME;
+uint64_t pueo_type_mask(pueo_datatype_t type)
+{
+  switch (type)
+  {
+    PUEO_IO_DISPATCH_TABLE(X_PUEO_TYPE_MASK_CASE)
+    default:
+      return 0;
+  }
+}
+
+void pueo_handle_set_type_filter(pueo_handle_t *h, uint64_t mask)
+{
+  h->type_filter = mask;
+}
+
+void pueo_handle_set_pack_samples(pueo_handle_t *h, bool pack)
+{
+  if (pack) h->flags |= PUEO_HANDLE_PACK_SAMPLES;
+  else h->flags &= ~PUEO_HANDLE_PACK_SAMPLES;
+}
+
+// get rid of nbytes of payload, preferably without reading it
+static int skip_payload(pueo_handle_t *h, size_t nbytes)
+{
+  if (h->skip_bytes)
   {
-    PUEO_IO_DISPATCH_TABLE(X_INMEM_SIZE)
+    int r = h->skip_bytes(nbytes, h);
+    if (r >= 0) return r;
+  }
 
-    default:
-      return -1;
+  size_t nskipped = 0;
+  uint8_t scratch[4096];
+  while (nskipped < nbytes)
+  {
+    size_t n = nbytes - nskipped;
+    int r;
+    if (h->view_bytes)
+    {
+      const void * ignored;
+      r = h->view_bytes(n, &ignored, h);
+    }
+    else
+    {
+      r = h->read_bytes(n < sizeof(scratch) ? n : sizeof(scratch), scratch, h);
+    }
+    if (r <= 0) break;
+    nskipped += r;
   }
+  return nskipped;
 }
 
 static int maybe_read_header(pueo_handle_t *h)
@@ -413,12 +3610,45 @@ static int maybe_read_header(pueo_handle_t *h)
   {
     return 0 ;
   }
-  int nread =  h->read_bytes(sizeof(pueo_packet_head_t), &h->last_read_header, h);
-  if (!nread) return EOF;
-  assert (h->last_read_header.f1 == 0xf1);
-  h->bytes_read +=nread;
-  h->flags |= PUEO_HANDLE_ALREADY_READ_HEAD;
-  return nread;
+
+  while (true)
+  {
+    int nread =  h->read_bytes(sizeof(pueo_packet_head_t), &h->last_read_header, h);
+    if (nread <= 0) return EOF;
+    // lost sync (or a truncated header), pueo_handle_init_resync can recover from this
+    if (nread < (int) sizeof(pueo_packet_head_t) || h->last_read_header.f1 != 0xf1) return -EIO;
+    h->bytes_read +=nread;
+
+    // filtered out, move on to the next one
+    if (h->type_filter && !(h->type_filter & pueo_type_mask(h->last_read_header.type)))
+    {
+      int nskip = skip_payload(h, h->last_read_header.num_bytes);
+      if (nskip != (int) h->last_read_header.num_bytes) return EOF;
+      h->bytes_read += nskip;
+      continue;
+    }
+
+    h->flags |= PUEO_HANDLE_ALREADY_READ_HEAD;
+    return nread;
+  }
+}
+
+const pueo_packet_head_t * pueo_ll_peek(pueo_handle_t *h)
+{
+  return maybe_read_header(h) >= 0 ? &h->last_read_header : NULL;
+}
+
+int pueo_ll_skip(pueo_handle_t *h)
+{
+  int r = maybe_read_header(h);
+  if (r < 0) return r;
+
+  int nskip = skip_payload(h, h->last_read_header.num_bytes);
+  if (nskip != (int) h->last_read_header.num_bytes) return -EIO;
+  h->bytes_read += nskip;
+  h->required_read_size = 0;
+  h->flags &= ~PUEO_HANDLE_ALREADY_READ_HEAD;
+  return nskip;
 }
 
 int pueo_ll_read(pueo_handle_t *h, pueo_packet_t *dest)
@@ -430,12 +3660,9 @@ int pueo_ll_read(pueo_handle_t *h, pueo_packet_t *dest)
   // and set required_read_size
   if (!h->required_read_size)
   {
+    // (0 means the header was already read, e.g. by pueo_ll_peek)
     int r = maybe_read_header(h);
-    if (r == EOF) return EOF;
-    else if ( r< (int) sizeof(pueo_packet_head_t))
-    { //uhoh
-      return -EIO;
-    }
+    if (r < 0) return r;
 
 //x macro for size
 #define X_PUEO_SWITCH_READ_SIZE(PACKET_TYPE, TYPENAME)\
@@ -486,11 +3713,15 @@ int pueo_packet_init(pueo_packet_t * p, int capacity)
 
 int pueo_ll_read_realloc(pueo_handle_t *h, pueo_packet_t **dest)
 {
-  // Nothing has been allocated. Let's allocate with a capacity of 512 since why not
-  if (!*dest)
+  // look at the header first, so we can allocate enough (at least 512, since why not) before reading
+  const pueo_packet_head_t * hd = pueo_ll_peek(h);
+  int need = hd ? pueo_size_inmem(hd->type) : -1;
+  if (!*dest || need > (*dest)->payload_capacity)
   {
-    *dest = malloc(sizeof(pueo_packet_t) + 512);
-    pueo_packet_init(*dest, 512);
+    int capacity = need > 512 ? need : 512;
+    free(*dest);
+    *dest = malloc(sizeof(pueo_packet_t) + capacity);
+    pueo_packet_init(*dest, capacity);
   }
 
   int nread = pueo_ll_read(h, *dest);
@@ -506,6 +3737,271 @@ int pueo_ll_read_realloc(pueo_handle_t *h, pueo_packet_t **dest)
   return nread;
 }
 
+// packets in an arena start 8-byte aligned, like they would from malloc
+#define ARENA_ALIGN(x) (((x) + 7) & ~((size_t) 7))
+
+static int arena_reserve(pueo_packet_arena_t * a, size_t nbytes, int npackets)
+{
+  if (a->used + nbytes > a->cap)
+  {
+    size_t cap = a->cap ? 2 * a->cap : 1 << 20;
+    while (cap < a->used + nbytes) cap *= 2;
+    uint8_t * mem = realloc(a->mem, cap);
+    if (!mem) return -ENOMEM;
+    a->mem = mem;
+    a->cap = cap;
+  }
+  if (npackets > a->offsets_cap)
+  {
+    int n = a->offsets_cap ? 2 * a->offsets_cap : 256;
+    while (n < npackets) n *= 2;
+    size_t * offsets = realloc(a->offsets, n * sizeof(*offsets));
+    if (!offsets) return -ENOMEM;
+    a->offsets = offsets;
+    a->offsets_cap = n;
+  }
+  return 0;
+}
+
+int pueo_ll_read_batch(pueo_handle_t *h, pueo_packet_arena_t * arena, int max_packets, size_t max_bytes)
+{
+  arena->npackets = 0;
+  arena->used = 0;
+
+  // whatever stopped the last batch early
+  if (arena->status)
+  {
+    int r = arena->status;
+    arena->status = 0;
+    return r;
+  }
+
+  int r = 0;
+  while (!max_packets || arena->npackets < max_packets)
+  {
+    r = maybe_read_header(h);
+    if (r < 0) break;
+
+    int need = pueo_size_inmem(h->last_read_header.type);
+    if (need < 0)
+    {
+      // not something we know how to read
+      r = pueo_ll_skip(h);
+      if (r < 0) break;
+      continue;
+    }
+
+    size_t size = ARENA_ALIGN(sizeof(pueo_packet_t) + need);
+    if (arena->npackets && max_bytes && arena->used + size > max_bytes) break; // leave it for next time
+
+    r = arena_reserve(arena, size, arena->npackets + 1);
+    if (r < 0) break;
+
+    pueo_packet_t * p = (pueo_packet_t*) (arena->mem + arena->used);
+    pueo_packet_init(p, need);
+    r = pueo_ll_read(h, p);
+    if (r < 0) break;
+
+    arena->offsets[arena->npackets++] = arena->used;
+    arena->used += size;
+  }
+
+  if (!arena->npackets) return r < 0 ? r : 0;
+  if (r < 0 && r != EOF) arena->status = r;
+  return arena->npackets;
+}
+
+pueo_packet_t * pueo_packet_arena_get(const pueo_packet_arena_t * arena, int i)
+{
+  return (pueo_packet_t*) (arena->mem + arena->offsets[i]);
+}
+
+void pueo_packet_arena_free(pueo_packet_arena_t * arena)
+{
+  free(arena->mem);
+  free(arena->offsets);
+  memset(arena, 0, sizeof(*arena));
+}
+
+int pueo_ll_view(pueo_handle_t *h, pueo_packet_view_t *v)
+{
+  if (!v) return -1;
+  if (!h->view_bytes) return -ENOTSUP;
+
+  int r = maybe_read_header(h);
+  if (r < 0) return r;
+
+  const void * payload = NULL;
+  int nview = h->view_bytes(h->last_read_header.num_bytes, &payload, h);
+  if (nview != (int) h->last_read_header.num_bytes)
+  {
+    return -EIO;
+  }
+  h->bytes_read += nview;
+  h->flags &= ~PUEO_HANDLE_ALREADY_READ_HEAD;
+  v->head = &h->last_read_header;
+  v->payload = payload;
+  return nview;
+}
+
+// walk a waveform in place, making sure it fits
+static const pueo_waveform_t * view_waveform(const uint8_t ** cursor, const uint8_t * end)
+{
+  const size_t hdrsize = offsetof(pueo_waveform_t, data);
+  if (*cursor + hdrsize > end) return NULL;
+  const pueo_waveform_t * wf = (const pueo_waveform_t*) *cursor;
+  size_t size = hdrsize + wf->length * sizeof(*wf->data);
+  if (wf->length > PUEO_MAX_BUFFER_LENGTH || *cursor + size > end)
+  {
+    fprintf(stderr,"***WARNING*** wf length (%hu) seems malformed\n", wf->length);
+    return NULL;
+  }
+  *cursor += size;
+  return wf;
+}
+
+int pueo_view_full_waveforms(pueo_handle_t *h, pueo_full_waveforms_view_t * v)
+{
+  if (!v) return 0;
+  if (!h->view_bytes) return -ENOTSUP;
+  int r = maybe_read_header(h);
+  if (r < 0) return r;
+  if (h->last_read_header.type != PUEO_FULL_WAVEFORMS) return 0;
+  if (h->last_read_header.version == PUEO_FULL_WAVEFORMS_PACKED_VER) return -ENOTSUP;
+
+  pueo_packet_view_t pv;
+  int nview = pueo_ll_view(h, &pv);
+  if (nview < 0) return nview;
+
+  size_t offs = pv.head->version == 0 ? offsetof(pueo_full_waveforms_t, readout_time) : offsetof(pueo_full_waveforms_t,wfs);
+  if ((size_t) nview < offs) return -EIO;
+  const uint8_t * cursor = pv.payload + offs;
+  const uint8_t * end = pv.payload + nview;
+  for (int i = 0; i < PUEO_NCHAN; i++)
+  {
+    v->wfs[i] = view_waveform(&cursor, end);
+    if (!v->wfs[i]) return -EIO;
+  }
+  v->head = pv.head;
+  v->evt = (const pueo_full_waveforms_t*) pv.payload;
+  return nview;
+}
+
+int pueo_view_single_waveform(pueo_handle_t *h, pueo_single_waveform_view_t * v)
+{
+  if (!v) return 0;
+  if (!h->view_bytes) return -ENOTSUP;
+  int r = maybe_read_header(h);
+  if (r < 0) return r;
+  if (h->last_read_header.type != PUEO_SINGLE_WAVEFORM) return 0;
+  if (h->last_read_header.version == PUEO_SINGLE_WAVEFORM_PACKED_VER) return -ENOTSUP;
+
+  pueo_packet_view_t pv;
+  int nview = pueo_ll_view(h, &pv);
+  if (nview < 0) return nview;
+
+  int ver = pv.head->version;
+  size_t offs = ver == 0 ? offsetof(pueo_single_waveform_t,  readout_time) :
+                ver == 1 ? offsetof(pueo_single_waveform_t, prio) :  offsetof(pueo_single_waveform_t, wf);
+  if ((size_t) nview < offs) return -EIO;
+  const uint8_t * cursor = pv.payload + offs;
+  v->wf = view_waveform(&cursor, pv.payload + nview);
+  if (!v->wf) return -EIO;
+  v->head = pv.head;
+  v->evt = (const pueo_single_waveform_t*) pv.payload;
+  return nview;
+}
+
+int pueo_read_full_waveforms_partial(pueo_handle_t *h, pueo_full_waveforms_t * p, const pueo_channel_mask_t * mask)
+{
+  if (!p) return 0;
+  int r = maybe_read_header(h);
+  if (r < 0) return r;
+  if (h->last_read_header.type != PUEO_FULL_WAVEFORMS) return 0;
+
+  int ver = h->last_read_header.version;
+  size_t num_bytes = h->last_read_header.num_bytes;
+  size_t offs = ver == 0 ? offsetof(pueo_full_waveforms_t, readout_time) : offsetof(pueo_full_waveforms_t,wfs);
+  if (num_bytes < offs) return -EIO;
+  int nrd = h->read_bytes(offs, p, h);
+  if (nrd != (int) offs) return -EIO;
+  if (ver == 0) memset(&p->readout_time, 0, sizeof(p->readout_time));
+  size_t nread = nrd;
+
+  // the last channel we need to look at, after which the rest can be skipped at once
+  int last = -1;
+  for (int i = 0; mask && i < PUEO_NCHAN; i++)
+  {
+    if (PUEO_CHANNEL_MASK_TEST(mask, i)) last = i;
+  }
+
+  // packed waveforms have their bit width after the usual header
+  bool packed = ver == PUEO_FULL_WAVEFORMS_PACKED_VER;
+  const size_t hdrsize = packed ? PUEO_PACKED_WF_HEAD_SIZE : offsetof(pueo_waveform_t, data);
+  uint8_t buf[PUEO_PACKED_WF_MAX_SIZE];
+  for (int i = 0; i < PUEO_NCHAN; i++)
+  {
+    pueo_waveform_t * wf = &p->wfs[i];
+    if (i > last)
+    {
+      wf->length = 0;
+      continue;
+    }
+
+    nrd = h->read_bytes(hdrsize, packed ? (void*) buf : (void*) wf, h);
+    if (nrd != (int) hdrsize) return -EIO;
+    nread += nrd;
+    if (packed) memcpy(wf, buf, offsetof(pueo_waveform_t, data));
+    int width = packed ? buf[offsetof(pueo_waveform_t, data)] : 16;
+    size_t nsamp_bytes = (wf->length * width + 7) / 8;
+    if (wf->length > PUEO_MAX_BUFFER_LENGTH || width > 16 || nread + nsamp_bytes > num_bytes)
+    {
+      fprintf(stderr,"***WARNING*** wf length (%hu) seems malformed\n", wf->length);
+      return -EIO;
+    }
+
+    if (mask && PUEO_CHANNEL_MASK_TEST(mask, i) && packed)
+    {
+      nrd = h->read_bytes(nsamp_bytes, buf + hdrsize, h);
+      if (nrd == (int) nsamp_bytes && pueo_waveform_unpack(buf, hdrsize + nsamp_bytes, wf) < 0) return -EIO;
+    }
+    else if (mask && PUEO_CHANNEL_MASK_TEST(mask, i))
+    {
+      nrd = h->read_bytes(nsamp_bytes, wf->data, h);
+    }
+    else
+    {
+      nrd = skip_payload(h, nsamp_bytes);
+      wf->length = 0;
+    }
+    if (nrd != (int) nsamp_bytes) return -EIO;
+    nread += nrd;
+  }
+
+  nrd = skip_payload(h, num_bytes - nread);
+  if (nrd != (int) (num_bytes - nread)) return -EIO;
+  nread += nrd;
+
+  h->bytes_read += nread;
+  h->flags &= ~PUEO_HANDLE_ALREADY_READ_HEAD;
+  return nread;
+}
+
+// the waveform types are written piecewise, so their payloads aren't just a struct
+static bool payload_is_struct(pueo_datatype_t type)
+{
+  return type != PUEO_FULL_WAVEFORMS && type != PUEO_SINGLE_WAVEFORM && type != PUEO_ENCODED_WAVEFORM;
+}
+
+#define X_PUEO_VIEW_AS_IMPL(PACKET_TYPE, STRUCT_NAME) \
+const pueo_##STRUCT_NAME##_t* pueo_packet_view_as_##STRUCT_NAME(const pueo_packet_view_t * v)\
+{  \
+  return (v->head && v->head->type == PACKET_TYPE && v->head->version == PACKET_TYPE##_VER && payload_is_struct(PACKET_TYPE))\
+     ? (const pueo_##STRUCT_NAME##_t*) v->payload : NULL; \
+}
+
+PUEO_IO_DISPATCH_TABLE(X_PUEO_VIEW_AS_IMPL)
+
 
 /** define the packet_as_methods */
 
@@ -532,7 +4028,7 @@ int pueo_read_##STRUCT_NAME(pueo_handle_t *h, pueo_##STRUCT_NAME##_t * p)\
 {\
   if (!p) return 0;  \
   int nread = maybe_read_header(h); \
-  if (nread == EOF) return EOF; \
+  if (nread < 0) return nread; \
   if (h->last_read_header.type == PACKET_TYPE) {\
     h->flags &= ~PUEO_HANDLE_ALREADY_READ_HEAD; \
     int nrd = pueo_read_packet_##STRUCT_NAME(h, p, h->last_read_header.version); \
@@ -551,14 +4047,77 @@ PUEO_IO_DISPATCH_TABLE(X_PUEO_READ_IMPL)
  * Returns EOF if there's nothing left, but 0 if it's the wrong type!
  *
  **/
+/* For backends with write_bytesv, the serializers write into a stand-in handle (like the
+ * one pueo_serialize_X uses) whose write_bytes gathers the pieces up (pointing into the
+ * packet, nothing is copied) for submitting in one go. The handle being written to isn't touched.
+ * The most pieces a packet has is a full waveforms packet: the header, the start of
+ * the struct and each waveform. Anything with more is submitted in several goes.
+ */
+#define GATHER_MAX_IOV (PUEO_NCHAN + 8)
+
+struct write_gather
+{
+  pueo_handle_t * h;
+  struct iovec iov[GATHER_MAX_IOV];
+  int niov;
+  size_t len;
+  bool failed;
+};
+
+static int gather_submit(struct write_gather * g)
+{
+  if (!g->niov) return 0;
+  if (g->h->write_bytesv(g->iov, g->niov, g->h) != (int) g->len) g->failed = true;
+  g->niov = 0;
+  g->len = 0;
+  return g->failed ? -1 : 0;
+}
+
+static int gather_bytes(size_t nbytes, const void * bytes, pueo_handle_t * h)
+{
+  struct write_gather * g = (struct write_gather*) h->aux;
+  if (g->niov == GATHER_MAX_IOV && gather_submit(g)) return -1;
+  g->iov[g->niov].iov_base = (void*) bytes;
+  g->iov[g->niov].iov_len = nbytes;
+  g->niov++;
+  g->len += nbytes;
+  return nbytes;
+}
+
+// the handle to serialize a packet into: gh, gathering for h, if h can take an iovec, otherwise h itself
+static pueo_handle_t * gather_begin(pueo_handle_t * h, struct write_gather * g, pueo_handle_t * gh)
+{
+  if (!h->write_bytesv) return h;
+  g->h = h;
+  g->niov = 0;
+  g->len = 0;
+  g->failed = false;
+  *gh = (pueo_handle_t) { .aux = g, .write_bytes = gather_bytes, .flags = h->flags };
+  return gh;
+}
+
+
+// the version pueo_write_X writes, which is the latest unless the handle packs waveforms
+static int write_version(const pueo_handle_t *h, pueo_datatype_t type, int ver)
+{
+  if (!(h->flags & PUEO_HANDLE_PACK_SAMPLES)) return ver;
+  return type == PUEO_FULL_WAVEFORMS ? PUEO_FULL_WAVEFORMS_PACKED_VER :
+         type == PUEO_SINGLE_WAVEFORM ? PUEO_SINGLE_WAVEFORM_PACKED_VER : ver;
+}
+
 #define X_PUEO_WRITE_IMPL(PACKET_TYPE, STRUCT_NAME) \
 int pueo_write_##STRUCT_NAME(pueo_handle_t *h, const pueo_##STRUCT_NAME##_t * p)\
 {\
-  pueo_packet_head_t  hd = pueo_packet_header_for_##STRUCT_NAME(p, PACKET_TYPE##_VER); \
-  int ret = h->write_bytes(sizeof(hd), &hd, h); \
+  pueo_packet_head_t  hd = pueo_packet_header_for_##STRUCT_NAME(p, write_version(h, PACKET_TYPE, PACKET_TYPE##_VER)); \
+  if (h->begin_write_packet) h->begin_write_packet(h); \
+  struct write_gather g; \
+  pueo_handle_t gh; \
+  pueo_handle_t * wh = gather_begin(h, &g, &gh); \
+  int ret = wh->write_bytes(sizeof(hd), &hd, wh); \
+  int ret2 = ret == sizeof(hd) ? pueo_write_packet_##STRUCT_NAME(wh, p) : -1;\
+  if (wh != h && gather_submit(&g)) ret2 = -1; \
   if (ret != sizeof(hd)) return -1; \
   h->bytes_written += ret; \
-  int ret2= pueo_write_packet_##STRUCT_NAME(h, p);\
   if (ret2 < 0) return ret2;\
   int ret3 = 0; \
   if (h->done_write_packet) ret3 = h->done_write_packet(h); \
@@ -573,6 +4132,309 @@ int pueo_write_##STRUCT_NAME(pueo_handle_t *h, const pueo_##STRUCT_NAME##_t * p)
 PUEO_IO_DISPATCH_TABLE(X_PUEO_WRITE_IMPL)
 
 
+/* Compact events: the payload of a (version 1) PUEO_FULL_WAVEFORMS packet, kept as is, with a table saying where each waveform starts.
+ * Packed payloads are unpacked into that on the way in, and packed again on the way out if the handle wants them packed.
+ */
+_Static_assert(PUEO_FULL_WAVEFORMS_VER == 1 && PUEO_FULL_WAVEFORMS_PACKED_VER == 2, "compact events hold version 1 payloads");
+_Static_assert(offsetof(pueo_compact_event_t, data) % 8 == 0, "the event header should be aligned");
+
+#define COMPACT_HEAD_SIZE offsetof(pueo_full_waveforms_t, wfs)
+#define COMPACT_WF_HEAD_SIZE offsetof(pueo_waveform_t, data)
+
+// make room for a payload of nbytes
+static int compact_reserve(pueo_compact_event_t ** dest, size_t nbytes)
+{
+  size_t size = offsetof(pueo_compact_event_t, data) + nbytes;
+  if (size > UINT32_MAX) return -EMSGSIZE;
+  if (!*dest || (*dest)->capacity < size)
+  {
+    pueo_compact_event_t * ce = realloc(*dest, size);
+    if (!ce) return -ENOMEM;
+    ce->capacity = size;
+    *dest = ce;
+  }
+  (*dest)->size = size;
+  return 0;
+}
+
+// fill in the offset table, making sure every waveform fits
+static int compact_index(pueo_compact_event_t * ce)
+{
+  size_t len = ce->size - offsetof(pueo_compact_event_t, data);
+  size_t pos = COMPACT_HEAD_SIZE;
+  for (int i = 0; i < PUEO_NCHAN; i++)
+  {
+    if (pos + COMPACT_WF_HEAD_SIZE > len) return -EIO;
+    const pueo_waveform_t * wf = (const pueo_waveform_t*) (ce->data + pos);
+    size_t size = COMPACT_WF_HEAD_SIZE + wf->length * sizeof(*wf->data);
+    if (wf->length > PUEO_MAX_BUFFER_LENGTH || pos + size > len)
+    {
+      fprintf(stderr,"***WARNING*** wf length (%hu) seems malformed\n", wf->length);
+      return -EIO;
+    }
+    ce->offsets[i] = pos;
+    pos += size;
+  }
+  return pos == len ? 0 : -EIO;
+}
+
+int pueo_compact_event_from_full(pueo_compact_event_t ** dest, const pueo_full_waveforms_t * fw)
+{
+  size_t nbytes = COMPACT_HEAD_SIZE;
+  for (int i = 0; i < PUEO_NCHAN; i++)
+  {
+    if (fw->wfs[i].length > PUEO_MAX_BUFFER_LENGTH) return -EINVAL;
+    nbytes += COMPACT_WF_HEAD_SIZE + fw->wfs[i].length * sizeof(*fw->wfs[i].data);
+  }
+
+  int r = compact_reserve(dest, nbytes);
+  if (r) return r;
+  pueo_compact_event_t * ce = *dest;
+
+  memcpy(ce->data, fw, COMPACT_HEAD_SIZE);
+  size_t pos = COMPACT_HEAD_SIZE;
+  for (int i = 0; i < PUEO_NCHAN; i++)
+  {
+    size_t size = COMPACT_WF_HEAD_SIZE + fw->wfs[i].length * sizeof(*fw->wfs[i].data);
+    memcpy(ce->data + pos, &fw->wfs[i], size);
+    ce->offsets[i] = pos;
+    pos += size;
+  }
+  return ce->size;
+}
+
+int pueo_compact_event_to_full(const pueo_compact_event_t * ce, pueo_full_waveforms_t * fw)
+{
+  memcpy(fw, ce->data, COMPACT_HEAD_SIZE);
+  for (int i = 0; i < PUEO_NCHAN; i++)
+  {
+    const pueo_waveform_t * wf = pueo_compact_event_waveform(ce, i);
+    memcpy(&fw->wfs[i], wf, COMPACT_WF_HEAD_SIZE + wf->length * sizeof(*wf->data));
+  }
+  return 0;
+}
+
+const pueo_full_waveforms_t * pueo_compact_event_header(const pueo_compact_event_t * ce)
+{
+  return (const pueo_full_waveforms_t*) ce->data;
+}
+
+const pueo_waveform_t * pueo_compact_event_waveform(const pueo_compact_event_t * ce, int i)
+{
+  return (const pueo_waveform_t*) (ce->data + ce->offsets[i]);
+}
+
+// the packed payload is read whole, then unpacked into place
+static int read_compact_packed(pueo_handle_t *h, pueo_compact_event_t ** dest)
+{
+  size_t num_bytes = h->last_read_header.num_bytes;
+  if (num_bytes < COMPACT_HEAD_SIZE) return -EIO;
+  uint8_t * buf = pueo_pack_scratch(num_bytes);
+  if (!buf) return -ENOMEM;
+
+  size_t nread = 0;
+  while (nread < num_bytes)
+  {
+    int nrd = h->read_bytes(num_bytes - nread, buf + nread, h);
+    if (nrd <= 0) return -EIO;
+    nread += nrd;
+  }
+  h->bytes_read += nread;
+  h->flags &= ~PUEO_HANDLE_ALREADY_READ_HEAD;
+
+  uint16_t crc = pueo_crc16(buf, num_bytes);
+  if (crc != h->last_read_header.cksum) fprintf(stderr,"Checksum check failed (hd: %hx, reconstructed: %hx)!\n", h->last_read_header.cksum, crc);
+
+  // find out how big it is unpacked first
+  size_t nbytes = COMPACT_HEAD_SIZE;
+  size_t pos = COMPACT_HEAD_SIZE;
+  for (int i = 0; i < PUEO_NCHAN; i++)
+  {
+    pueo_waveform_t wf;
+    if (pos + PUEO_PACKED_WF_HEAD_SIZE > num_bytes) return -EIO;
+    memcpy(&wf, buf + pos, COMPACT_WF_HEAD_SIZE);
+    int width = buf[pos + COMPACT_WF_HEAD_SIZE];
+    if (wf.length > PUEO_MAX_BUFFER_LENGTH || width > 16) return -EIO;
+    pos += PUEO_PACKED_WF_HEAD_SIZE + (wf.length * width + 7) / 8;
+    nbytes += COMPACT_WF_HEAD_SIZE + wf.length * sizeof(*wf.data);
+  }
+  if (pos != num_bytes) return -EIO;
+
+  int r = compact_reserve(dest, nbytes);
+  if (r) return r;
+  pueo_compact_event_t * ce = *dest;
+  memcpy(ce->data, buf, COMPACT_HEAD_SIZE);
+  pos = COMPACT_HEAD_SIZE;
+  size_t out = COMPACT_HEAD_SIZE;
+  for (int i = 0; i < PUEO_NCHAN; i++)
+  {
+    pueo_waveform_t * wf = (pueo_waveform_t*) (ce->data + out);
+    int used = pueo_waveform_unpack(buf + pos, num_bytes - pos, wf);
+    if (used < 0) return -EIO;
+    ce->offsets[i] = out;
+    pos += used;
+    out += COMPACT_WF_HEAD_SIZE + wf->length * sizeof(*wf->data);
+  }
+  return nread;
+}
+
+int pueo_read_compact_event(pueo_handle_t *h, pueo_compact_event_t ** dest)
+{
+  if (!dest) return 0;
+  int r = maybe_read_header(h);
+  if (r < 0) return r;
+  if (h->last_read_header.type != PUEO_FULL_WAVEFORMS) return 0;
+
+  int ver = h->last_read_header.version;
+  if (ver == PUEO_FULL_WAVEFORMS_PACKED_VER) return read_compact_packed(h, dest);
+  size_t num_bytes = h->last_read_header.num_bytes;
+  size_t offs = ver == 0 ? offsetof(pueo_full_waveforms_t, readout_time) : COMPACT_HEAD_SIZE;
+  if (num_bytes < offs) return -EIO;
+
+  // version 0 didn't have readout_time, so it's a bit shorter
+  r = compact_reserve(dest, num_bytes - offs + COMPACT_HEAD_SIZE);
+  if (r) return r;
+  pueo_compact_event_t * ce = *dest;
+
+  // it's all one read, straight into place (aside from the missing readout_time)
+  size_t nread = 0;
+  while (nread < num_bytes)
+  {
+    uint8_t * where = nread < offs ? ce->data + nread : ce->data + COMPACT_HEAD_SIZE + (nread - offs);
+    size_t want = nread < offs ? offs - nread : num_bytes - nread;
+    int nrd = h->read_bytes(want, where, h);
+    if (nrd <= 0) return -EIO;
+    nread += nrd;
+  }
+  if (ver == 0) memset(ce->data + offs, 0, COMPACT_HEAD_SIZE - offs);
+  h->bytes_read += nread;
+  h->flags &= ~PUEO_HANDLE_ALREADY_READ_HEAD;
+
+  uint16_t crc = pueo_crc16_continue(pueo_crc16(ce->data, offs), ce->data + COMPACT_HEAD_SIZE, num_bytes - offs);
+  if (crc != h->last_read_header.cksum) fprintf(stderr,"Checksum check failed (hd: %hx, reconstructed: %hx)!\n", h->last_read_header.cksum, crc);
+
+  r = compact_index(ce);
+  if (r) return r;
+  return nread;
+}
+
+int pueo_write_compact_event(pueo_handle_t *h, const pueo_compact_event_t * ce)
+{
+  size_t len = ce->size - offsetof(pueo_compact_event_t, data);
+  const uint8_t * payload = ce->data;
+  int ver = write_version(h, PUEO_FULL_WAVEFORMS, PUEO_FULL_WAVEFORMS_VER);
+  if (ver == PUEO_FULL_WAVEFORMS_PACKED_VER)
+  {
+    uint8_t * buf = pueo_pack_scratch(COMPACT_HEAD_SIZE + PUEO_NCHAN * PUEO_PACKED_WF_MAX_SIZE);
+    if (!buf) return -ENOMEM;
+    memcpy(buf, ce->data, COMPACT_HEAD_SIZE);
+    len = COMPACT_HEAD_SIZE;
+    for (int i = 0; i < PUEO_NCHAN; i++) len += pueo_waveform_pack(pueo_compact_event_waveform(ce, i), buf + len);
+    payload = buf;
+  }
+
+  pueo_packet_head_t hd = { .type = PUEO_FULL_WAVEFORMS, .f1 = 0xf1, .version = ver,
+                            .num_bytes = len, .cksum = pueo_crc16(payload, len) };
+  if (h->begin_write_packet) h->begin_write_packet(h);
+  struct write_gather g;
+  pueo_handle_t gh;
+  pueo_handle_t * wh = gather_begin(h, &g, &gh);
+  int ret = wh->write_bytes(sizeof(hd), &hd, wh);
+  int ret2 = ret == sizeof(hd) ? wh->write_bytes(len, payload, wh) : -1;
+  if (wh != h && gather_submit(&g)) ret2 = -1;
+  if (ret != sizeof(hd)) return -1;
+  h->bytes_written += ret;
+  if (ret2 < 0) return ret2;
+  int ret3 = 0;
+  if (h->done_write_packet) ret3 = h->done_write_packet(h);
+  if (ret3) return ret3;
+  h->bytes_written += ret2;
+  h->packet_write_counter++;
+  return ret + ret2;
+}
+
+
+/* Serializing into a buffer: the serializers write into a handle whose write_bytes
+ * copies into the buffer (if there's room), adding to the checksum as it goes.
+ * With no buffer, it just counts.
+ */
+struct serialize_sink
+{
+  uint8_t * buf;
+  size_t cap;
+  size_t len;
+  uint16_t crc;
+};
+
+static int sink_writebytes(size_t nbytes, const void * bytes, pueo_handle_t *h)
+{
+  struct serialize_sink * sink = (struct serialize_sink*) h->aux;
+  if (sink->buf && sink->len + nbytes <= sink->cap)
+  {
+    memcpy(sink->buf + sink->len, bytes, nbytes);
+    sink->crc = pueo_crc16_continue(sink->crc, bytes, nbytes);
+  }
+  sink->len += nbytes;
+  return nbytes;
+}
+
+#define X_PUEO_SERIALIZE_IMPL(PACKET_TYPE, STRUCT_NAME) \
+int pueo_serialize_##STRUCT_NAME(const pueo_##STRUCT_NAME##_t * p, void * buf, size_t cap)\
+{\
+  pueo_packet_head_t hd = { .type = PACKET_TYPE, .f1 = 0xf1, .version = PACKET_TYPE##_VER }; \
+  struct serialize_sink sink = { .buf = buf, .cap = cap, .len = sizeof(hd), .crc = CRC16_START }; \
+  pueo_handle_t sh = { .aux = &sink, .write_bytes = sink_writebytes }; \
+  if (pueo_write_packet_##STRUCT_NAME(&sh, p) < 0) return -1; \
+  if (sink.len > cap) return -EMSGSIZE; \
+  hd.num_bytes = sink.len - sizeof(hd); \
+  hd.cksum = sink.crc; \
+  memcpy(buf, &hd, sizeof(hd)); \
+  return sink.len; \
+}\
+int pueo_serialized_size_##STRUCT_NAME(const pueo_##STRUCT_NAME##_t * p)\
+{\
+  struct serialize_sink sink = { .len = sizeof(pueo_packet_head_t) }; \
+  pueo_handle_t sh = { .aux = &sink, .write_bytes = sink_writebytes }; \
+  if (pueo_write_packet_##STRUCT_NAME(&sh, p) < 0) return -1; \
+  return sink.len; \
+}\
+
+
+PUEO_IO_DISPATCH_TABLE(X_PUEO_SERIALIZE_IMPL)
+
+#define X_PUEO_SWITCH_SERIALIZE(PACKET_TYPE, STRUCT_NAME)\
+  case PACKET_TYPE: \
+    return pueo_serialize_##STRUCT_NAME((const pueo_##STRUCT_NAME##_t*) p, buf, cap);
+
+int pueo_ll_serialize(pueo_datatype_t type, const void * p, void * buf, size_t cap)
+{
+  switch(type)
+  {
+    PUEO_IO_DISPATCH_TABLE(X_PUEO_SWITCH_SERIALIZE)
+    default:
+      return -1;
+  }
+}
+
+int pueo_write_serialized(pueo_handle_t *h, const void * buf, size_t len)
+{
+  const pueo_packet_head_t * hd = (const pueo_packet_head_t*) buf;
+  if (len < sizeof(*hd) || hd->f1 != 0xf1 || len != sizeof(*hd) + hd->num_bytes)
+  {
+    fprintf(stderr,"pueo_write_serialized: not a packet\n");
+    return -1;
+  }
+
+  if (h->begin_write_packet) h->begin_write_packet(h);
+  int ret = h->write_bytes(len, buf, h);
+  if (ret != (int) len) return -1;
+  if (h->done_write_packet && h->done_write_packet(h)) return -1;
+  h->bytes_written += ret;
+  h->packet_write_counter++;
+  return ret;
+}
+
+
 
 // x macro for dump dispatch
 #define X_PUEO_SWITCH_DUMP(PACKET_TYPE, TYPENAME)\
@@ -607,13 +4469,13 @@ int pueo_db_insert_packet(pueo_db_handle_t *h, const pueo_packet_t  *p)
 
 
 
-const char *  pueo_packet_name(const pueo_packet_t * p)
+const char *  pueo_type_name(pueo_datatype_t type)
 {
 
 #define X_PUEO_PACKET_NAME(PACKET_TYPE, TYPENAME)\
   case PACKET_TYPE: \
         return #TYPENAME;
-  switch (p->head.type)
+  switch (type)
   {
     PUEO_IO_DISPATCH_TABLE(X_PUEO_PACKET_NAME)
 
@@ -622,3 +4484,8 @@ const char *  pueo_packet_name(const pueo_packet_t * p)
   }
 }
 
+const char *  pueo_packet_name(const pueo_packet_t * p)
+{
+  return pueo_type_name(p->head.type);
+}
+
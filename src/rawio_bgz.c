@@ -0,0 +1,775 @@
+/** \file rawio_bgz.c
+ *
+ * Block-compressed gzip handles.
+ *
+ * The file is a series of independent gzip members, so anything that can read
+ * a concatenated gzip file (gzread, zcat) can still read it. Each data member
+ * ("block") holds a whole number of packets, and carries its compressed and
+ * uncompressed sizes in a gzip extra subfield:
+ *
+ *    'P' 'B' len=8  u32 member size, u32 uncompressed size
+ *
+ * At close, the list of block sizes is appended as empty members (subfield 'P'
+ * 'I', up to BGZ_INDEX_PER_MEMBER pairs of u32 each), followed by a fixed-size
+ * empty member pointing at them:
+ *
+ *    'P' 'E' len=16 u64 offset of the first index member, u64 number of blocks
+ *
+ * If the trailer is missing (e.g. the writer died), the reader walks the block
+ * headers instead.
+ *
+ * Since blocks are independent, a pool of threads compresses them when writing
+ * and decompresses ahead of the reader when reading, and the reader can seek.
+ *
+ * This file is part of libpueorawdata, developed by the PUEO collaboration.
+ * \copyright Copyright (C) 2021 PUEO Collaboration
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <https://www.gnu.org/licenses/>.
+
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include "pueo/rawio.h"
+#include "rawio_bgz.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <zlib.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define BGZ_HEADER_SIZE 24  // gzip header + XLEN + one 'P' 'B' subfield
+#define BGZ_FOOTER_SIZE 8   // crc32 + isize
+#define BGZ_EOF_SIZE 42     // 10 + 2 + 4 + 16 + empty deflate block (2) + 8
+#define BGZ_INDEX_PER_MEMBER 8000 // so that the subfield fits in XLEN
+
+enum bgz_job_state
+{
+  BGZ_IDLE,
+  BGZ_PENDING,
+  BGZ_BUSY,
+  BGZ_DONE
+};
+
+struct bgz_job
+{
+  int state;
+  uint64_t seq; // workers take the oldest pending job first
+  int err;
+
+  // writing: in is the uncompressed block, out the whole member
+  // reading: in is the whole member, out the uncompressed block
+  uint8_t * in;
+  size_t in_len;
+  size_t in_cap;
+  uint8_t * out;
+  size_t out_len;
+  size_t out_cap;
+
+  size_t block; // reading only
+  size_t pos;   // reading only, position in out
+
+  z_stream z;
+  bool z_init;
+};
+
+struct bgz_aux
+{
+  int fd;
+  bool writing;
+  int level;
+  size_t block_size;
+
+  int nthreads;
+  pthread_t * threads;
+  int njobs;
+  struct bgz_job * jobs;
+  int cur;    // writing: the job being filled. reading: the job being consumed
+  int oldest; // writing: the oldest job not written out yet
+  int nflight; // writing: jobs submitted but not written out yet
+
+  // everything below here (and the job states) is protected by mu
+  pthread_mutex_t mu;
+  pthread_cond_t cv_work;
+  pthread_cond_t cv_done;
+  uint64_t seq;
+  bool closing;
+
+  // block index
+  size_t nblocks;
+  size_t blocks_cap;
+  uint32_t * csizes;
+  uint32_t * usizes;
+  uint64_t * coffsets; // reading only
+  uint64_t * uoffsets; // reading only
+  uint64_t coffset; // writing: bytes written so far
+  size_t next_block; // reading: next block to hand to a job
+};
+
+
+static void put_le16(uint8_t * p, uint16_t v) { p[0] = v; p[1] = v >> 8; }
+static void put_le32(uint8_t * p, uint32_t v) { put_le16(p, v); put_le16(p+2, v >> 16); }
+static void put_le64(uint8_t * p, uint64_t v) { put_le32(p, v); put_le32(p+4, v >> 32); }
+static uint16_t get_le16(const uint8_t * p) { return p[0] | p[1] << 8; }
+static uint32_t get_le32(const uint8_t * p) { return get_le16(p) | (uint32_t) get_le16(p+2) << 16; }
+static uint64_t get_le64(const uint8_t * p) { return get_le32(p) | (uint64_t) get_le32(p+4) << 32; }
+
+// gzip header with FEXTRA, mtime 0, unknown OS, then XLEN and the subfield id/len
+static void bgz_header(uint8_t * p, uint16_t xlen, char si2, uint16_t slen)
+{
+  static const uint8_t magic[10] = { 0x1f, 0x8b, 8, 4, 0, 0, 0, 0, 0, 0xff };
+  memcpy(p, magic, sizeof(magic));
+  put_le16(p+10, xlen);
+  p[12] = 'P';
+  p[13] = si2;
+  put_le16(p+14, slen);
+}
+
+// returns the subfield id (B, I or E) if p looks like one of our members, otherwise 0
+static char bgz_member_type(const uint8_t * p, size_t n)
+{
+  if (n < 16 || p[0] != 0x1f || p[1] != 0x8b || p[2] != 8 || !(p[3] & 4)) return 0;
+  if (get_le16(p+10) < 4 || p[12] != 'P') return 0;
+  return p[13] == 'B' || p[13] == 'I' || p[13] == 'E' ? p[13] : 0;
+}
+
+// an empty member (i.e. an empty final deflate block) with a subfield of slen bytes
+static size_t bgz_empty_member(uint8_t * p, char si2, uint16_t slen)
+{
+  bgz_header(p, slen + 4, si2, slen);
+  uint8_t * tail = p + 16 + slen;
+  tail[0] = 3;
+  tail[1] = 0;
+  memset(tail+2, 0, BGZ_FOOTER_SIZE);
+  return 16 + slen + 2 + BGZ_FOOTER_SIZE;
+}
+
+static int pread_all(int fd, void * bytes, size_t nbytes, uint64_t offset)
+{
+  size_t nread = 0;
+  while (nread < nbytes)
+  {
+    ssize_t r = pread(fd, (uint8_t*) bytes + nread, nbytes - nread, offset + nread);
+    if (r < 0)
+    {
+      if (errno == EINTR) continue;
+      return -1;
+    }
+    if (r == 0) break;
+    nread += r;
+  }
+  return nread;
+}
+
+static int write_all(int fd, const void * bytes, size_t nbytes)
+{
+  size_t nwritten = 0;
+  while (nwritten < nbytes)
+  {
+    ssize_t r = write(fd, (const uint8_t*) bytes + nwritten, nbytes - nwritten);
+    if (r < 0)
+    {
+      if (errno == EINTR) continue;
+      return -1;
+    }
+    nwritten += r;
+  }
+  return nwritten;
+}
+
+static int grow(uint8_t ** buf, size_t * cap, size_t need)
+{
+  if (need <= *cap) return 0;
+  uint8_t * newbuf = realloc(*buf, need);
+  if (!newbuf) return -1;
+  *buf = newbuf;
+  *cap = need;
+  return 0;
+}
+
+static int bgz_compress(struct bgz_aux * aux, struct bgz_job * job)
+{
+  if (!job->z_init)
+  {
+    if (deflateInit2(&job->z, aux->level, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK) return -1;
+    job->z_init = true;
+  }
+  else deflateReset(&job->z);
+
+  size_t bound = BGZ_HEADER_SIZE + deflateBound(&job->z, job->in_len) + BGZ_FOOTER_SIZE;
+  if (grow(&job->out, &job->out_cap, bound)) return -1;
+
+  job->z.next_in = job->in;
+  job->z.avail_in = job->in_len;
+  job->z.next_out = job->out + BGZ_HEADER_SIZE;
+  job->z.avail_out = bound - BGZ_HEADER_SIZE - BGZ_FOOTER_SIZE;
+  if (deflate(&job->z, Z_FINISH) != Z_STREAM_END) return -1;
+
+  size_t member_size = BGZ_HEADER_SIZE + job->z.total_out + BGZ_FOOTER_SIZE;
+  bgz_header(job->out, 12, 'B', 8);
+  put_le32(job->out + 16, member_size);
+  put_le32(job->out + 20, job->in_len);
+  uint8_t * footer = job->out + BGZ_HEADER_SIZE + job->z.total_out;
+  put_le32(footer, crc32(0, job->in, job->in_len));
+  put_le32(footer + 4, job->in_len);
+  job->out_len = member_size;
+  return 0;
+}
+
+static int bgz_decompress(struct bgz_aux * aux, struct bgz_job * job)
+{
+  size_t csize = aux->csizes[job->block];
+  size_t usize = aux->usizes[job->block];
+  if (grow(&job->in, &job->in_cap, csize) || grow(&job->out, &job->out_cap, usize ? usize : 1)) return -1;
+  if (pread_all(aux->fd, job->in, csize, aux->coffsets[job->block]) != (int) csize) return -1;
+
+  if (bgz_member_type(job->in, csize) != 'B') return -1;
+  size_t data_start = 12 + get_le16(job->in + 10);
+  if (data_start + BGZ_FOOTER_SIZE > csize) return -1;
+
+  if (!job->z_init)
+  {
+    if (inflateInit2(&job->z, -MAX_WBITS) != Z_OK) return -1;
+    job->z_init = true;
+  }
+  else inflateReset(&job->z);
+
+  job->z.next_in = job->in + data_start;
+  job->z.avail_in = csize - data_start - BGZ_FOOTER_SIZE;
+  job->z.next_out = job->out;
+  job->z.avail_out = usize;
+  int r = inflate(&job->z, Z_FINISH);
+  if (r != Z_STREAM_END || job->z.total_out != usize) return -1;
+
+  const uint8_t * footer = job->in + csize - BGZ_FOOTER_SIZE;
+  if (get_le32(footer) != crc32(0, job->out, usize))
+  {
+    fprintf(stderr,"bgz: crc mismatch in block %zu\n", job->block);
+    return -1;
+  }
+  job->out_len = usize;
+  return 0;
+}
+
+static void * bgz_thread(void * arg)
+{
+  struct bgz_aux * aux = (struct bgz_aux*) arg;
+
+  pthread_mutex_lock(&aux->mu);
+  while (!aux->closing)
+  {
+    struct bgz_job * job = NULL;
+    for (int i = 0; i < aux->njobs; i++)
+    {
+      if (aux->jobs[i].state == BGZ_PENDING && (!job || aux->jobs[i].seq < job->seq)) job = &aux->jobs[i];
+    }
+
+    if (!job)
+    {
+      pthread_cond_wait(&aux->cv_work, &aux->mu);
+      continue;
+    }
+
+    job->state = BGZ_BUSY;
+    pthread_mutex_unlock(&aux->mu);
+    int err = aux->writing ? bgz_compress(aux, job) : bgz_decompress(aux, job);
+    pthread_mutex_lock(&aux->mu);
+    job->err = err;
+    job->state = BGZ_DONE;
+    pthread_cond_broadcast(&aux->cv_done);
+  }
+  pthread_mutex_unlock(&aux->mu);
+  return NULL;
+}
+
+static void bgz_submit(struct bgz_aux * aux, struct bgz_job * job)
+{
+  pthread_mutex_lock(&aux->mu);
+  job->state = BGZ_PENDING;
+  job->seq = aux->seq++;
+  job->err = 0;
+  pthread_cond_signal(&aux->cv_work);
+  pthread_mutex_unlock(&aux->mu);
+}
+
+static void bgz_wait(struct bgz_aux * aux, struct bgz_job * job)
+{
+  pthread_mutex_lock(&aux->mu);
+  while (job->state != BGZ_DONE) pthread_cond_wait(&aux->cv_done, &aux->mu);
+  pthread_mutex_unlock(&aux->mu);
+}
+
+static int bgz_add_block(struct bgz_aux * aux, uint32_t csize, uint32_t usize)
+{
+  if (aux->nblocks == aux->blocks_cap)
+  {
+    size_t newcap = aux->blocks_cap ? 2 * aux->blocks_cap : 1024;
+    uint32_t * c = realloc(aux->csizes, newcap * sizeof(uint32_t));
+    if (!c) return -1;
+    aux->csizes = c;
+    uint32_t * u = realloc(aux->usizes, newcap * sizeof(uint32_t));
+    if (!u) return -1;
+    aux->usizes = u;
+    aux->blocks_cap = newcap;
+  }
+  aux->csizes[aux->nblocks] = csize;
+  aux->usizes[aux->nblocks] = usize;
+  aux->nblocks++;
+  return 0;
+}
+
+// writes out the oldest job in flight, waiting for it to be compressed if need be
+static int bgz_write_oldest(struct bgz_aux * aux)
+{
+  struct bgz_job * job = &aux->jobs[aux->oldest];
+  bgz_wait(aux, job);
+  int r = job->err;
+  if (!r && write_all(aux->fd, job->out, job->out_len) < 0) r = -1;
+  if (!r) r = bgz_add_block(aux, job->out_len, job->in_len);
+  if (!r) aux->coffset += job->out_len;
+
+  pthread_mutex_lock(&aux->mu);
+  job->state = BGZ_IDLE;
+  pthread_mutex_unlock(&aux->mu);
+  job->in_len = 0;
+  aux->oldest = (aux->oldest + 1) % aux->njobs;
+  aux->nflight--;
+  return r;
+}
+
+// hands the current block to the workers, and writes out whatever is finished
+static int bgz_end_block(struct bgz_aux * aux)
+{
+  int r = 0;
+  struct bgz_job * job = &aux->jobs[aux->cur];
+  if (job->in_len)
+  {
+    bgz_submit(aux, job);
+    aux->nflight++;
+    aux->cur = (aux->cur + 1) % aux->njobs;
+  }
+
+  while (aux->nflight)
+  {
+    // always need the next job free to fill, otherwise only write what's ready
+    if (aux->nflight < aux->njobs)
+    {
+      pthread_mutex_lock(&aux->mu);
+      bool ready = aux->jobs[aux->oldest].state == BGZ_DONE;
+      pthread_mutex_unlock(&aux->mu);
+      if (!ready) break;
+    }
+    if (bgz_write_oldest(aux)) r = -1;
+  }
+  return r;
+}
+
+static int bgz_writebytes(size_t nbytes, const void * bytes, pueo_handle_t *h)
+{
+  struct bgz_aux * aux = (struct bgz_aux*) h->aux;
+  struct bgz_job * job = &aux->jobs[aux->cur];
+  if (job->in_len + nbytes > job->in_cap)
+  {
+    size_t newcap = job->in_cap;
+    while (newcap < job->in_len + nbytes) newcap *= 2;
+    if (grow(&job->in, &job->in_cap, newcap)) return -1;
+  }
+  memcpy(job->in + job->in_len, bytes, nbytes);
+  job->in_len += nbytes;
+  return nbytes;
+}
+
+// blocks only ever end between packets
+static int bgz_done(pueo_handle_t *h)
+{
+  struct bgz_aux * aux = (struct bgz_aux*) h->aux;
+  if (aux->jobs[aux->cur].in_len < aux->block_size) return 0;
+  return bgz_end_block(aux);
+}
+
+static int bgz_flush(pueo_handle_t *h)
+{
+  struct bgz_aux * aux = (struct bgz_aux*) h->aux;
+  int r = bgz_end_block(aux);
+  while (aux->nflight)
+  {
+    if (bgz_write_oldest(aux)) r = -1;
+  }
+  return r;
+}
+
+static int bgz_write_trailer(struct bgz_aux * aux)
+{
+  uint8_t * buf = malloc(16 + 8 * BGZ_INDEX_PER_MEMBER + 2 + BGZ_FOOTER_SIZE);
+  if (!buf) return -1;
+
+  uint64_t index_offset = aux->coffset;
+  int r = 0;
+  for (size_t i = 0; !r && i < aux->nblocks; i += BGZ_INDEX_PER_MEMBER)
+  {
+    size_t n = aux->nblocks - i < BGZ_INDEX_PER_MEMBER ? aux->nblocks - i : BGZ_INDEX_PER_MEMBER;
+    for (size_t j = 0; j < n; j++)
+    {
+      put_le32(buf + 16 + 8*j, aux->csizes[i+j]);
+      put_le32(buf + 20 + 8*j, aux->usizes[i+j]);
+    }
+    size_t len = bgz_empty_member(buf, 'I', 8*n);
+    if (write_all(aux->fd, buf, len) < 0) r = -1;
+  }
+
+  put_le64(buf + 16, index_offset);
+  put_le64(buf + 24, aux->nblocks);
+  size_t len = bgz_empty_member(buf, 'E', 16);
+  if (!r && write_all(aux->fd, buf, len) < 0) r = -1;
+  free(buf);
+  return r;
+}
+
+// gets the block sizes from the trailer. Returns false if there isn't a (sensible) one
+static bool bgz_read_trailer(struct bgz_aux * aux, uint64_t size)
+{
+  uint8_t eof[BGZ_EOF_SIZE];
+  if (size < BGZ_EOF_SIZE || pread_all(aux->fd, eof, BGZ_EOF_SIZE, size - BGZ_EOF_SIZE) != BGZ_EOF_SIZE
+      || bgz_member_type(eof, BGZ_EOF_SIZE) != 'E' || get_le16(eof+14) != 16)
+  {
+    return false;
+  }
+
+  uint64_t index_offset = get_le64(eof+16);
+  uint64_t nblocks = get_le64(eof+24);
+  if (index_offset > size - BGZ_EOF_SIZE) return false;
+  size_t index_len = size - BGZ_EOF_SIZE - index_offset;
+  uint8_t * index = malloc(index_len ? index_len : 1);
+  if (!index) return false;
+  if (pread_all(aux->fd, index, index_len, index_offset) != (int) index_len)
+  {
+    free(index);
+    return false;
+  }
+
+  size_t pos = 0;
+  while (pos + 16 <= index_len && bgz_member_type(index + pos, index_len - pos) == 'I')
+  {
+    size_t slen = get_le16(index + pos + 14);
+    if (pos + 16 + slen > index_len) break;
+    for (size_t j = 0; j + 8 <= slen; j += 8)
+    {
+      if (bgz_add_block(aux, get_le32(index + pos + 16 + j), get_le32(index + pos + 20 + j))) break;
+    }
+    pos += 12 + get_le16(index + pos + 10) + 2 + BGZ_FOOTER_SIZE;
+  }
+  free(index);
+
+  if (aux->nblocks == nblocks) return true;
+  fprintf(stderr,"bgz: index trailer is inconsistent, walking the blocks instead\n");
+  aux->nblocks = 0;
+  return false;
+}
+
+// gets the block sizes from the trailer, or failing that by walking the blocks
+static int bgz_load_index(struct bgz_aux * aux)
+{
+  struct stat st;
+  if (fstat(aux->fd, &st)) return -1;
+  uint64_t size = st.st_size;
+
+  if (!bgz_read_trailer(aux, size))
+  {
+    uint64_t offset = 0;
+    uint8_t head[BGZ_HEADER_SIZE];
+    while (pread_all(aux->fd, head, BGZ_HEADER_SIZE, offset) == BGZ_HEADER_SIZE && bgz_member_type(head, BGZ_HEADER_SIZE) == 'B')
+    {
+      uint32_t csize = get_le32(head+16);
+      if (csize < BGZ_HEADER_SIZE || offset + csize > size)
+      {
+        fprintf(stderr,"bgz: truncated block at offset %lu\n", (unsigned long) offset);
+        break;
+      }
+      if (bgz_add_block(aux, csize, get_le32(head+20))) return -1;
+      offset += csize;
+    }
+  }
+
+  aux->coffsets = malloc((aux->nblocks + 1) * sizeof(uint64_t));
+  aux->uoffsets = malloc((aux->nblocks + 1) * sizeof(uint64_t));
+  if (!aux->coffsets || !aux->uoffsets) return -1;
+  aux->coffsets[0] = 0;
+  aux->uoffsets[0] = 0;
+  for (size_t i = 0; i < aux->nblocks; i++)
+  {
+    aux->coffsets[i+1] = aux->coffsets[i] + aux->csizes[i];
+    aux->uoffsets[i+1] = aux->uoffsets[i] + aux->usizes[i];
+  }
+  return 0;
+}
+
+static void bgz_schedule(struct bgz_aux * aux, int i, size_t skip)
+{
+  struct bgz_job * job = &aux->jobs[i];
+  if (aux->next_block == aux->nblocks)
+  {
+    pthread_mutex_lock(&aux->mu);
+    job->state = BGZ_IDLE;
+    pthread_mutex_unlock(&aux->mu);
+    return;
+  }
+  job->block = aux->next_block++;
+  job->pos = skip;
+  job->out_len = 0;
+  bgz_submit(aux, job);
+}
+
+// makes sure the current job has something left to read. Returns NULL at the end
+static struct bgz_job * bgz_current(struct bgz_aux * aux)
+{
+  while (true)
+  {
+    struct bgz_job * job = &aux->jobs[aux->cur];
+    if (job->state == BGZ_IDLE) return NULL;
+    bgz_wait(aux, job);
+    if (job->err || job->pos < job->out_len) return job;
+
+    // used up, so recycle it for the next block that isn't in flight yet
+    bgz_schedule(aux, aux->cur, 0);
+    aux->cur = (aux->cur + 1) % aux->njobs;
+  }
+}
+
+static int bgz_readbytes(size_t nbytes, void * bytes, pueo_handle_t *h)
+{
+  struct bgz_aux * aux = (struct bgz_aux*) h->aux;
+  size_t ncopied = 0;
+  while (ncopied < nbytes)
+  {
+    struct bgz_job * job = bgz_current(aux);
+    if (!job) break;
+    if (job->err) return ncopied ? (int) ncopied : -1;
+    size_t nleft = job->out_len - job->pos;
+    size_t ncopy = nleft < nbytes - ncopied ? nleft : nbytes - ncopied;
+    memcpy((uint8_t*) bytes + ncopied, job->out + job->pos, ncopy);
+    job->pos += ncopy;
+    ncopied += ncopy;
+  }
+  return ncopied;
+}
+
+// packets never straddle blocks, so they can be viewed in place
+static int bgz_viewbytes(size_t nbytes, const void ** bytes, pueo_handle_t *h)
+{
+  struct bgz_aux * aux = (struct bgz_aux*) h->aux;
+  struct bgz_job * job = bgz_current(aux);
+  if (!job) return 0;
+  if (job->err) return -1;
+  size_t nleft = job->out_len - job->pos;
+  size_t nview = nleft < nbytes ? nleft : nbytes;
+  *bytes = job->out + job->pos;
+  job->pos += nview;
+  return nview;
+}
+
+static int bgz_seek(uint64_t offset, pueo_handle_t *h)
+{
+  struct bgz_aux * aux = (struct bgz_aux*) h->aux;
+  if (offset > aux->uoffsets[aux->nblocks]) return -1;
+
+  // call off the readahead
+  pthread_mutex_lock(&aux->mu);
+  for (int i = 0; i < aux->njobs; i++)
+  {
+    if (aux->jobs[i].state == BGZ_PENDING) aux->jobs[i].state = BGZ_IDLE;
+  }
+  for (int i = 0; i < aux->njobs; i++)
+  {
+    while (aux->jobs[i].state == BGZ_BUSY) pthread_cond_wait(&aux->cv_done, &aux->mu);
+    aux->jobs[i].state = BGZ_IDLE;
+  }
+  pthread_mutex_unlock(&aux->mu);
+
+  // last block starting at or before offset
+  size_t lo = 0, hi = aux->nblocks;
+  while (hi - lo > 1)
+  {
+    size_t mid = (lo + hi) / 2;
+    if (aux->uoffsets[mid] <= offset) lo = mid;
+    else hi = mid;
+  }
+
+  aux->next_block = offset == aux->uoffsets[aux->nblocks] ? aux->nblocks : lo;
+  aux->cur = 0;
+  for (int i = 0; i < aux->njobs; i++) bgz_schedule(aux, i, i == 0 ? offset - aux->uoffsets[lo] : 0);
+  return 0;
+}
+
+// stops the workers, closes the file and frees everything
+static int bgz_free(struct bgz_aux * aux)
+{
+  if (aux->threads)
+  {
+    pthread_mutex_lock(&aux->mu);
+    aux->closing = true;
+    pthread_cond_broadcast(&aux->cv_work);
+    pthread_mutex_unlock(&aux->mu);
+    for (int i = 0; i < aux->nthreads; i++) pthread_join(aux->threads[i], NULL);
+    free(aux->threads);
+  }
+  for (int i = 0; aux->jobs && i < aux->njobs; i++)
+  {
+    struct bgz_job * job = &aux->jobs[i];
+    if (job->z_init)
+    {
+      if (aux->writing) deflateEnd(&job->z);
+      else inflateEnd(&job->z);
+    }
+    free(job->in);
+    free(job->out);
+  }
+  free(aux->jobs);
+  int r = aux->fd >= 0 ? close(aux->fd) : 0;
+  pthread_mutex_destroy(&aux->mu);
+  pthread_cond_destroy(&aux->cv_work);
+  pthread_cond_destroy(&aux->cv_done);
+  free(aux->csizes);
+  free(aux->usizes);
+  free(aux->coffsets);
+  free(aux->uoffsets);
+  free(aux);
+  return r;
+}
+
+static int bgz_close(pueo_handle_t *h)
+{
+  struct bgz_aux * aux = (struct bgz_aux*) h->aux;
+  if (!aux) return 0;
+  int r = 0;
+  if (aux->writing)
+  {
+    r = bgz_flush(h);
+    if (bgz_write_trailer(aux)) r = -1;
+  }
+  if (bgz_free(aux)) r = -1;
+  h->aux = NULL;
+  return r;
+}
+
+bool pueo_bgz_probe(const char * file)
+{
+  int fd = open(file, O_RDONLY);
+  if (fd < 0) return false;
+  uint8_t head[BGZ_HEADER_SIZE];
+  int n = pread_all(fd, head, sizeof(head), 0);
+  close(fd);
+  char type = n > 0 ? bgz_member_type(head, n) : 0;
+  return type == 'B' || type == 'E';
+}
+
+int pueo_handle_init_bgz(pueo_handle_t *h, const char * file, const char * mode, const pueo_bgz_opts_t * opts)
+{
+  memset(h, 0, sizeof(pueo_handle_t));
+
+  bool am_reading = !!strchr(mode,'r');
+  bool am_writing = !!strchr(mode,'w');
+  if (!(am_reading ^ am_writing) || strchr(mode,'a'))
+  {
+    fprintf(stderr,"pueo_handle_init_bgz: mode must have one of r or w in it (appending is not supported)\n");
+    return -1;
+  }
+
+  pueo_bgz_opts_t o = {0};
+  if (opts) o = *opts;
+  else
+  {
+    // like gzopen, allow the level to be in the mode
+    const char * digits = strpbrk(mode,"0123456789");
+    if (digits) o.level = atoi(digits);
+  }
+  if (o.nthreads <= 0)
+  {
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    o.nthreads = ncpu < 1 ? 1 : ncpu > 16 ? 16 : ncpu;
+  }
+  if (o.block_size <= 0) o.block_size = 1 << 20;
+
+  int fd = am_reading ? open(file, O_RDONLY) : open(file, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if (fd < 0) return -1;
+
+  struct bgz_aux * aux = calloc(1, sizeof(struct bgz_aux));
+  aux->fd = fd;
+  aux->writing = am_writing;
+  aux->level = o.level ? o.level : Z_DEFAULT_COMPRESSION;
+  aux->block_size = o.block_size;
+  pthread_mutex_init(&aux->mu, NULL);
+  pthread_cond_init(&aux->cv_work, NULL);
+  pthread_cond_init(&aux->cv_done, NULL);
+  aux->njobs = 2 * o.nthreads;
+  aux->jobs = calloc(aux->njobs, sizeof(struct bgz_job));
+
+  if (am_reading)
+  {
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    if (bgz_load_index(aux))
+    {
+      bgz_free(aux);
+      return -1;
+    }
+  }
+  else
+  {
+    // leave room for the packet that takes a block over block_size
+    for (int i = 0; i < aux->njobs; i++)
+    {
+      if (grow(&aux->jobs[i].in, &aux->jobs[i].in_cap, 2 * aux->block_size))
+      {
+        bgz_free(aux);
+        return -1;
+      }
+    }
+  }
+
+  aux->threads = calloc(o.nthreads, sizeof(pthread_t));
+  for (int i = 0; i < o.nthreads; i++)
+  {
+    if (pthread_create(&aux->threads[i], NULL, bgz_thread, aux))
+    {
+      fprintf(stderr,"pueo_handle_init_bgz: couldn't start worker thread\n");
+      break;
+    }
+    aux->nthreads++;
+  }
+  if (!aux->nthreads)
+  {
+    bgz_free(aux);
+    return -1;
+  }
+
+  if (am_reading)
+  {
+    for (int i = 0; i < aux->njobs; i++) bgz_schedule(aux, i, 0);
+  }
+
+  h->aux = aux;
+  h->close = bgz_close;
+  h->read_bytes = am_reading ? bgz_readbytes : NULL;
+  h->view_bytes = am_reading ? bgz_viewbytes : NULL;
+  h->seek = am_reading ? bgz_seek : NULL;
+  h->write_bytes = am_writing ? bgz_writebytes : NULL;
+  h->done_write_packet = am_writing ? bgz_done : NULL;
+  h->flush = am_writing ? bgz_flush : NULL;
+  if (am_reading) asprintf(&h->description, "bgz file %s (%zu blocks, %d threads)", file, aux->nblocks, aux->nthreads);
+  else asprintf(&h->description, "bgz file %s (level %d, %d kB blocks, %d threads)", file, o.level ? o.level : 6, o.block_size >> 10, aux->nthreads);
+  return 0;
+}
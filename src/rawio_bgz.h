@@ -0,0 +1,32 @@
+#ifndef PUEO_RAWIO_BGZ_H
+#define PUEO_RAWIO_BGZ_H
+
+/** \file rawio_bgz.h
+ *
+ * private internal header for the block-compressed gzip backend. Not exported!
+ *
+ * This file is part of libpueorawdata, developed by the PUEO collaboration.
+ * \copyright Copyright (C) 2021 PUEO Collaboration
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <https://www.gnu.org/licenses/>.
+
+ *
+ */
+
+#include <stdbool.h>
+
+// true if file starts with one of our blocks (so pueo_handle_init_file can use the block reader for .gz)
+bool pueo_bgz_probe(const char * file);
+
+#endif
@@ -385,6 +385,7 @@ int pueo_db_insert_##X(pueo_db_handle_t * h, const pueo_##X##_t * x) { (void) h;
 
 // these should never need to be entered into a DB
 UNSUPPORTED_INSERT_DB(full_waveforms)
+UNSUPPORTED_INSERT_DB(encoded_waveform)
 UNSUPPORTED_INSERT_DB(sensors_disk)
 
 
@@ -3,6 +3,7 @@
 #include "float16_guard.h"
 #include <stdio.h>
 #include "pueo/rawio.h"
+#include "pueo/encode.h"
 #include <string.h>
 #include "pueo/sensor_ids.h"
 #include <inttypes.h>
@@ -77,6 +78,28 @@ int pueo_dump_single_waveform(FILE *f, const pueo_single_waveform_t * wf)
   DUMPFINISH();
 }
 
+int pueo_dump_encoded_waveform(FILE *f, const pueo_encoded_waveform_t * wf)
+{
+  DUMPINIT(f)
+  DUMPSTART("encoded_waveform");
+  DUMPU32(wf,run);
+  DUMPU32(wf,event);
+  DUMPU8(wf,channel_id);
+  DUMPX8(wf,flags);
+  DUMPU16(wf,nsamples);
+  DUMPX16(wf,encoded_flags);
+  DUMPU16(wf,encoded_nbytes);
+  DUMPTIME(wf,readout_time);
+  if ((wf->encoded_flags & PUEO_ENCODING_MASK) == PUEO_ENCODING_QUANTIZED) DUMPKEYVAL("max_error", "%d", pueo_encoded_waveform_max_error(wf));
+
+  // and what it decodes to
+  pueo_waveform_t decoded;
+  if (pueo_decode_waveform(wf, &decoded) < 0) decoded.length = 0;
+  ret+=pueo_dump_waveform(f,&decoded);
+  DUMPEND();
+  DUMPFINISH();
+}
+
 int pueo_dump_full_waveforms(FILE *f, const pueo_full_waveforms_t * wf)
 {
   DUMPINIT(f)
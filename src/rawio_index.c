@@ -0,0 +1,396 @@
+/** \file rawio_index.c
+ *
+ * Sidecar event indices.
+ *
+ * An index file is a small header followed by one pueo_index_entry_t per
+ * waveform packet, in the order the packets appear in the data. Entries hold
+ * offsets in the uncompressed stream, which is what pueo_handle_seek takes (the
+ * bgz reader maps those to blocks itself).
+ *
+ * This file is part of libpueorawdata, developed by the PUEO collaboration.
+ * \copyright Copyright (C) 2021 PUEO Collaboration
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <https://www.gnu.org/licenses/>.
+
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include "float16_guard.h"
+#include "pueo/rawio.h"
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+
+#define INDEX_MAGIC "PUEOIDX"
+#define INDEX_VERSION 1
+
+struct index_file_head
+{
+  char magic[8];
+  uint32_t version;
+  uint32_t entry_size;
+};
+
+struct pueo_index
+{
+  pueo_index_entry_t * entries; // in file order
+  pueo_index_entry_t * by_event;
+  pueo_index_entry_t * by_time;
+  size_t n;
+};
+
+// enough of a packet to fill in an entry: run, event and readout_time are in the same place for both waveform types
+#define INDEX_PREFIX_SIZE (sizeof(pueo_packet_head_t) + offsetof(pueo_full_waveforms_t, readout_time) + sizeof(pueo_time_t))
+
+_Static_assert(offsetof(pueo_full_waveforms_t, readout_time) == offsetof(pueo_single_waveform_t, readout_time), "index assumes the waveform types start the same");
+
+// fills in an entry from the start of a packet, returning false if it's not something we index
+static bool index_entry_for(const uint8_t * prefix, size_t len, uint64_t offset, pueo_index_entry_t * e)
+{
+  const pueo_packet_head_t * hd = (const pueo_packet_head_t*) prefix;
+  if (len < sizeof(*hd) + 2 * sizeof(uint32_t)) return false;
+  if (hd->type != PUEO_FULL_WAVEFORMS && hd->type != PUEO_SINGLE_WAVEFORM) return false;
+
+  memset(e, 0, sizeof(*e));
+  e->offset = offset;
+  e->type = hd->type;
+  const uint8_t * payload = prefix + sizeof(*hd);
+  memcpy(&e->run, payload + offsetof(pueo_full_waveforms_t, run), sizeof(e->run));
+  memcpy(&e->event, payload + offsetof(pueo_full_waveforms_t, event), sizeof(e->event));
+
+  // version 0 of both predates readout_time
+  if (hd->version > 0 && len >= INDEX_PREFIX_SIZE)
+  {
+    memcpy(&e->readout_time, payload + offsetof(pueo_full_waveforms_t, readout_time), sizeof(e->readout_time));
+  }
+  return true;
+}
+
+static int cmp_event(const void * a, const void * b)
+{
+  const pueo_index_entry_t * x = a;
+  const pueo_index_entry_t * y = b;
+  if (x->run != y->run) return x->run < y->run ? -1 : 1;
+  if (x->event != y->event) return x->event < y->event ? -1 : 1;
+  return x->offset < y->offset ? -1 : x->offset > y->offset;
+}
+
+static int cmp_time(const void * a, const void * b)
+{
+  const pueo_index_entry_t * x = a;
+  const pueo_index_entry_t * y = b;
+  if (x->readout_time.utc_secs != y->readout_time.utc_secs) return x->readout_time.utc_secs < y->readout_time.utc_secs ? -1 : 1;
+  if (x->readout_time.utc_nsecs != y->readout_time.utc_nsecs) return x->readout_time.utc_nsecs < y->readout_time.utc_nsecs ? -1 : 1;
+  return x->offset < y->offset ? -1 : x->offset > y->offset;
+}
+
+// takes ownership of entries
+static pueo_index_t * index_from_entries(pueo_index_entry_t * entries, size_t n)
+{
+  pueo_index_t * idx = calloc(1, sizeof(pueo_index_t));
+  idx->entries = entries;
+  idx->n = n;
+  idx->by_event = malloc(n * sizeof(*entries) + 1);
+  idx->by_time = malloc(n * sizeof(*entries) + 1);
+  if (!idx->by_event || !idx->by_time)
+  {
+    pueo_index_close(idx);
+    return NULL;
+  }
+  memcpy(idx->by_event, entries, n * sizeof(*entries));
+  memcpy(idx->by_time, entries, n * sizeof(*entries));
+  qsort(idx->by_event, n, sizeof(*entries), cmp_event);
+  qsort(idx->by_time, n, sizeof(*entries), cmp_time);
+  return idx;
+}
+
+static int read_fully(pueo_handle_t * h, size_t nbytes, void * bytes)
+{
+  size_t nread = 0;
+  while (nread < nbytes)
+  {
+    int r = h->read_bytes(nbytes - nread, (uint8_t*) bytes + nread, h);
+    if (r <= 0) break;
+    nread += r;
+  }
+  return nread;
+}
+
+pueo_index_t * pueo_index_build(const char * uri, const char * index_file)
+{
+  pueo_handle_t h;
+  if (pueo_handle_init(&h, uri, "r"))
+  {
+    fprintf(stderr,"pueo_index_build: couldn't open %s\n", uri);
+    return NULL;
+  }
+
+  size_t n = 0, cap = 1024;
+  pueo_index_entry_t * entries = malloc(cap * sizeof(*entries));
+  uint8_t * scratch = h.view_bytes ? NULL : malloc(1 << 20); // num_bytes is 20 bits
+  uint64_t offset = 0;
+  uint8_t prefix[INDEX_PREFIX_SIZE];
+
+  while (true)
+  {
+    // just the start of each packet, the rest is skipped (viewed, if possible, so it's not copied)
+    if (read_fully(&h, sizeof(pueo_packet_head_t), prefix) != sizeof(pueo_packet_head_t)) break;
+    const pueo_packet_head_t * hd = (const pueo_packet_head_t*) prefix;
+    if (hd->f1 != 0xf1)
+    {
+      fprintf(stderr,"pueo_index_build: lost sync at offset %lu in %s, stopping there\n", (unsigned long) offset, uri);
+      break;
+    }
+    size_t num_bytes = hd->num_bytes;
+    size_t nprefix = num_bytes < sizeof(prefix) - sizeof(*hd) ? num_bytes : sizeof(prefix) - sizeof(*hd);
+    if (read_fully(&h, nprefix, prefix + sizeof(*hd)) != (int) nprefix) break;
+
+    size_t nskip = num_bytes - nprefix;
+    if (h.view_bytes)
+    {
+      const void * ignored;
+      if (nskip && h.view_bytes(nskip, &ignored, &h) != (int) nskip) break;
+    }
+    else if (read_fully(&h, nskip, scratch) != (int) nskip) break;
+
+    if (n == cap)
+    {
+      cap *= 2;
+      pueo_index_entry_t * more = realloc(entries, cap * sizeof(*entries));
+      if (!more) break;
+      entries = more;
+    }
+    if (index_entry_for(prefix, sizeof(*hd) + nprefix, offset, &entries[n])) n++;
+    offset += sizeof(*hd) + num_bytes;
+  }
+
+  free(scratch);
+  pueo_handle_close(&h);
+
+  pueo_index_t * idx = index_from_entries(entries, n);
+  if (idx && index_file && pueo_index_save(idx, index_file))
+  {
+    fprintf(stderr,"pueo_index_build: couldn't write %s\n", index_file);
+  }
+  return idx;
+}
+
+pueo_index_t * pueo_index_open(const char * index_file)
+{
+  FILE * f = fopen(index_file,"r");
+  if (!f) return NULL;
+
+  struct index_file_head head;
+  if (fread(&head, sizeof(head), 1, f) != 1 || memcmp(head.magic, INDEX_MAGIC, sizeof(INDEX_MAGIC)) ||
+      head.version != INDEX_VERSION || head.entry_size != sizeof(pueo_index_entry_t))
+  {
+    fprintf(stderr,"pueo_index_open: %s is not an index we understand\n", index_file);
+    fclose(f);
+    return NULL;
+  }
+
+  // entries until the end (an index still being written may end with a partial one, which we ignore)
+  size_t n = 0, cap = 1024;
+  pueo_index_entry_t * entries = malloc(cap * sizeof(*entries));
+  while (entries)
+  {
+    n += fread(entries + n, sizeof(*entries), cap - n, f);
+    if (n < cap) break;
+    cap *= 2;
+    pueo_index_entry_t * more = realloc(entries, cap * sizeof(*entries));
+    if (!more)
+    {
+      free(entries);
+      entries = NULL;
+    }
+    else entries = more;
+  }
+  fclose(f);
+  return entries ? index_from_entries(entries, n) : NULL;
+}
+
+int pueo_index_save(const pueo_index_t * idx, const char * index_file)
+{
+  FILE * f = fopen(index_file,"w");
+  if (!f) return -1;
+  struct index_file_head head = { .magic = INDEX_MAGIC, .version = INDEX_VERSION, .entry_size = sizeof(pueo_index_entry_t) };
+  int r = fwrite(&head, sizeof(head), 1, f) == 1 && fwrite(idx->entries, sizeof(*idx->entries), idx->n, f) == idx->n ? 0 : -1;
+  if (fclose(f)) r = -1;
+  return r;
+}
+
+void pueo_index_close(pueo_index_t * idx)
+{
+  if (!idx) return;
+  free(idx->entries);
+  free(idx->by_event);
+  free(idx->by_time);
+  free(idx);
+}
+
+const pueo_index_entry_t * pueo_index_entries(const pueo_index_t * idx, size_t * n)
+{
+  *n = idx->n;
+  return idx->entries;
+}
+
+const pueo_index_entry_t * pueo_index_find_event(const pueo_index_t * idx, uint32_t run, uint32_t event)
+{
+  // first entry not before (run, event)
+  size_t lo = 0, hi = idx->n;
+  while (lo < hi)
+  {
+    size_t mid = lo + (hi - lo) / 2;
+    const pueo_index_entry_t * e = &idx->by_event[mid];
+    if (e->run < run || (e->run == run && e->event < event)) lo = mid + 1;
+    else hi = mid;
+  }
+  if (lo == idx->n || idx->by_event[lo].run != run || idx->by_event[lo].event != event) return NULL;
+  return &idx->by_event[lo];
+}
+
+const pueo_index_entry_t * pueo_index_find_time(const pueo_index_t * idx, uint64_t utc_secs, uint32_t utc_nsecs)
+{
+  // first entry not before the time
+  size_t lo = 0, hi = idx->n;
+  while (lo < hi)
+  {
+    size_t mid = lo + (hi - lo) / 2;
+    const pueo_index_entry_t * e = &idx->by_time[mid];
+    if (e->readout_time.utc_secs < utc_secs || (e->readout_time.utc_secs == utc_secs && e->readout_time.utc_nsecs < utc_nsecs)) lo = mid + 1;
+    else hi = mid;
+  }
+  return lo < idx->n ? &idx->by_time[lo] : NULL;
+}
+
+int pueo_handle_seek_event(pueo_handle_t * h, const pueo_index_t * idx, uint32_t run, uint32_t event)
+{
+  const pueo_index_entry_t * e = pueo_index_find_event(idx, run, event);
+  if (!e) return -ENOENT;
+  return pueo_handle_seek(h, e->offset);
+}
+
+int pueo_handle_seek_time(pueo_handle_t * h, const pueo_index_t * idx, uint64_t utc_secs, uint32_t utc_nsecs)
+{
+  const pueo_index_entry_t * e = pueo_index_find_time(idx, utc_secs, utc_nsecs);
+  if (!e) return -ENOENT;
+  return pueo_handle_seek(h, e->offset);
+}
+
+
+/* The indexing layer, which sits in front of a writing handle (kept in the aux) and
+ * appends an entry for each waveform packet that goes through it.
+ */
+struct index_writer_aux
+{
+  pueo_handle_t inner;
+  FILE * f;
+  uint64_t offset;  // of the packet being written
+  uint64_t nbytes;  // of the packet being written so far
+  uint8_t prefix[INDEX_PREFIX_SIZE];
+};
+
+static int index_writebytes(size_t nbytes, const void * bytes, pueo_handle_t * h)
+{
+  struct index_writer_aux * aux = (struct index_writer_aux*) h->aux;
+  if (aux->nbytes < sizeof(aux->prefix))
+  {
+    size_t ncopy = sizeof(aux->prefix) - aux->nbytes < nbytes ? sizeof(aux->prefix) - aux->nbytes : nbytes;
+    memcpy(aux->prefix + aux->nbytes, bytes, ncopy);
+  }
+  int r = aux->inner.write_bytes(nbytes, bytes, &aux->inner);
+  if (r > 0) aux->nbytes += r;
+  return r;
+}
+
+// a packet that failed partway never reached index_done, but its bytes still went out
+static void index_begin(pueo_handle_t * h)
+{
+  struct index_writer_aux * aux = (struct index_writer_aux*) h->aux;
+  aux->offset += aux->nbytes;
+  aux->nbytes = 0;
+  if (aux->inner.begin_write_packet) aux->inner.begin_write_packet(&aux->inner);
+}
+
+static int index_done(pueo_handle_t * h)
+{
+  struct index_writer_aux * aux = (struct index_writer_aux*) h->aux;
+  int r = aux->inner.done_write_packet ? aux->inner.done_write_packet(&aux->inner) : 0;
+
+  pueo_index_entry_t e;
+  size_t nprefix = aux->nbytes < sizeof(aux->prefix) ? aux->nbytes : sizeof(aux->prefix);
+  if (!r && index_entry_for(aux->prefix, nprefix, aux->offset, &e) && fwrite(&e, sizeof(e), 1, aux->f) != 1) r = -1;
+  aux->offset += aux->nbytes;
+  aux->nbytes = 0;
+  return r;
+}
+
+static int index_flush(pueo_handle_t * h)
+{
+  struct index_writer_aux * aux = (struct index_writer_aux*) h->aux;
+  int r = aux->inner.flush ? aux->inner.flush(&aux->inner) : 0;
+  if (fflush(aux->f)) r = -1;
+  return r;
+}
+
+static int index_close(pueo_handle_t * h)
+{
+  struct index_writer_aux * aux = (struct index_writer_aux*) h->aux;
+  if (!aux) return 0;
+  int r = pueo_handle_close(&aux->inner);
+  if (fclose(aux->f)) r = -1;
+  free(aux);
+  h->aux = NULL;
+  return r;
+}
+
+int pueo_handle_write_index(pueo_handle_t * h, const char * index_file)
+{
+  if (!h->write_bytes)
+  {
+    fprintf(stderr,"pueo_handle_write_index: need a handle to write to\n");
+    return -1;
+  }
+
+  FILE * f = fopen(index_file,"w");
+  if (!f)
+  {
+    fprintf(stderr,"pueo_handle_write_index: couldn't open %s\n", index_file);
+    return -1;
+  }
+  struct index_file_head head = { .magic = INDEX_MAGIC, .version = INDEX_VERSION, .entry_size = sizeof(pueo_index_entry_t) };
+  fwrite(&head, sizeof(head), 1, f);
+
+  struct index_writer_aux * aux = calloc(1, sizeof(struct index_writer_aux));
+  aux->f = f;
+
+  // the inner handle keeps the backend, the outer one keeps the counters and description
+  aux->inner = *h;
+  aux->inner.description = NULL;
+  h->aux = aux;
+  h->write_bytes = index_writebytes;
+  h->write_bytesv = NULL;
+  h->done_write_packet = index_done;
+  h->begin_write_packet = index_begin;
+  h->flush = index_flush;
+  h->close = index_close;
+  h->read_bytes = NULL;
+  h->view_bytes = NULL;
+  h->seek = NULL;
+  h->skip_bytes = NULL;
+  return 0;
+}
@@ -1,8 +1,11 @@
 #include "float16_guard.h"
 #include "pueo/rawio.h"
 #include "rawio_versions.h"
+#include "rawio_packets.h"
+#include "pueo/encode.h"
 #include <stddef.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "pueocrc.h"
@@ -122,6 +125,105 @@ static void update_len_cksum_waveform(uint32_t * len, uint16_t * cksum, const pu
   if (len) *len += size;
 }
 
+/* Packed waveforms (the packed versions, see pueo_handle_set_pack_samples).
+ * The samples have to be packed somewhere that lasts until the packet is written (the pieces may be gathered),
+ * so the whole packed payload goes into a per-thread scratch buffer and is written at once.
+ * The header (for the CRC) is always made just before the packet is written, on the same thread, so the writer
+ * picks up what the header packed rather than packing it all again.
+ */
+
+static _Thread_local struct
+{
+  uint8_t * buf;
+  size_t cap;
+  const pueo_waveform_t * src; // what's packed in buf, if anything
+  int nwf;
+  size_t nbytes;
+} pack_scratch;
+
+uint8_t * pueo_pack_scratch(size_t n)
+{
+  pack_scratch.src = NULL;
+  if (pack_scratch.cap < n)
+  {
+    uint8_t * buf = realloc(pack_scratch.buf, n);
+    if (!buf) return NULL;
+    pack_scratch.buf = buf;
+    pack_scratch.cap = n;
+  }
+  return pack_scratch.buf;
+}
+
+size_t pueo_waveform_pack(const pueo_waveform_t * wf, uint8_t * out)
+{
+  size_t length = wf->length;
+
+  CHECK_WF_LENGTH(length)
+
+  pueo_waveform_t hd = { .channel_id = wf->channel_id, .surf_word = wf->surf_word, .length = length };
+  memcpy(out, &hd, offsetof(pueo_waveform_t, data));
+  int width = pueo_pack_width(wf->data, length);
+  out[offsetof(pueo_waveform_t, data)] = width;
+  return PUEO_PACKED_WF_HEAD_SIZE + pueo_pack_samples(wf->data, length, width, out + PUEO_PACKED_WF_HEAD_SIZE);
+}
+
+int pueo_waveform_unpack(const uint8_t * in, size_t len, pueo_waveform_t * wf)
+{
+  if (len < PUEO_PACKED_WF_HEAD_SIZE) return -1;
+  memcpy(wf, in, offsetof(pueo_waveform_t, data));
+  int width = in[offsetof(pueo_waveform_t, data)];
+  size_t nbytes = (wf->length * width + 7) / 8;
+  if (width < 1 || width > 16 || wf->length > PUEO_MAX_BUFFER_LENGTH || PUEO_PACKED_WF_HEAD_SIZE + nbytes > len)
+  {
+    fprintf(stderr,"***WARNING*** packed wf (length %hu, width %d) seems malformed\n", wf->length, width);
+    return -1;
+  }
+  return PUEO_PACKED_WF_HEAD_SIZE + pueo_unpack_samples(in + PUEO_PACKED_WF_HEAD_SIZE, wf->length, width, wf->data);
+}
+
+// packs nwf waveforms into the scratch buffer, returning it (and the size in *nbytes)
+static const uint8_t * pack_waveforms(const pueo_waveform_t * wfs, int nwf, size_t * nbytes)
+{
+  uint8_t * buf = pueo_pack_scratch(nwf * PUEO_PACKED_WF_MAX_SIZE);
+  if (!buf) return NULL;
+  size_t n = 0;
+  for (int i = 0; i < nwf; i++) n += pueo_waveform_pack(&wfs[i], buf + n);
+  pack_scratch.src = wfs;
+  pack_scratch.nwf = nwf;
+  pack_scratch.nbytes = n;
+  *nbytes = n;
+  return buf;
+}
+
+// the same, but reusing what the header just packed if it's these waveforms (once, so it can't go stale)
+static const uint8_t * take_packed_waveforms(const pueo_waveform_t * wfs, int nwf, size_t * nbytes)
+{
+  const uint8_t * buf = pack_scratch.src == wfs && pack_scratch.nwf == nwf ? pack_scratch.buf : pack_waveforms(wfs, nwf, nbytes);
+  if (buf) *nbytes = pack_scratch.nbytes;
+  pack_scratch.src = NULL;
+  return buf;
+}
+
+static int read_packed_waveform(pueo_handle_t*h, pueo_waveform_t * wf)
+{
+  uint8_t buf[PUEO_PACKED_WF_MAX_SIZE];
+  int nrd = h->read_bytes(PUEO_PACKED_WF_HEAD_SIZE, buf, h);
+  if (nrd != (int) PUEO_PACKED_WF_HEAD_SIZE) return -1;
+  uint16_t length;
+  memcpy(&length, buf + offsetof(pueo_waveform_t, length), sizeof(length));
+  int width = buf[offsetof(pueo_waveform_t, data)];
+  if (length > PUEO_MAX_BUFFER_LENGTH || width > 16) return -1;
+  int nbytes = (length * width + 7) / 8;
+  if (h->read_bytes(nbytes, buf + PUEO_PACKED_WF_HEAD_SIZE, h) != nbytes) return -1;
+  if (pueo_waveform_unpack(buf, PUEO_PACKED_WF_HEAD_SIZE + nbytes, wf) < 0) return -1;
+  return PUEO_PACKED_WF_HEAD_SIZE + nbytes;
+}
+
+static bool packing(const pueo_handle_t * h)
+{
+  return h->flags & PUEO_HANDLE_PACK_SAMPLES;
+}
+
 /* Write a single waveform. First write the part before the pueo_waveform_t, then the part after
  * If not padded properly, this should still roundtrip ok...
  **/
@@ -129,7 +231,17 @@ int pueo_write_packet_single_waveform(pueo_handle_t *h, const pueo_single_wavefo
 {
   int nwr = 0;
   nwr += h->write_bytes(offsetof(pueo_single_waveform_t, wf), p, h);
-  nwr += write_waveform(h, &p->wf);
+  if (packing(h))
+  {
+    size_t nbytes;
+    const uint8_t * packed = take_packed_waveforms(&p->wf, 1, &nbytes);
+    if (!packed) return -1;
+    nwr += h->write_bytes(nbytes, packed, h);
+  }
+  else
+  {
+    nwr += write_waveform(h, &p->wf);
+  }
   return nwr;
 }
 
@@ -142,7 +254,17 @@ pueo_packet_head_t pueo_packet_header_for_single_waveform(const pueo_single_wave
           ver == 1 ? offsetof(pueo_single_waveform_t, prio)  :
           offsetof(pueo_single_waveform_t, wf);
   crc = pueo_crc16_continue(crc,p, len);
-  update_len_cksum_waveform(&len,&crc,&p->wf);
+  size_t nbytes;
+  const uint8_t * packed = ver == PUEO_SINGLE_WAVEFORM_PACKED_VER ? pack_waveforms(&p->wf, 1, &nbytes) : NULL;
+  if (packed)
+  {
+    crc = pueo_crc16_continue(crc, packed, nbytes);
+    len += nbytes;
+  }
+  else
+  {
+    update_len_cksum_waveform(&len,&crc,&p->wf);
+  }
   hd.num_bytes = len;
   hd.cksum = crc;
   return hd;
@@ -156,7 +278,7 @@ int pueo_read_packet_single_waveform(pueo_handle_t *h, pueo_single_waveform_t *p
   if (ver == 0) memset(&p->readout_time, 0, sizeof(p->readout_time));
   int total_read = h->read_bytes(offs, p, h);
   if (total_read !=  (int) offs) return -1;
-  int nrd = read_waveform(h, &p->wf);
+  int nrd = ver == PUEO_SINGLE_WAVEFORM_PACKED_VER ? read_packed_waveform(h, &p->wf) : read_waveform(h, &p->wf);
   if (nrd < 0) return -1;
   total_read += nrd;
   return total_read;
@@ -169,7 +291,17 @@ pueo_packet_head_t pueo_packet_header_for_full_waveforms(const pueo_full_wavefor
   uint16_t crc = CRC16_START;
   len += ver == 0 ? offsetof(pueo_full_waveforms_t,  readout_time) : offsetof(pueo_full_waveforms_t,wfs);
   crc = pueo_crc16_continue(crc,p, len);
-  for (int i = 0; i < PUEO_NCHAN; i++) update_len_cksum_waveform(&len,&crc,&p->wfs[i]);
+  size_t nbytes;
+  const uint8_t * packed = ver == PUEO_FULL_WAVEFORMS_PACKED_VER ? pack_waveforms(p->wfs, PUEO_NCHAN, &nbytes) : NULL;
+  if (packed)
+  {
+    crc = pueo_crc16_continue(crc, packed, nbytes);
+    len += nbytes;
+  }
+  else
+  {
+    for (int i = 0; i < PUEO_NCHAN; i++) update_len_cksum_waveform(&len,&crc,&p->wfs[i]);
+  }
   hd.num_bytes = len;
   hd.cksum = crc;
   return hd;
@@ -179,6 +311,14 @@ int pueo_write_packet_full_waveforms(pueo_handle_t *h, const pueo_full_waveforms
 {
   int nwr = 0;
   nwr += h->write_bytes(offsetof(pueo_full_waveforms_t, wfs), p, h);
+  if (packing(h))
+  {
+    size_t nbytes;
+    const uint8_t * packed = take_packed_waveforms(p->wfs, PUEO_NCHAN, &nbytes);
+    if (!packed) return -1;
+    return nwr + h->write_bytes(nbytes, packed, h);
+  }
+
   for (int i = 0; i < PUEO_NCHAN; i++)
   {
     nwr += write_waveform(h, &p->wfs[i]);
@@ -195,7 +335,7 @@ int pueo_read_packet_full_waveforms(pueo_handle_t *h, pueo_full_waveforms_t *p,
   if (total_read != (int) offs) return -1;
   for (int i = 0; i < PUEO_NCHAN; i++)
   {
-    int nrd = read_waveform(h, &p->wfs[i]);
+    int nrd = ver == PUEO_FULL_WAVEFORMS_PACKED_VER ? read_packed_waveform(h, &p->wfs[i]) : read_waveform(h, &p->wfs[i]);
     if (nrd < 0) return -1;
     total_read += nrd;
   }
@@ -372,15 +512,40 @@ int pueo_read_packet_nav_sat(pueo_handle_t * h, pueo_nav_sat_t * n, int ver)
 }
 
 
-int pueo_write_packet_encoded_waveforms(pueo_handle_t *h, const pueo_encoded_waveform_t *p)
+/* Encoded waveforms: the fixed part, then readout_time, then just the encoded bytes */
+pueo_packet_head_t pueo_packet_header_for_encoded_waveform(const pueo_encoded_waveform_t *p, int ver)
 {
-  //TODO
-  return -1;
+  pueo_packet_head_t hd = {.type = PUEO_ENCODED_WAVEFORM, .f1 = 0xf1, .version = ver};
+  size_t nencoded = p->encoded_nbytes < sizeof(p->encoded) ? p->encoded_nbytes : sizeof(p->encoded);
+  uint16_t crc = pueo_crc16(p, offsetof(pueo_encoded_waveform_t, encoded));
+  crc = pueo_crc16_continue(crc, &p->readout_time, sizeof(p->readout_time));
+  crc = pueo_crc16_continue(crc, p->encoded, nencoded);
+  hd.num_bytes = offsetof(pueo_encoded_waveform_t, encoded) + sizeof(p->readout_time) + nencoded;
+  hd.cksum = crc;
+  return hd;
 }
 
-int pueo_read_packet_encoded_waveforms(pueo_handle_t *h, pueo_encoded_waveform_t *p, int ver)
+int pueo_write_packet_encoded_waveform(pueo_handle_t *h, const pueo_encoded_waveform_t *p)
 {
-  //TODO
-  return -1;
+  if (p->encoded_nbytes > sizeof(p->encoded)) return -1;
+  int nwr = 0;
+  nwr += h->write_bytes(offsetof(pueo_encoded_waveform_t, encoded), p, h);
+  nwr += h->write_bytes(sizeof(p->readout_time), &p->readout_time, h);
+  nwr += h->write_bytes(p->encoded_nbytes, p->encoded, h);
+  return nwr;
+}
+
+int pueo_read_packet_encoded_waveform(pueo_handle_t *h, pueo_encoded_waveform_t *p, int ver)
+{
+  (void) ver;
+  int nrd = h->read_bytes(offsetof(pueo_encoded_waveform_t, encoded), p, h);
+  if (nrd != (int) offsetof(pueo_encoded_waveform_t, encoded) || p->encoded_nbytes > sizeof(p->encoded)) return -1;
+  int nrd2 = h->read_bytes(sizeof(p->readout_time), &p->readout_time, h);
+  if (nrd2 != (int) sizeof(p->readout_time)) return -1;
+  nrd += nrd2;
+  nrd2 = h->read_bytes(p->encoded_nbytes, p->encoded, h);
+  if (nrd2 != (int) p->encoded_nbytes) return -1;
+  nrd += nrd2;
+  return nrd;
 }
 
@@ -26,6 +26,27 @@
 
 
 #include <pueo/rawio.h>
+#include <stddef.h>
+
+
+enum pueo_handle_flags
+{
+  PUEO_HANDLE_ALREADY_READ_HEAD = 1,
+  PUEO_HANDLE_PACK_SAMPLES = 2, // write the packed waveform versions, see pueo_handle_set_pack_samples
+};
+
+// Packed waveforms are the usual waveform header, a byte with the bit width, then the packed samples
+#define PUEO_PACKED_WF_HEAD_SIZE (offsetof(pueo_waveform_t, data) + 1)
+#define PUEO_PACKED_WF_MAX_SIZE (PUEO_PACKED_WF_HEAD_SIZE + PUEO_MAX_BUFFER_LENGTH * sizeof(int16_t))
+
+// Packs wf into out (which needs PUEO_PACKED_WF_MAX_SIZE), returning the number of bytes
+size_t pueo_waveform_pack(const pueo_waveform_t * wf, uint8_t * out);
+
+// Unpacks a packed waveform of at most len bytes into wf, returning the number of bytes used or -1 if it's malformed
+int pueo_waveform_unpack(const uint8_t * in, size_t len, pueo_waveform_t * wf);
+
+// A per-thread buffer of at least n bytes for packing into, good until the next call (NULL if it can't be had)
+uint8_t * pueo_pack_scratch(size_t n);
 
 
 // Set up write packet method for each type
@@ -0,0 +1,495 @@
+/** \file rawio_shm.c
+ *
+ * Shared-memory ring handles.
+ *
+ * The ring lives in a POSIX shared memory segment: a header page followed by
+ * size bytes of data. Each packet is stored contiguously as a record (a 16 byte
+ * shm_record followed by the packet, padded to 16 bytes), so readers can view
+ * packets in place. A record that wouldn't fit before the end of the ring is
+ * preceded by a padding record, and starts again at the beginning. Since records
+ * (and the ring) are multiples of the shm_record size, there's always room for that.
+ *
+ * head (written by the producer) and tail / oldest are byte counts since the
+ * ring was created, so never wrap. The producer fills in a record, then
+ * publishes it by moving head. Waiting is done with futexes on counters that
+ * are bumped whenever head or tail move.
+ *
+ *  - single consumer: the consumer moves tail as it finishes records, and the
+ *    producer only writes where tail has been (it drops or waits otherwise).
+ *  - broadcast: the producer never waits. Before overwriting, it moves oldest
+ *    past the records in the way, and each consumer keeps its own position,
+ *    jumping ahead to oldest if it was lapped.
+ *
+ * This file is part of libpueorawdata, developed by the PUEO collaboration.
+ * \copyright Copyright (C) 2021 PUEO Collaboration
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <https://www.gnu.org/licenses/>.
+
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include "pueo/rawio.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdatomic.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#define SHM_MAGIC 0x70756f72 // "puor"
+#define SHM_HEADER_SIZE 4096
+#define SHM_RECORD_ALIGN 16 // sizeof(struct shm_record), so any gap at the end of the ring can hold a padding record
+struct shm_record
+{
+  uint32_t len;    // including this, multiple of SHM_RECORD_ALIGN
+  uint32_t nbytes; // size of the packet, 0 for padding (skip to the start of the ring)
+  uint64_t seq;    // packet number
+};
+_Static_assert(sizeof(struct shm_record) == SHM_RECORD_ALIGN, "records must be able to pad any gap");
+
+// at the start of the segment. Each group on its own cache line, so producer and consumer don't fight.
+struct shm_ring
+{
+  uint32_t magic;
+  uint32_t broadcast;
+  uint64_t size;
+
+  _Alignas(64) _Atomic uint64_t head;
+  _Atomic uint32_t head_seq;     // bumped every time head moves (futex)
+  _Atomic uint32_t readers_waiting;
+  _Atomic uint32_t closed;       // the producer is gone
+  _Atomic uint64_t packets;      // published
+  _Atomic uint64_t overruns;     // single consumer: packets the producer dropped for lack of room. broadcast: packets overwritten
+
+  _Alignas(64) _Atomic uint64_t tail;   // single consumer: where the consumer is. broadcast: oldest record still in the ring
+  _Atomic uint32_t tail_seq;     // bumped every time tail moves (futex)
+  _Atomic uint32_t writer_waiting;
+};
+
+struct shm_aux
+{
+  struct shm_ring * ring;
+  uint8_t * data;
+  size_t map_size;
+  bool writing;
+  bool block;
+  char * unlink_name;
+
+  // writing
+  bool at_packet_start;
+  bool dropping;     // the packet being written didn't fit
+  uint64_t rec_start; // where the record being written starts (after any padding)
+  uint32_t rec_len;
+  uint32_t rec_pos;  // bytes written so far, including the shm_record
+  uint32_t rec_end;  // where the packet ends (rec_len is padded)
+  uint64_t reserved; // bytes reserved past head, including padding
+
+  // reading
+  uint64_t pos;      // start of the current record
+  uint32_t cur_len;  // 0 if not in a record
+  uint32_t cur_end;  // where the packet ends
+  uint32_t cur_pos;  // bytes consumed so far, including the shm_record
+  uint64_t next_seq; // broadcast: the packet we expect next, to count what we missed
+};
+
+static long futex_wait(_Atomic uint32_t * addr, uint32_t val, int timeout_ms)
+{
+  struct timespec ts = { timeout_ms / 1000, (timeout_ms % 1000) * 1000000L };
+  return syscall(SYS_futex, (uint32_t*) addr, FUTEX_WAIT, val, timeout_ms >= 0 ? &ts : NULL, NULL, 0);
+}
+
+static void futex_wake(_Atomic uint32_t * addr)
+{
+  syscall(SYS_futex, (uint32_t*) addr, FUTEX_WAKE, INT32_MAX, NULL, NULL, 0);
+}
+
+/* ------ producer ------ */
+
+// makes room for n more bytes past head + reserved. Returns false if there isn't (and we aren't waiting for it)
+static bool shm_make_room(struct shm_aux * aux, uint64_t n)
+{
+  struct shm_ring * ring = aux->ring;
+  uint64_t end = atomic_load_explicit(&ring->head, memory_order_relaxed) + aux->reserved + n;
+
+  if (ring->broadcast)
+  {
+    // push oldest past whatever we're about to overwrite
+    uint64_t oldest = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    uint64_t n_overwritten = 0;
+    while (end - oldest > ring->size)
+    {
+      struct shm_record rec;
+      memcpy(&rec, aux->data + oldest % ring->size, sizeof(rec));
+      if (rec.nbytes) n_overwritten++;
+      oldest += rec.len;
+    }
+    if (n_overwritten) atomic_fetch_add(&ring->overruns, n_overwritten);
+    atomic_store_explicit(&ring->tail, oldest, memory_order_release);
+    return true;
+  }
+
+  while (end - atomic_load_explicit(&ring->tail, memory_order_acquire) > ring->size)
+  {
+    if (!aux->block) return false;
+    atomic_store(&ring->writer_waiting, 1);
+    uint32_t seq = atomic_load(&ring->tail_seq);
+    if (end - atomic_load(&ring->tail) > ring->size) futex_wait(&ring->tail_seq, seq, 100);
+    atomic_store(&ring->writer_waiting, 0);
+  }
+  return true;
+}
+
+static int shm_writebytes(size_t nbytes, const void * bytes, pueo_handle_t *h)
+{
+  struct shm_aux * aux = (struct shm_aux*) h->aux;
+  struct shm_ring * ring = aux->ring;
+
+  if (aux->at_packet_start)
+  {
+    aux->at_packet_start = false;
+
+    // reserve a contiguous record big enough for the packet (the header tells us how big)
+    const pueo_packet_head_t * hd = (const pueo_packet_head_t*) bytes;
+    size_t packet_size = nbytes >= sizeof(*hd) ? sizeof(*hd) + hd->num_bytes : nbytes;
+    uint64_t len = (sizeof(struct shm_record) + packet_size + SHM_RECORD_ALIGN - 1) & ~(uint64_t) (SHM_RECORD_ALIGN - 1);
+    if (len > ring->size / 2)
+    {
+      fprintf(stderr,"shm: a %zu byte packet is too big for a ring of %lu bytes\n", packet_size, (unsigned long) ring->size);
+      return -1;
+    }
+
+    uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    uint64_t pad = ring->size - head % ring->size < len ? ring->size - head % ring->size : 0;
+    aux->reserved = 0;
+    if (!shm_make_room(aux, pad + len))
+    {
+      aux->dropping = true;
+      return nbytes;
+    }
+
+    if (pad)
+    {
+      struct shm_record rec = { .len = pad, .nbytes = 0 };
+      memcpy(aux->data + head % ring->size, &rec, sizeof(rec));
+    }
+    aux->reserved = pad + len;
+    aux->rec_start = head + pad;
+    aux->rec_len = len;
+    aux->rec_pos = sizeof(struct shm_record);
+    aux->rec_end = sizeof(struct shm_record) + packet_size;
+  }
+
+  if (aux->dropping) return nbytes;
+
+  if (aux->rec_pos + nbytes > aux->rec_end)
+  {
+    fprintf(stderr,"shm: packet is bigger than its header says\n");
+    return -1;
+  }
+  memcpy(aux->data + aux->rec_start % ring->size + aux->rec_pos, bytes, nbytes);
+  aux->rec_pos += nbytes;
+  return nbytes;
+}
+
+static int shm_done(pueo_handle_t *h)
+{
+  struct shm_aux * aux = (struct shm_aux*) h->aux;
+  struct shm_ring * ring = aux->ring;
+  aux->at_packet_start = true;
+
+  if (aux->dropping)
+  {
+    aux->dropping = false;
+    atomic_fetch_add(&ring->overruns, 1);
+    h->packets_dropped++;
+    return 0;
+  }
+
+  struct shm_record rec = { .len = aux->rec_len, .nbytes = aux->rec_pos - sizeof(rec), .seq = atomic_load_explicit(&ring->packets, memory_order_relaxed) };
+  memcpy(aux->data + aux->rec_start % ring->size, &rec, sizeof(rec));
+
+  // publish
+  atomic_store_explicit(&ring->head, atomic_load_explicit(&ring->head, memory_order_relaxed) + aux->reserved, memory_order_release);
+  aux->reserved = 0;
+  atomic_fetch_add(&ring->packets, 1);
+  atomic_fetch_add(&ring->head_seq, 1);
+  if (atomic_load(&ring->readers_waiting)) futex_wake(&ring->head_seq);
+  return 0;
+}
+
+/* ------ consumer ------ */
+
+// finish with the current record (it may be overwritten after this)
+static void shm_release(struct shm_aux * aux)
+{
+  struct shm_ring * ring = aux->ring;
+  aux->pos += aux->cur_len;
+  aux->cur_len = 0;
+  if (ring->broadcast) return;
+
+  atomic_store_explicit(&ring->tail, aux->pos, memory_order_release);
+  atomic_fetch_add(&ring->tail_seq, 1);
+  if (atomic_load(&ring->writer_waiting)) futex_wake(&ring->tail_seq);
+}
+
+// broadcast: true (after skipping ahead) if the producer has overwritten our position
+static bool shm_check_lapped(pueo_handle_t *h)
+{
+  struct shm_aux * aux = (struct shm_aux*) h->aux;
+  uint64_t oldest = atomic_load_explicit(&aux->ring->tail, memory_order_acquire);
+  if (!aux->ring->broadcast || aux->pos >= oldest) return false;
+  aux->pos = oldest;
+  aux->cur_len = 0;
+  return true;
+}
+
+// makes sure we're in a record with something left. Returns 0 at the end, -1 on error.
+static int shm_next(pueo_handle_t *h)
+{
+  struct shm_aux * aux = (struct shm_aux*) h->aux;
+  struct shm_ring * ring = aux->ring;
+
+  if (aux->cur_len && aux->cur_pos < aux->cur_end) return 1;
+  if (aux->cur_len) shm_release(aux);
+
+  while (true)
+  {
+    shm_check_lapped(h);
+    uint64_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    if (head == aux->pos)
+    {
+      if (atomic_load(&ring->closed)) return 0;
+      atomic_fetch_add(&ring->readers_waiting, 1);
+      uint32_t seq = atomic_load(&ring->head_seq);
+      if (atomic_load(&ring->head) == aux->pos && !atomic_load(&ring->closed)) futex_wait(&ring->head_seq, seq, 100);
+      atomic_fetch_sub(&ring->readers_waiting, 1);
+      continue;
+    }
+
+    struct shm_record rec;
+    memcpy(&rec, aux->data + aux->pos % ring->size, sizeof(rec));
+    if (shm_check_lapped(h)) continue; // rec may be garbage
+
+    if (rec.len < sizeof(rec) || rec.len % SHM_RECORD_ALIGN || rec.len > ring->size || rec.nbytes + sizeof(rec) > rec.len)
+    {
+      fprintf(stderr,"shm: corrupt record at %lu\n", (unsigned long) aux->pos);
+      return -1;
+    }
+    if (!rec.nbytes)
+    {
+      aux->cur_len = rec.len;
+      shm_release(aux);
+      continue;
+    }
+    if (ring->broadcast)
+    {
+      if (rec.seq > aux->next_seq) h->packets_dropped += rec.seq - aux->next_seq;
+      aux->next_seq = rec.seq + 1;
+    }
+    aux->cur_len = rec.len;
+    aux->cur_end = sizeof(rec) + rec.nbytes;
+    aux->cur_pos = sizeof(rec);
+    return 1;
+  }
+}
+
+static int shm_readbytes(size_t nbytes, void * bytes, pueo_handle_t *h)
+{
+  struct shm_aux * aux = (struct shm_aux*) h->aux;
+  if (!nbytes) return 0; // (at the end of a record, this would otherwise wait for the next one)
+  while (true)
+  {
+    int r = shm_next(h);
+    if (r <= 0) return r;
+
+    // packets never straddle records, so this is as much as there is
+    uint32_t nleft = aux->cur_end - aux->cur_pos;
+    uint32_t ncopy = nleft < nbytes ? nleft : nbytes;
+    bool at_start = aux->cur_pos == sizeof(struct shm_record);
+    memcpy(bytes, aux->data + aux->pos % aux->ring->size + aux->cur_pos, ncopy);
+
+    // if it was overwritten while we copied, we can't use it. At the start of a packet, we can just move on to the next one.
+    if (shm_check_lapped(h))
+    {
+      if (at_start) continue;
+      return -1;
+    }
+    aux->cur_pos += ncopy;
+    return ncopy;
+  }
+}
+
+static int shm_viewbytes(size_t nbytes, const void ** bytes, pueo_handle_t *h)
+{
+  struct shm_aux * aux = (struct shm_aux*) h->aux;
+  if (!nbytes) return 0;
+  int r = shm_next(h);
+  if (r <= 0) return r;
+
+  uint32_t nleft = aux->cur_end - aux->cur_pos;
+  uint32_t nview = nleft < nbytes ? nleft : nbytes;
+  *bytes = aux->data + aux->pos % aux->ring->size + aux->cur_pos;
+  aux->cur_pos += nview;
+  return nview;
+}
+
+static int shm_close(pueo_handle_t *h)
+{
+  struct shm_aux * aux = (struct shm_aux*) h->aux;
+  if (!aux) return 0;
+  if (aux->writing)
+  {
+    atomic_store(&aux->ring->closed, 1);
+    atomic_fetch_add(&aux->ring->head_seq, 1);
+    futex_wake(&aux->ring->head_seq);
+  }
+  else if (aux->cur_len)
+  {
+    // anything partly read counts as read
+    shm_release(aux);
+  }
+
+  int r = munmap(aux->ring, aux->map_size);
+  if (aux->unlink_name)
+  {
+    shm_unlink(aux->unlink_name);
+    free(aux->unlink_name);
+  }
+  free(aux);
+  h->aux = NULL;
+  return r;
+}
+
+int pueo_handle_init_shm(pueo_handle_t *h, const char * name, const char * mode, const pueo_shm_opts_t * opts)
+{
+  memset(h, 0, sizeof(pueo_handle_t));
+
+  bool am_reading = !!strchr(mode,'r');
+  bool am_writing = !!strchr(mode,'w');
+  if (!(am_reading ^ am_writing))
+  {
+    fprintf(stderr,"pueo_handle_init_shm: mode must have one of r or w in it\n");
+    return -1;
+  }
+
+  pueo_shm_opts_t o = {0};
+  if (opts) o = *opts;
+  if (strchr(mode,'b')) o.broadcast = true;
+  uint64_t size = o.size > 0 ? ((uint64_t) o.size + 4095) & ~4095ull : 64 << 20;
+
+  char shm_name[256];
+  snprintf(shm_name, sizeof(shm_name), "%s%s", name[0] == '/' ? "" : "/", name);
+
+  int fd = am_writing ? shm_open(shm_name, O_RDWR | O_CREAT, 0666) : shm_open(shm_name, O_RDWR, 0);
+  if (fd < 0)
+  {
+    fprintf(stderr,"pueo_handle_init_shm: couldn't open %s (%s)\n", shm_name, strerror(errno));
+    return -1;
+  }
+
+  // the producer (re)creates the ring, consumers take whatever size it has
+  if (am_writing)
+  {
+    if (ftruncate(fd, 0) || ftruncate(fd, SHM_HEADER_SIZE + size))
+    {
+      fprintf(stderr,"pueo_handle_init_shm: couldn't size %s (%s)\n", shm_name, strerror(errno));
+      close(fd);
+      return -1;
+    }
+  }
+  else
+  {
+    struct stat st;
+    if (fstat(fd, &st) || st.st_size <= SHM_HEADER_SIZE)
+    {
+      fprintf(stderr,"pueo_handle_init_shm: %s isn't a ring (yet?)\n", shm_name);
+      close(fd);
+      return -1;
+    }
+    size = st.st_size - SHM_HEADER_SIZE;
+  }
+
+  size_t map_size = SHM_HEADER_SIZE + size;
+  void * mem = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (mem == MAP_FAILED)
+  {
+    fprintf(stderr,"pueo_handle_init_shm: couldn't map %s\n", shm_name);
+    return -1;
+  }
+
+  struct shm_ring * ring = mem;
+  if (am_writing)
+  {
+    // fresh from ftruncate, so all zero
+    ring->size = size;
+    ring->broadcast = o.broadcast;
+    atomic_store(&ring->magic, SHM_MAGIC);
+  }
+  else if (ring->magic != SHM_MAGIC || ring->size != size)
+  {
+    fprintf(stderr,"pueo_handle_init_shm: %s isn't a ring\n", shm_name);
+    munmap(mem, map_size);
+    return -1;
+  }
+
+  struct shm_aux * aux = calloc(1, sizeof(struct shm_aux));
+  aux->ring = ring;
+  aux->data = (uint8_t*) mem + SHM_HEADER_SIZE;
+  aux->map_size = map_size;
+  aux->writing = am_writing;
+  aux->block = o.block;
+  aux->at_packet_start = true;
+  if (o.unlink) aux->unlink_name = strdup(shm_name);
+
+  // single consumer picks up where the last one left off, broadcast consumers start with the next packet
+  if (am_reading && ring->broadcast)
+  {
+    aux->pos = atomic_load(&ring->head); // before packets, so we can't count a packet as missed
+    aux->next_seq = atomic_load(&ring->packets);
+  }
+  else if (am_reading)
+  {
+    aux->pos = atomic_load(&ring->tail);
+  }
+
+  h->aux = aux;
+  h->close = shm_close;
+  h->write_bytes = am_writing ? shm_writebytes : NULL;
+  h->done_write_packet = am_writing ? shm_done : NULL;
+  h->read_bytes = am_reading ? shm_readbytes : NULL;
+  h->view_bytes = am_reading ? shm_viewbytes : NULL;
+  asprintf(&h->description, "shm-%s://%s (%.1f MB%s)", mode, name, size / 1048576., ring->broadcast ? ", broadcast" : "");
+  return 0;
+}
+
+int pueo_handle_shm_stats(const pueo_handle_t *h, pueo_shm_stats_t * stats)
+{
+  if (h->close != shm_close) return -1;
+  const struct shm_aux * aux = (const struct shm_aux*) h->aux;
+  struct shm_ring * ring = aux->ring;
+  uint64_t head = atomic_load(&ring->head);
+  stats->size = ring->size;
+  stats->used = head - (aux->writing || !ring->broadcast ? atomic_load(&ring->tail) : aux->pos);
+  stats->packets = atomic_load(&ring->packets);
+  stats->overruns = atomic_load(&ring->overruns);
+  return 0;
+}
@@ -0,0 +1,296 @@
+#include "pueo/rawdata.h"
+#include "pueo/rawio.h"
+#include "pueo/encode.h"
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Round-trips waveforms through the codec: random ones of every amplitude and the edge cases
+ * (no samples, odd lengths, all zeros, stuck at the rails, noise that only fits raw), then the
+ * fixed-width packing at every width, then encoded waveforms written and read back through a
+ * memory handle. The lossy modes are checked to record exactly how far off they decode.
+ * Exits non-zero if anything doesn't come back as it went in.
+ */
+
+static int16_t samples[PUEO_MAX_BUFFER_LENGTH];
+static int16_t decoded[PUEO_MAX_BUFFER_LENGTH];
+static uint8_t encoded[2 * PUEO_MAX_BUFFER_LENGTH];
+
+// random samples of up to +/- amplitude around a slow wiggle, like a noisy waveform
+static void fill_random(int n, int amplitude)
+{
+  int32_t base = 0;
+  for (int i = 0; i < n; i++)
+  {
+    base += rand() % 5 - 2;
+    int32_t v = base + (amplitude ? rand() % (2 * amplitude + 1) - amplitude : 0);
+    samples[i] = v > INT16_MAX ? INT16_MAX : v < INT16_MIN ? INT16_MIN : v;
+  }
+}
+
+static void fill_constant(int n, int16_t v)
+{
+  for (int i = 0; i < n; i++) samples[i] = v;
+}
+
+// encodes and decodes n samples, checking the encoding used if want_encoding isn't negative
+static int roundtrip(const char * what, int n, int want_encoding)
+{
+  uint16_t flags = 0;
+  int nbytes = pueo_encode_samples(samples, n, encoded, sizeof(encoded), &flags);
+  if (nbytes < 0)
+  {
+    fprintf(stderr,"%s (%d samples): encoding failed\n", what, n);
+    return 1;
+  }
+  if (nbytes > n * (int) sizeof(int16_t))
+  {
+    fprintf(stderr,"%s (%d samples): encoded to %d bytes, more than raw\n", what, n, nbytes);
+    return 1;
+  }
+  if (want_encoding >= 0 && (flags & PUEO_ENCODING_MASK) != want_encoding)
+  {
+    fprintf(stderr,"%s (%d samples): encoded as %d, expected %d\n", what, n, flags & PUEO_ENCODING_MASK, want_encoding);
+    return 1;
+  }
+  memset(decoded, 0x55, sizeof(decoded));
+  if (pueo_decode_samples(encoded, nbytes, flags, decoded, n) != n || memcmp(samples, decoded, n * sizeof(int16_t)))
+  {
+    fprintf(stderr,"%s (%d samples): didn't decode to what was encoded\n", what, n);
+    return 1;
+  }
+  return 0;
+}
+
+static int test_samples(int * ntests)
+{
+  static const int lengths[] = { 0, 1, 2, 3, 31, 32, 33, 63, 65, 97, 255, 511, 513, 1023, 1024 };
+  const int nlengths = sizeof(lengths) / sizeof(*lengths);
+  int bad = 0;
+
+  for (int l = 0; l < nlengths; l++)
+  {
+    int n = lengths[l];
+    fill_constant(n, 0);
+    bad += roundtrip("all zeros", n, n ? PUEO_ENCODING_PACKED : -1);
+    // the first block pays for getting from 0 to the rail, so short ones are stored raw
+    fill_constant(n, INT16_MAX);
+    bad += roundtrip("stuck at 32767", n, n >= 64 ? PUEO_ENCODING_PACKED : -1);
+    fill_constant(n, -INT16_MAX);
+    bad += roundtrip("stuck at -32767", n, n >= 64 ? PUEO_ENCODING_PACKED : -1);
+    fill_constant(n, INT16_MIN);
+    bad += roundtrip("stuck at -32768", n, n >= 64 ? PUEO_ENCODING_PACKED : -1);
+
+    // flipping between the rails every sample, where the residuals wrap around
+    for (int i = 0; i < n; i++) samples[i] = i & 1 ? INT16_MAX : INT16_MIN;
+    bad += roundtrip("rail to rail", n, -1);
+
+    // full-scale noise doesn't compress, so it has to fall back to raw
+    for (int i = 0; i < n; i++) samples[i] = rand();
+    bad += roundtrip("full-scale noise", n, n > 2 ? PUEO_ENCODING_RAW : -1);
+
+    for (int amplitude = 0; amplitude <= 32768; amplitude = amplitude ? amplitude * 4 : 1)
+    {
+      for (int rep = 0; rep < 4; rep++)
+      {
+        fill_random(n, amplitude);
+        bad += roundtrip("random", n, -1);
+      }
+    }
+    *ntests += 6 + 9 * 4;
+  }
+
+  // and a pile of random lengths
+  for (int rep = 0; rep < 2000; rep++)
+  {
+    int n = rand() % (PUEO_MAX_BUFFER_LENGTH + 1);
+    fill_random(n, 1 << (rand() % 16));
+    bad += roundtrip("random length", n, -1);
+    (*ntests)++;
+  }
+
+  // the encoded bytes mustn't be trusted
+  fill_random(PUEO_MAX_BUFFER_LENGTH, 100);
+  uint16_t flags = 0;
+  int nbytes = pueo_encode_samples(samples, PUEO_MAX_BUFFER_LENGTH, encoded, sizeof(encoded), &flags);
+  if (nbytes <= 1 || pueo_decode_samples(encoded, nbytes - 1, flags, decoded, PUEO_MAX_BUFFER_LENGTH) >= 0 ||
+      pueo_decode_samples(encoded, nbytes, flags, decoded, PUEO_MAX_BUFFER_LENGTH + 1) >= 0)
+  {
+    fprintf(stderr,"truncated encoding wasn't caught\n");
+    bad++;
+  }
+  (*ntests)++;
+  return bad;
+}
+
+static int test_packing(int * ntests)
+{
+  int bad = 0;
+  uint8_t packed[2 * PUEO_MAX_BUFFER_LENGTH];
+  for (int width = 1; width <= 16; width++)
+  {
+    int32_t lo = -(1 << (width - 1)), hi = (1 << (width - 1)) - 1;
+    for (int rep = 0; rep < 50; rep++)
+    {
+      int n = rep < 40 ? rep : rand() % (PUEO_MAX_BUFFER_LENGTH + 1);
+      for (int i = 0; i < n; i++) samples[i] = i == 0 ? lo : i == 1 ? hi : lo + rand() % (hi - lo + 1);
+      if (n > 1 && pueo_pack_width(samples, n) != width)
+      {
+        fprintf(stderr,"width of %d samples from %d to %d came out as %d, not %d\n", n, (int) lo, (int) hi, pueo_pack_width(samples, n), width);
+        bad++;
+      }
+      int nbytes = (n * width + 7) / 8;
+      memset(packed, 0xaa, sizeof(packed));
+      memset(decoded, 0x55, sizeof(decoded));
+      if (pueo_pack_samples(samples, n, width, packed) != nbytes || packed[nbytes] != 0xaa ||
+          pueo_unpack_samples(packed, n, width, decoded) != nbytes || memcmp(samples, decoded, n * sizeof(int16_t)))
+      {
+        fprintf(stderr,"%d samples packed at width %d didn't come back\n", n, width);
+        bad++;
+      }
+      (*ntests)++;
+    }
+  }
+  return bad;
+}
+
+// the lossy error bound should be the real one, whatever the bits, step and decimation
+static int test_lossy(int * ntests)
+{
+  static const int bits[] = { 2, 3, 4, 6, 8, 10, 12, 16 };
+  static const int steps[] = { 0, 1, 3, 17, 200 };
+  static const int decimations[] = { 0, 1, 2, 3, 5, 8 };
+  static pueo_waveform_t wf, back;
+  static pueo_encoded_waveform_t enc;
+  int bad = 0;
+
+  for (size_t b = 0; b < sizeof(bits) / sizeof(*bits); b++)
+  for (size_t s = 0; s < sizeof(steps) / sizeof(*steps); s++)
+  for (size_t d = 0; d < sizeof(decimations) / sizeof(*decimations); d++)
+  for (int rep = 0; rep < 8; rep++)
+  {
+    pueo_quantize_opts_t opts = { .bits = bits[b], .step = steps[s], .decimation = decimations[d], .offset = rep & 1 ? rand() % 200 - 100 : 0 };
+    wf.channel_id = rep;
+    wf.length = rep == 0 ? 0 : rep == 1 ? 1 : rep == 2 ? PUEO_MAX_BUFFER_LENGTH : rand() % (PUEO_MAX_BUFFER_LENGTH + 1);
+    fill_random(wf.length, rep == 3 ? 32768 : 1 << (rep * 2));
+    memcpy(wf.data, samples, wf.length * sizeof(int16_t));
+
+    uint16_t flags = 0;
+    int reported = -1;
+    if (pueo_encode_waveform_lossy(&wf, &enc, &opts) < 0 ||
+        pueo_encode_samples_lossy(wf.data, wf.length, encoded, sizeof(encoded), &flags, &opts, &reported) < 0 ||
+        pueo_decode_waveform(&enc, &back) != wf.length)
+    {
+      fprintf(stderr,"lossy %d bits, step %d, decimation %d (%hu samples): didn't encode and decode\n", opts.bits, opts.step, opts.decimation, wf.length);
+      bad++;
+      continue;
+    }
+
+    int err = 0;
+    for (int i = 0; i < wf.length; i++)
+    {
+      int e = abs(back.data[i] - wf.data[i]);
+      if (e > err) err = e;
+    }
+    int stored = pueo_encoded_waveform_max_error(&enc);
+    if (stored != err || reported != err)
+    {
+      fprintf(stderr,"lossy %d bits, step %d, decimation %d (%hu samples): max error is %d, but %d is stored and %d reported\n",
+              opts.bits, opts.step, opts.decimation, wf.length, err, stored, reported);
+      bad++;
+    }
+    (*ntests)++;
+  }
+
+  // the options go by signal level, which is kept in the flags
+  static pueo_single_waveform_t swf;
+  pueo_quantize_opts_t by_level[4] = { { .bits = 4 }, { .bits = 8, .decimation = 2 }, { .bits = 12 }, { 0 } };
+  for (int level = 0; level < 4; level++)
+  {
+    memset(&swf, 0, sizeof(swf));
+    swf.prio.signal_level = level;
+    swf.wf.length = PUEO_MAX_BUFFER_LENGTH;
+    fill_random(swf.wf.length, 1000);
+    memcpy(swf.wf.data, samples, swf.wf.length * sizeof(int16_t));
+    int want = pueo_encode_samples_lossy(swf.wf.data, swf.wf.length, encoded, sizeof(encoded), &(uint16_t){0}, &by_level[level], NULL);
+    if (pueo_encode_single_waveform_by_priority(&swf, &enc, by_level) != want || enc.flags != level ||
+        ((enc.encoded_flags & PUEO_ENCODING_MASK) == PUEO_ENCODING_QUANTIZED) != (level < 3))
+    {
+      fprintf(stderr,"signal level %d wasn't encoded with its options\n", level);
+      bad++;
+    }
+    (*ntests)++;
+  }
+  return bad;
+}
+
+static int test_packets(int * ntests)
+{
+  pueo_handle_t h;
+  if (pueo_handle_init_mem(&h, 0))
+  {
+    fprintf(stderr,"couldn't make a memory handle\n");
+    return 1;
+  }
+
+  const int npackets = 200;
+  static pueo_single_waveform_t in[200], out;
+  static pueo_encoded_waveform_t enc, back;
+  int bad = 0;
+
+  for (int i = 0; i < npackets; i++)
+  {
+    memset(&in[i], 0, sizeof(in[i]));
+    in[i].run = 1234;
+    in[i].event = i;
+    in[i].readout_time.utc_secs = 1700000000 + i;
+    in[i].wf.channel_id = i % 224;
+    in[i].wf.length = i < 3 ? i : rand() % (PUEO_MAX_BUFFER_LENGTH + 1);
+    if (i % 10 == 9) for (int j = 0; j < in[i].wf.length; j++) in[i].wf.data[j] = rand();
+    else
+    {
+      fill_random(in[i].wf.length, 1 << (i % 12));
+      memcpy(in[i].wf.data, samples, in[i].wf.length * sizeof(int16_t));
+    }
+
+    if (pueo_encode_single_waveform(&in[i], &enc) < 0 || pueo_write_encoded_waveform(&h, &enc) <= 0)
+    {
+      fprintf(stderr,"couldn't encode and write waveform %d\n", i);
+      bad++;
+    }
+  }
+
+  for (int i = 0; i < npackets; i++)
+  {
+    memset(&back, 0, sizeof(back));
+    if (pueo_read_encoded_waveform(&h, &back) <= 0 || pueo_decode_single_waveform(&back, &out) != in[i].wf.length)
+    {
+      fprintf(stderr,"couldn't read back waveform %d\n", i);
+      bad++;
+      break;
+    }
+    if (out.run != in[i].run || out.event != in[i].event || out.readout_time.utc_secs != in[i].readout_time.utc_secs ||
+        out.wf.channel_id != in[i].wf.channel_id || memcmp(out.wf.data, in[i].wf.data, in[i].wf.length * sizeof(int16_t)))
+    {
+      fprintf(stderr,"waveform %d (%hu samples) didn't come back as written\n", i, in[i].wf.length);
+      bad++;
+    }
+  }
+  *ntests += npackets;
+
+  pueo_handle_close(&h);
+  return bad;
+}
+
+int main(int nargs, char ** args)
+{
+  srand(nargs > 1 ? atoi(args[1]) : 1234);
+  int ntests = 0, bad = 0;
+  bad += test_samples(&ntests);
+  bad += test_packing(&ntests);
+  bad += test_lossy(&ntests);
+  bad += test_packets(&ntests);
+  printf("encode-roundtrip: %d tests, %d bad\n", ntests, bad);
+  return bad ? 1 : 0;
+}
@@ -27,22 +27,16 @@ int main(int nargs, char ** args)
     pueo_handle_t h;
     pueo_handle_init(&h, args[i], "r");
 
-    pueo_packet_t * packet = 0;
+    // no need to decode anything, just skip to the ith header
     int i = 0;
-    while (i <= ith)
+    while (i < ith && pueo_ll_skip(&h) >= 0) i++;
+
+    const pueo_packet_head_t * head = i == ith ? pueo_ll_peek(&h) : NULL;
+    if (head)
     {
-      int read = pueo_ll_read_realloc(&h, &packet);
-      if (read <= 0) break;
-
-      if (i == ith)
-      {
-        printf("%s ", pueo_packet_name(packet));
-      }
-      free(packet);
-      packet = 0;
-      i++;
+      printf("%s ", pueo_type_name(head->type));
     }
-
+    pueo_handle_close(&h);
   }
   printf("\n");
 
@@ -10,6 +10,7 @@
 #include <unistd.h>
 
 #include <stdlib.h>
+#include <string.h>
 
 int is_directory(const char* path)
 {
@@ -21,7 +22,24 @@ int is_directory(const char* path)
 int main(int nargs, char ** args)
 {
   pueo_handle_t h;
-  pueo_handle_init(&h, nargs > 1 ? args[1] : "test.wfs","r");
+  const char * inpath = nargs > 1 ? args[1] : "test.wfs";
+  if (pueo_handle_init(&h, inpath,"r"))
+  {
+    fprintf(stderr,"Couldn't open %s\n", inpath);
+    return 1;
+  }
+
+  // for files, read (and decompress) ahead on another thread while we dump
+  if (!strstr(inpath, "://"))
+  {
+    pueo_handle_t file = h;
+    if (pueo_handle_init_prefetch(&h, &file, NULL))
+    {
+      fprintf(stderr,"Couldn't start reading ahead from %s\n", inpath);
+      pueo_handle_close(&file);
+      return 1;
+    }
+  }
   char* outpath = NULL;
 
   pueo_db_handle_t * db = NULL;
@@ -34,46 +52,44 @@ int main(int nargs, char ** args)
     }
   }
 
+  pueo_handle_t hout;
   if (nargs > 3)
   {
     outpath = args[3];
+    if(is_directory(outpath)) {
+      // We're given a directory, so write a series of files there
+      char* prefix = NULL;
+      asprintf(&prefix,"%s/", outpath);
+      pueo_rotate_opts_t opts = { .max_packets = 10000 };
+      pueo_handle_init_rotate(&hout, prefix, &opts);
+      free(prefix);
+    }
+    else {
+      // We're given a full filename, append to that location
+      pueo_handle_init(&hout, outpath, "a");
+    }
   }
 
-  pueo_packet_t * packet = 0;
+  // read in batches, reusing the same memory for all of them. Capped by size too, since
+  // 256 unpacked full waveforms packets would take over 100 MB
+  pueo_packet_arena_t arena = {0};
   printf("{\n");
-  while (true)
+  while (pueo_ll_read_batch(&h, &arena, 256, 4 << 20) > 0)
   {
-    int read = pueo_ll_read_realloc(&h, &packet);
-    if (read <= 0) break;
-    pueo_dump_packet(stdout,packet);
-    if (db) pueo_db_insert_packet(db, packet);
-
-    if (outpath) {
-      char* ofile = NULL;
-      char* mode = NULL;
+    for (int i = 0; i < arena.npackets; i++)
+    {
+      pueo_packet_t * packet = pueo_packet_arena_get(&arena, i);
+      pueo_dump_packet(stdout,packet);
+      if (db) pueo_db_insert_packet(db, packet);
 
-      if(is_directory(outpath)) {
-        // We're given a directory, so make up a filename
-        struct timespec now;
-        clock_gettime(CLOCK_REALTIME,&now);
-        asprintf(&ofile,"%s/%d.%09d.dat", outpath, now.tv_sec, now.tv_nsec);
-        asprintf(&mode, "w");
+      if (outpath) {
+        pueo_ll_write(&hout, packet->head.type, packet->payload);
       }
-      else {
-        // We're given a full filename, append to that location
-        ofile = outpath;
-        asprintf(&mode, "a");
-      };
-
-      pueo_handle_t hout;
-      pueo_handle_init(&hout, ofile, mode);
-      pueo_ll_write(&hout, packet->head.type, packet->payload);
-      pueo_handle_close(&hout);
-    } 
-    free(packet);
-    packet = 0;
+    }
   }
+  pueo_packet_arena_free(&arena);
   printf("}\n");
+  if (outpath) pueo_handle_close(&hout);
   return 0;
 }
 
@@ -0,0 +1,154 @@
+#include "pueo/rawdata.h"
+#include "pueo/rawio.h"
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Damages a stream of packets and reads it back through pueo_handle_init_resync: garbage
+ * between two packets, a payload that no longer matches its checksum, a header without its
+ * marker and a truncated last packet. Everything else should come through in order, and the
+ * skipped bytes and stretches of damage should add up (both in the stats and the callback).
+ * Exits non-zero if they don't.
+ */
+
+#define NPACKETS 40
+#define GARBAGE_BEFORE 3   // garbage goes in before this packet
+#define GARBAGE_LEN 37
+#define BAD_CRC 5          // a payload byte of this one is flipped
+#define BAD_MARKER 8       // and this one loses its 0xf1
+
+static size_t offsets[NPACKETS + 1]; // where each packet starts in the undamaged stream (and where it ends)
+
+struct skip
+{
+  uint64_t offset;
+  size_t nskipped;
+};
+static struct skip skips[16];
+static int nskips;
+
+static void on_skip(uint64_t offset, size_t nskipped, void * arg)
+{
+  (void) arg;
+  if (nskips < 16) skips[nskips] = (struct skip) { offset, nskipped };
+  nskips++;
+}
+
+static void fill(pueo_logs_t * l, int i)
+{
+  memset(l, 0, sizeof(*l));
+  l->utc_retrieved = 1700000000 + i;
+  l->msg_len = 1 + (i * 97) % 1000;
+  for (int j = 0; j < l->msg_len; j++) l->buf[j] = 'a' + (i + j) % 26;
+}
+
+int main()
+{
+  pueo_handle_t mem;
+  static pueo_logs_t in, out;
+  if (pueo_handle_init_mem(&mem, 0))
+  {
+    fprintf(stderr,"couldn't make a memory handle\n");
+    return 1;
+  }
+  for (int i = 0; i < NPACKETS; i++)
+  {
+    pueo_handle_mem_data(&mem, &offsets[i]);
+    fill(&in, i);
+    if (pueo_write_logs(&mem, &in) <= 0)
+    {
+      fprintf(stderr,"couldn't write packet %d\n", i);
+      return 1;
+    }
+  }
+  size_t len;
+  const uint8_t * clean = pueo_handle_mem_data(&mem, &len);
+  offsets[NPACKETS] = len;
+
+  // the damaged copy: garbage inserted, two packets spoiled and the last one cut off halfway
+  size_t tail_kept = (offsets[NPACKETS] - offsets[NPACKETS-1]) / 2;
+  size_t damaged_len = len + GARBAGE_LEN - (offsets[NPACKETS] - offsets[NPACKETS-1] - tail_kept);
+  uint8_t * damaged = malloc(damaged_len);
+  size_t at = offsets[GARBAGE_BEFORE];
+  memcpy(damaged, clean, at);
+  srand(1234);
+  for (int i = 0; i < GARBAGE_LEN; i++) damaged[at + i] = i == 10 ? 0xf1 : rand(); // with a stray marker for good measure
+  memcpy(damaged + at + GARBAGE_LEN, clean + at, damaged_len - at - GARBAGE_LEN);
+  damaged[offsets[BAD_CRC] + GARBAGE_LEN + sizeof(pueo_packet_head_t) + offsetof(pueo_logs_t, buf)] ^= 0xff;
+  damaged[offsets[BAD_MARKER] + GARBAGE_LEN + offsetof(pueo_packet_head_t, cksum) + sizeof(uint16_t)] = 0xf0; // f1 comes right after
+
+  pueo_handle_t inner, h;
+  pueo_resync_opts_t opts = { .callback = on_skip };
+  if (pueo_handle_init_mem_span(&inner, damaged, damaged_len) || pueo_handle_init_resync(&h, &inner, &opts))
+  {
+    fprintf(stderr,"couldn't open the damaged stream\n");
+    return 1;
+  }
+
+  int bad = 0, nread = 0;
+  for (int i = 0; i < NPACKETS; i++)
+  {
+    if (i == BAD_CRC || i == BAD_MARKER || i == NPACKETS - 1) continue;
+    fill(&in, i);
+    memset(&out, 0, sizeof(out));
+    if (pueo_read_logs(&h, &out) <= 0 || out.utc_retrieved != in.utc_retrieved || out.msg_len != in.msg_len || memcmp(out.buf, in.buf, in.msg_len))
+    {
+      fprintf(stderr,"packet %d didn't come through\n", i);
+      bad++;
+      break;
+    }
+    nread++;
+  }
+  if (!bad && pueo_read_logs(&h, &out) > 0)
+  {
+    fprintf(stderr,"the truncated packet came through\n");
+    bad++;
+  }
+
+  // what should have been skipped, where it starts in the damaged stream and how long it is
+  const struct skip want[] =
+  {
+    { offsets[GARBAGE_BEFORE], GARBAGE_LEN },
+    { offsets[BAD_CRC] + GARBAGE_LEN, offsets[BAD_CRC+1] - offsets[BAD_CRC] },
+    { offsets[BAD_MARKER] + GARBAGE_LEN, offsets[BAD_MARKER+1] - offsets[BAD_MARKER] },
+    { offsets[NPACKETS-1] + GARBAGE_LEN, tail_kept },
+  };
+  const int nwant = sizeof(want) / sizeof(*want);
+  uint64_t want_skipped = 0;
+  for (int i = 0; i < nwant; i++) want_skipped += want[i].nskipped;
+
+  pueo_resync_stats_t stats;
+  if (pueo_handle_resync_stats(&h, &stats) || stats.bytes_skipped != want_skipped || stats.resyncs != (uint64_t) nwant)
+  {
+    fprintf(stderr,"stats say %lu bytes skipped in %lu stretches, expected %lu in %d\n",
+            (unsigned long) stats.bytes_skipped, (unsigned long) stats.resyncs, (unsigned long) want_skipped, nwant);
+    bad++;
+  }
+  if (nskips != nwant)
+  {
+    fprintf(stderr,"callback called %d times, expected %d\n", nskips, nwant);
+    bad++;
+  }
+  for (int i = 0; i < nskips && i < nwant; i++)
+  {
+    if (skips[i].offset != want[i].offset || skips[i].nskipped != want[i].nskipped)
+    {
+      fprintf(stderr,"skip %d was %zu bytes at %lu, expected %zu at %lu\n", i,
+              skips[i].nskipped, (unsigned long) skips[i].offset, want[i].nskipped, (unsigned long) want[i].offset);
+      bad++;
+    }
+  }
+  if (pueo_handle_resync_stats(&mem, &stats) != -1)
+  {
+    fprintf(stderr,"got resync stats for a memory handle\n");
+    bad++;
+  }
+
+  printf("resync: %d of %d packets read, %lu bytes skipped in %lu stretches, %d bad\n",
+         nread, NPACKETS, (unsigned long) stats.bytes_skipped, (unsigned long) stats.resyncs, bad);
+  pueo_handle_close(&h);
+  pueo_handle_close(&mem);
+  free(damaged);
+  return bad ? 1 : 0;
+}
@@ -0,0 +1,80 @@
+#include "pueo/rawdata.h"
+#include "pueo/rawio.h"
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* Exercises the wrap-around of a small shared-memory ring: packets of all sorts of sizes are
+ * written one at a time and read back right away, so the gap left at the end of the ring
+ * takes every possible size. Both the single-reader and the broadcast ring are tried.
+ * Exits non-zero if any packet doesn't come back as written.
+ */
+
+static int fill(pueo_logs_t * l, int i, int payload)
+{
+  memset(l, 0, sizeof(*l));
+  l->utc_retrieved = i;
+  l->msg_len = payload - offsetof(pueo_logs_t, buf);
+  for (int j = 0; j < l->msg_len; j++) l->buf[j] = 'a' + (i + j) % 26;
+  return payload;
+}
+
+static int exercise(const char * name, bool broadcast, int npackets)
+{
+  pueo_shm_opts_t opts = { .size = 4096, .broadcast = broadcast, .unlink = true };
+  pueo_handle_t w, r;
+  if (pueo_handle_init_shm(&w, name, "w", &opts))
+  {
+    fprintf(stderr,"couldn't create ring %s\n", name);
+    return 1;
+  }
+  if (pueo_handle_init_shm(&r, name, "r", NULL))
+  {
+    fprintf(stderr,"couldn't open ring %s\n", name);
+    pueo_handle_close(&w);
+    return 1;
+  }
+
+  static pueo_logs_t in, out;
+  int bad = 0;
+  srand(1234);
+  for (int i = 0; i < npackets; i++)
+  {
+    // the sizes from the original report first, then anything up to a third of the ring
+    static const int first[] = { 1344, 1336, 1336, 8 + offsetof(pueo_logs_t, buf) };
+    int payload = i < 4 ? first[i] : (int) offsetof(pueo_logs_t, buf) + rand() % 1300;
+    fill(&in, i, payload);
+
+    if (pueo_write_logs(&w, &in) <= 0)
+    {
+      fprintf(stderr,"%s: write %d (payload %d) failed\n", name, i, payload);
+      bad++;
+      break;
+    }
+    if (pueo_read_logs(&r, &out) <= 0 || out.utc_retrieved != in.utc_retrieved || out.msg_len != in.msg_len || memcmp(out.buf, in.buf, in.msg_len))
+    {
+      fprintf(stderr,"%s: packet %d (payload %d) didn't come back\n", name, i, payload);
+      bad++;
+    }
+  }
+
+  printf("%s: %d packets, %d bad, %lu dropped\n", name, npackets, bad, (unsigned long) (w.packets_dropped + r.packets_dropped));
+  pueo_handle_close(&r);
+  pueo_handle_close(&w);
+  return bad;
+}
+
+int main(int nargs, char ** args)
+{
+  int npackets = nargs > 1 ? atoi(args[1]) : 20000;
+  char name[64];
+  int bad = 0;
+
+  snprintf(name, sizeof(name), "pueo-shm-wrap-%d", (int) getpid());
+  bad += exercise(name, false, npackets);
+  snprintf(name, sizeof(name), "pueo-shm-wrap-b-%d", (int) getpid());
+  bad += exercise(name, true, npackets);
+  return bad ? 1 : 0;
+}
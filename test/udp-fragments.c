@@ -0,0 +1,162 @@
+#include "pueo/rawdata.h"
+#include "pueo/rawio.h"
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+/* Sends full-waveforms packets, which are too big for one datagram, over loopback UDP and
+ * checks they come back byte for byte (written out again, they're the same as what was sent). The writer sends to a relay socket here, which
+ * passes the datagrams on to the reader, except for one fragment of one packet, which it
+ * throws away: that packet should never show up, and should be counted in packets_dropped.
+ * Exits non-zero if anything doesn't come back as written.
+ */
+
+#define FRAG_MARKER_OFFSET 4 // where a fragment has 0xf2 (and a packet header 0xf1)
+#define FRAG_INDEX_OFFSET 5
+#define UDP_MAX 65507 // the biggest datagram
+
+static uint8_t dgram[65536];
+
+// passes on whatever the writer has sent so far (on loopback, it's already here), dropping fragment drop_index if it's not negative
+static int relay(int sock, const struct sockaddr_in * to, int drop_index)
+{
+  int ndropped = 0;
+  while (true)
+  {
+    ssize_t n = recv(sock, dgram, sizeof(dgram), MSG_DONTWAIT);
+    if (n < 0) return errno == EAGAIN || errno == EWOULDBLOCK ? ndropped : -1;
+    if (drop_index >= 0 && n > FRAG_INDEX_OFFSET && dgram[FRAG_MARKER_OFFSET] == 0xf2 && dgram[FRAG_INDEX_OFFSET] == drop_index)
+    {
+      ndropped++;
+      continue;
+    }
+    if (sendto(sock, dgram, n, 0, (const struct sockaddr*) to, sizeof(*to)) != n) return -1;
+  }
+}
+
+static void fill(pueo_full_waveforms_t * fw, int event, int length)
+{
+  memset(fw, 0, sizeof(*fw));
+  fw->run = 42;
+  fw->event = event;
+  fw->readout_time.utc_secs = 1700000000 + event;
+  for (int ichan = 0; ichan < PUEO_NCHAN; ichan++)
+  {
+    fw->wfs[ichan].channel_id = ichan;
+    fw->wfs[ichan].length = length;
+    for (int i = 0; i < length; i++) fw->wfs[ichan].data[i] = rand() % 2048 - 1024;
+  }
+}
+
+int main(int nargs, char ** args)
+{
+  int npackets = nargs > 1 ? atoi(args[1]) : 20;
+  alarm(30); // the reader blocks, so don't hang forever if a packet goes missing
+
+  // the relay gets whatever port is free
+  int sock = socket(AF_INET, SOCK_DGRAM, 0);
+  struct sockaddr_in relay_addr = { .sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+  socklen_t addrlen = sizeof(relay_addr);
+  int bufsize = 4 << 20;
+  setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &bufsize, sizeof(bufsize));
+  if (sock < 0 || bind(sock, (struct sockaddr*) &relay_addr, sizeof(relay_addr)) ||
+      getsockname(sock, (struct sockaddr*) &relay_addr, &addrlen))
+  {
+    fprintf(stderr,"couldn't make the relay socket\n");
+    return 1;
+  }
+
+  // the reader has to be told a port, so look for one that's free
+  pueo_handle_t r, w, sent, got;
+  // with one reassembly slot, the next packet pushes out the one that can't be completed
+  pueo_udp_opts_t ropts = { .bufsize = 4 << 20, .reassembly_slots = 1 };
+  int port = 20000 + getpid() % 20000;
+  int tries = 0;
+  while (pueo_handle_init_udp_opts(&r, port, "127.0.0.1", "r", &ropts))
+  {
+    if (++tries == 100)
+    {
+      fprintf(stderr,"couldn't find a port to read from\n");
+      return 1;
+    }
+    port = 20000 + (port + 1) % 20000;
+  }
+  struct sockaddr_in reader_addr = { .sin_family = AF_INET, .sin_port = htons(port), .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+
+  if (pueo_handle_init_udp_opts(&w, ntohs(relay_addr.sin_port), "127.0.0.1", "w", NULL) || pueo_handle_init_mem(&sent, 0) || pueo_handle_init_mem(&got, 0))
+  {
+    fprintf(stderr,"couldn't open the writer\n");
+    return 1;
+  }
+
+  static pueo_full_waveforms_t fw, back;
+  int bad = 0, nread = 0;
+  int lost = npackets / 2; // the one with a fragment missing
+  srand(1234);
+
+  for (int i = 0; i < npackets && !bad; i++)
+  {
+    fill(&fw, i, i == 0 ? PUEO_MAX_BUFFER_LENGTH : 200 + rand() % (PUEO_MAX_BUFFER_LENGTH - 199));
+    pueo_handle_mem_reset(&sent);
+    size_t len = 0;
+    const uint8_t * written = NULL;
+    if (pueo_write_full_waveforms(&w, &fw) <= 0 || pueo_write_full_waveforms(&sent, &fw) <= 0 ||
+        !(written = pueo_handle_mem_data(&sent, &len)) || len <= UDP_MAX)
+    {
+      fprintf(stderr,"packet %d: couldn't write it (or it fits in a datagram)\n", i);
+      bad++;
+      break;
+    }
+
+    if (i == lost)
+    {
+      if (relay(sock, &reader_addr, 1) != 1)
+      {
+        fprintf(stderr,"packet %d: didn't find the fragment to drop\n", i);
+        bad++;
+      }
+      continue;
+    }
+
+    if (relay(sock, &reader_addr, -1) < 0)
+    {
+      fprintf(stderr,"packet %d: relay failed\n", i);
+      bad++;
+      break;
+    }
+
+    // the reader should get exactly this one next
+    memset(&back, 0, sizeof(back));
+    pueo_handle_mem_reset(&got);
+    size_t nback = 0;
+    const uint8_t * reread = NULL;
+    if (pueo_read_full_waveforms(&r, &back) <= 0 || pueo_write_full_waveforms(&got, &back) <= 0 ||
+        !(reread = pueo_handle_mem_data(&got, &nback)) || nback != len || memcmp(reread, written, len))
+    {
+      fprintf(stderr,"packet %d (%zu bytes) didn't come back as written\n", i, len);
+      bad++;
+      continue;
+    }
+    nread++;
+
+    uint64_t want_dropped = i > lost ? 1 : 0;
+    if (r.packets_dropped != want_dropped)
+    {
+      fprintf(stderr,"after packet %d: %lu dropped, expected %lu\n", i, (unsigned long) r.packets_dropped, (unsigned long) want_dropped);
+      bad++;
+    }
+  }
+
+  printf("udp-fragments: %d packets, %d read, %d bad, %lu dropped\n", npackets, nread, bad, (unsigned long) r.packets_dropped);
+  pueo_handle_close(&got);
+  pueo_handle_close(&sent);
+  pueo_handle_close(&w);
+  pueo_handle_close(&r);
+  close(sock);
+  return bad ? 1 : 0;
+}